@@ -0,0 +1,183 @@
+//
+//  ADCSampler.h
+//
+//  Interrupt driven ADC sampling into per-channel ring buffers
+//
+
+#pragma once
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <avr/sleep.h>
+
+#include "RingBuffer.h"
+
+//
+// The ADC runs in auto trigger mode. Each conversion complete interrupt stores
+// the raw 10 bit result in the ring buffer of the channel it was taken on and
+// rotates the mux to the next channel, so the sample rate does not depend on
+// how busy the event loop is. The loop drains the buffers at its leisure.
+//
+// With the Timer0Overflow trigger, conversions start on each overflow of the
+// TimerEventMgr's Timer0 (F_CPU / 64 / 256 = 976.5Hz at 16MHz), giving every
+// channel a rate of 976.5 / NumChannels Hz. FreeRunning converts back to back
+// at F_CPU / 128 / 13 (9615Hz at 16MHz) and needs a loop that keeps up with it.
+//
+// With the Sleep trigger there is no auto triggering. Each convertAsleep()
+// call puts the CPU into ADC noise reduction sleep, which starts a conversion
+// on the next channel with the CPU and I/O clocks stopped, and the conversion
+// complete interrupt wakes it up again. Timers, TWI and the USART stop along
+// with the I/O clock, so the caller picks a moment when that does no harm,
+// or uses convertAwake() instead.
+//
+// In free running mode the next conversion has already started (using the old
+// mux setting) by the time the interrupt fires, so a mux change only takes
+// effect one conversion later. _resultChannel tracks the channel the pending
+// result belongs to and _muxChannel the one that was last written to ADMUX.
+//
+// sampleBandgap() asks for a conversion of the internal 1.1V bandgap against
+// AVCC, which is how AVCC itself is measured. It goes in after the current
+// round of the channels: the mux is switched to the bandgap and the first
+// conversion after that is thrown away, as the input takes longer than one
+// to settle, then the next is kept for readBandgap() and the rotation starts
+// again from channel 0. It isn't taken in free running mode.
+//
+
+template<uint8_t NumChannels, uint8_t BufferSize>
+class ADCSampler {
+    static_assert(NumChannels > 0 && NumChannels <= 8, "ADCSampler supports channels 0-7");
+
+public:
+    static const uint8_t BandgapMux = 0x0e;
+
+    // 13 ADC clocks at F_CPU / 128, which is all convertAsleep() stops the
+    // I/O clock for
+    static const uint16_t ConversionUs = 13UL * 128 * 1000000 / F_CPU;
+
+    enum class Trigger : uint8_t { FreeRunning = 0, Timer0Overflow = _BV(ADTS2), Sleep = 0xff };
+
+    void start(Trigger trigger)
+    {
+        _pipelined = trigger == Trigger::FreeRunning;
+        _resultChannel = 0;
+        _muxChannel = 0;
+        _bandgap = Bandgap::Idle;
+
+        // Digital input buffers just add noise and current on analog pins
+        DIDR0 |= (1 << NumChannels) - 1;
+        ADMUX = _BV(REFS0);
+        if (trigger == Trigger::Sleep) {
+            ADCSRB = 0;
+            ADCSRA = _BV(ADEN) | _BV(ADIE) | _BV(ADIF) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+            return;
+        }
+        ADCSRB = static_cast<uint8_t>(trigger);
+        ADCSRA = _BV(ADEN) | _BV(ADATE) | _BV(ADIE) | _BV(ADIF) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0);
+        if (_pipelined) {
+            ADCSRA |= _BV(ADSC);
+        }
+    }
+
+    void stop()
+    {
+        ADCSRA &= ~(_BV(ADATE) | _BV(ADIE));
+    }
+
+    bool converting() const { return ADCSRA & _BV(ADSC); }
+
+    // Sleep trigger only. Call with interrupts off, so that nothing can
+    // change between the caller's checks and going to sleep; they're turned
+    // on just before the sleep instruction. Returns when the CPU wakes up,
+    // which is normally when the conversion completes. Any other wake up
+    // source (e.g. EEPROM ready) lets the conversion finish with the CPU
+    // running.
+    void convertAsleep()
+    {
+        set_sleep_mode(SLEEP_MODE_ADC);
+        sleep_enable();
+        sei();
+        sleep_cpu();
+        sleep_disable();
+    }
+
+    // Sleep trigger only. Starts the same conversion with the CPU and I/O
+    // clock running, for when they can't stop. It's noisier. Writing ADIF
+    // back as a one would clear a result the interrupt hasn't taken yet.
+    void convertAwake()
+    {
+        ADCSRA = (ADCSRA & ~_BV(ADIF)) | _BV(ADSC);
+    }
+
+    // Called from the event loop. Returns false when the channel has no samples
+    bool read(uint8_t channel, uint16_t& sample) { return _samples[channel].pop(sample); }
+
+    // Ignored while one is still waiting to be read
+    void sampleBandgap()
+    {
+        if (_bandgap == Bandgap::Idle) {
+            _bandgap = Bandgap::Wanted;
+        }
+    }
+
+    // Returns false until the conversion asked for is done. The interrupt
+    // leaves the sample alone until it's been read.
+    bool readBandgap(uint16_t& sample)
+    {
+        if (_bandgap != Bandgap::Ready) {
+            return false;
+        }
+        sample = _bandgapSample;
+        _bandgap = Bandgap::Idle;
+        return true;
+    }
+
+    // Number of samples lost because the loop didn't drain the buffers in time
+    uint8_t overruns() const { return _overruns; }
+
+    // Called from ISR(ADC_vect)
+    void handleInterrupt()
+    {
+        uint16_t sample = ADCW;
+        if (_bandgap == Bandgap::Settling) {
+            _bandgap = Bandgap::Converting;
+            return;
+        }
+        if (_bandgap == Bandgap::Converting) {
+            _bandgapSample = sample;
+            _bandgap = Bandgap::Ready;
+            ADMUX = _BV(REFS0) | _muxChannel;
+            return;
+        }
+        if (!_samples[_resultChannel].push(sample) && _overruns != 0xff) {
+            ++_overruns;
+        }
+
+        if (_pipelined) {
+            _resultChannel = _muxChannel;
+        }
+        if (++_muxChannel >= NumChannels) {
+            _muxChannel = 0;
+            if (_bandgap == Bandgap::Wanted && !_pipelined) {
+                _bandgap = Bandgap::Settling;
+                _resultChannel = 0;
+                ADMUX = _BV(REFS0) | BandgapMux;
+                return;
+            }
+        }
+        ADMUX = _BV(REFS0) | _muxChannel;
+        if (!_pipelined) {
+            _resultChannel = _muxChannel;
+        }
+    }
+
+private:
+    enum class Bandgap : uint8_t { Idle, Wanted, Settling, Converting, Ready };
+
+    RingBuffer<uint16_t, BufferSize> _samples[NumChannels];
+    uint8_t _resultChannel = 0;
+    uint8_t _muxChannel = 0;
+    uint8_t _overruns = 0;
+    bool _pipelined = false;
+    Bandgap _bandgap = Bandgap::Idle;
+    uint16_t _bandgapSample = 0;
+};
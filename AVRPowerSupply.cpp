@@ -6,17 +6,34 @@
 
 #include "m8r.h"
 
-#include "ADC.h"
-#include "Button.h"
-#include "DeviceStream.h"
+#include "ADCSampler.h"
+#include "AdaptivePoller.h"
+#include "AnalogFilter.h"
+#include "AsyncINA219.h"
+#include "BurstCapture.h"
+#include "ButtonDebouncer.h"
+#include "Calibration.h"
+#include "CommandInterpreter.h"
+#include "ErrorQueue.h"
 #include "EventListener.h"
-#include "FixedPoint.h"
-#include "INA219.h"
-#include "Menu.h"
+#include "HD44780.h"
+#include "LCDFrameBuffer.h"
+#include "OvercurrentMonitor.h"
+#include "Oversampler.h"
+#include "Profiler.h"
+#include "Scaling.h"
+#include "SerialPort.h"
+#include "SettingsStore.h"
+#include "StackMonitor.h"
+#include "StateMenu.h"
+#include "SupplyChannels.h"
 #include "System.h"
-#include "TextLCD.h"
+#include "TaskScheduler.h"
+#include "Telemetry.h"
+#include "TextStream.h"
 #include "Timer0.h"
 #include "TimerEventMgr.h"
+#include "Watchdog.h"
 
 //
 //  AVR Based Power Supply
@@ -46,6 +63,7 @@
 // SCL              - Port C5
 // ShutdownA (var)  - Port D6
 // ShutdownA (sw)   - Port D7
+// Serial RX/TX     - Port D0/D1
 // Analog In        - Port C0 - C3
 // Switches         - Port B0 - B2
 //
@@ -66,10 +84,358 @@ using namespace m8r;
 #define Switch1 DynamicInputBit<B, 1>
 #define Switch2 DynamicInputBit<B, 2>
 
-const uint8_t ADCAverageCount = 16;
+const uint8_t ADCNumChannels = 4;
+const uint8_t ADCBufferSize = 8;
+
+typedef ADCSampler<ADCNumChannels, ADCBufferSize> MyADCSampler;
+
+// AVCC is the reference for the analog inputs, and it's whatever the USB
+// port gives, so it's measured. A conversion of the internal bandgap goes
+// in with the inputs' on every sensor poll, and each MyBandgapOversampler
+// value of those gives a new AVCC, 0.4s apart. The bandgap is only good to
+// 10% from chip to chip, so it's calibrated like the inputs, see below.
+// ADCRefMilliVolts is what's assumed until then, and a measurement outside
+// AVCCMinMilliVolts-AVCCMaxMilliVolts is taken as a bad one.
+const uint16_t ADCRefMilliVolts = 5000;
+const uint16_t BandgapMilliVolts = 1100;
+const uint16_t AVCCMinMilliVolts = 4000;
+const uint16_t AVCCMaxMilliVolts = 5500;
+typedef Oversampler<16, 2> MyBandgapOversampler;
+
+// With ADCNoiseReduction each conversion is taken in ADC noise reduction
+// sleep, with the CPU and I/O quiet, at most one every ADCSamplePeriodMs.
+// The samples are clean enough to need far less averaging. The timers stop
+// for the 104us of each conversion, so event timing runs about 5% slow. None
+// is taken asleep while a supply is on its way to a fast trip, so that costs
+// the trip at most one conversion, which its budget allows for.
+// Without it conversions are triggered from Timer0, once per ms.
+const bool ADCNoiseReduction = true;
+const uint8_t ADCSamplePeriodMs = 2;
+
+// Filtering of each analog input, see AnalogFilter.h: a sliding window
+// average of up to 2^ADCMaxWindowShift samples, or an exponential filter
+// with a time constant of up to 2^ADCMaxIIRShift, either way with a new
+// value on every conversion. They're chosen in the menu (a long press of
+// the second button) and kept with the settings. By default a and b
+// average 4 samples, c averages 16 for the resolution and d is unfiltered.
+const uint8_t ADCMaxWindowShift = 4;
+const uint8_t ADCMaxIIRShift = 6;
+typedef AnalogFilterBank<ADCNumChannels, ADCMaxWindowShift, ADCMaxIIRShift> MyADCFilters;
+const uint8_t ADCDefaultFilters[ADCNumChannels] PROGMEM = { 2, 2, 4, 0 };
+
+// The INA219 shunt register is 10uV per count, across a 0.33 ohm shunt
+const uint16_t ShuntMilliOhms = 330;
+const uint8_t ShuntMicroVoltsPerCount = 10;
+const uint8_t ShuntCountsPerMa = ShuntMilliOhms / ShuntMicroVoltsPerCount;
+
+// Readings stop at the end of the 320mV range, about 970mA
+const int16_t ShuntFullScale = 32000;
+
+// The INA219s work out the current themselves, calibrated for the shunt so
+// the current register is in 0.1mA, and the power from it in 2mW
+const uint16_t SensorCurrentLsbMicroAmps = 100;
+const uint16_t SensorPowerLsbMilliWatts = SensorCurrentLsbMicroAmps * 20 / 1000;
+const uint16_t SensorCalibration = AsyncINA219::calibration(SensorCurrentLsbMicroAmps, ShuntMilliOhms);
+static_assert(SensorCurrentLsbMicroAmps >= AsyncINA219::minCurrentLsbMicroAmps(ShuntFullScale / ShuntCountsPerMa), "Current LSB too small for the shunt range");
+
+// Raw shunt register to 0.1mA, done with multiplies and shifts, for the
+// fast trip monitor's samples, which have no current register reading
+typedef Scale<ShuntMicroVoltsPerCount * 10, ShuntMilliOhms, 0x7fff> ShuntToTenthMilliAmps;
+
+// Current limits are set to the mA, in coarse or fine steps. Each one is
+// turned into a shunt register threshold once, when it's accepted, so the
+// protection path compares raw readings. The top of the range is past the
+// end of the shunt range and trips on a full scale reading.
+const uint16_t CurrentLimitMinMa = 1;
+const uint16_t CurrentLimitMaxMa = 1000;
+const uint8_t CurrentLimitCoarseMa = 10;
+const uint8_t CurrentLimitFineMa = 1;
+
+// The supplies, A first. Each is its INA219's address and the pin that shuts
+// it down. Everything else kept per supply is in arrays of NumSupplies in
+// the same order. The display, the capture and the menu name the first two,
+// so there have to be at least that many.
+typedef SupplyChannels<
+    SupplyChannel<0x40, ShutdownA>,
+    SupplyChannel<0x41, ShutdownB>
+> MySupplies;
+const uint8_t NumSupplies = MySupplies::Count;
+static_assert(NumSupplies >= 2, "Need at least two supplies");
+
+// Calibration, see Calibration.h. Each analog input, each supply's bus
+// voltage and current, and AVCC have a gain and offset, kept with the
+// settings. Voltages are in mV and currents in 0.1mA, as they're read, and
+// each reading is calibrated as it comes in. The current limits go back
+// through the current calibration to the shunt thresholds, so they trip at
+// the calibrated current. AVCC's gain is the bandgap's, from
+// BandgapMilliVolts, and it has no offset. The analog inputs are read
+// against AVCC, so it's best calibrated before them. In the menu (a long
+// press of the first button) each one is set against a reference on its
+// input: a reference of 0 zeroes it, anything else sets its gain.
+// CalibrationMaxOffset is 200mV or 20mA.
+const uint8_t CalibrationAnalog = 0;
+const uint8_t CalibrationBusVoltage = CalibrationAnalog + ADCNumChannels;
+const uint8_t CalibrationCurrent = CalibrationBusVoltage + NumSupplies;
+const uint8_t CalibrationAVCC = CalibrationCurrent + NumSupplies;
+const uint8_t NumCalibrations = CalibrationAVCC + 1;
+const int16_t CalibrationMaxOffset = 200;
+
+// Sensor acquisition. With FastTrip the sensors keep the conversion cycle
+// short (9 bit bus, 12 bit shunt, 616us) for the fast trip path below.
+// Without it both are averaged over 128 samples in the INA219 for cleaner
+// readings, a new conversion is ready every 136ms and the limits are checked
+// once per conversion. Either way each completed conversion is fetched once.
+const bool FastTrip = true;
+const uint16_t SensorConfiguration = FastTrip
+    ? AsyncINA219::configuration(AsyncINA219::Bus16V, AsyncINA219::Shunt320mV, AsyncINA219::ADC9Bit, AsyncINA219::ADC12Bit, AsyncINA219::ShuntAndBusContinuous)
+    : AsyncINA219::configuration(AsyncINA219::Bus16V, AsyncINA219::Shunt320mV, AsyncINA219::Average128, AsyncINA219::Average128, AsyncINA219::ShuntAndBusContinuous);
+
+// Each supply's sensor is read at its own rate, at most every SensorPollMs.
+// While its readings stay within the deadbands, the time between reads
+// doubles up to SensorMaxPollInterval polls. A reading outside them, or
+// within 1/2^SensorNearLimitShift of the current limit, goes back to every
+// poll. With FastTrip the monitor's shunt samples are checked every poll as
+// well, so a step is caught without waiting for the next read. Without it the
+// reads are the protection, so they stay at the full rate.
+const uint16_t SensorPollMs = 25;
+const uint8_t SensorMaxPollInterval = FastTrip ? 8 : 1;
+const int16_t SensorShuntDeadband = 5 * ShuntCountsPerMa;
+const int16_t SensorMilliVoltsDeadband = 20;
+const uint8_t SensorNearLimitShift = 3;
+
+typedef AdaptivePoller<NumSupplies, SensorMaxPollInterval> MySensorPoller;
+
+// Fast trip overcurrent protection. The sensors convert continuously and are
+// polled from the Timer2 interrupt. A supply trips after FastTripFilterCount
+// consecutive samples over its limit. The worst case latency this implies,
+// with Timer2 stopped for one ADC noise reduction conversion, is checked
+// against the budget at compile time.
+const uint16_t FastTripPollHz = 1000;
+const uint8_t FastTripFilterCount = 2;
+const uint32_t FastTripConversionUs = AsyncINA219::conversionTimeUs(AsyncINA219::ADC9Bit) + AsyncINA219::conversionTimeUs(AsyncINA219::ADC12Bit);
+const uint16_t FastTripLatencyBudgetUs = 4000;
+const uint16_t FastTripStoppedUs = ADCNoiseReduction ? MyADCSampler::ConversionUs : 0;
+
+typedef OvercurrentMonitor<NumSupplies, FastTripPollHz, FastTripFilterCount> MyOvercurrentMonitor;
+static_assert(!FastTrip || MyOvercurrentMonitor::worstCaseLatencyUs(FastTripConversionUs, FastTripStoppedUs) <= FastTripLatencyBudgetUs, "Fast trip settings exceed the latency budget");
+static_assert(!FastTrip || NumSupplies * TWIQueue::readTimeUs() <= MyOvercurrentMonitor::PollPeriodUs / 2, "Fast trip reads of all the supplies take over half the bus");
+
+// The sensor reads share the TWI queue with the monitor's, so only as many
+// run at once as there is room for. Due supplies are started round robin as
+// reads finish, so none waits on the others for more than a pass.
+const uint8_t SensorReadsInFlight = (TWIQueue::QueueSize - (FastTrip ? NumSupplies : 0)) / AsyncINA219::MaxQueued;
+static_assert(SensorReadsInFlight > 0, "No room in the TWI queue for the sensor reads");
+
+// Hiccup mode. After a trip a supply comes back on by itself after
+// HiccupOffMs, doubled for each retry in a row up to HiccupMaxBackoff times.
+// If it trips again within HiccupWatchMs of coming back the retry has
+// failed; if not it's back for good and its retries start over. After
+// HiccupRetries failed retries it stays off until the current limit menu
+// resets it, which is all there is with HiccupRetries at 0. Each supply is
+// handled on its own, every HiccupTickMs.
+const uint8_t HiccupRetries = 5;
+const uint16_t HiccupOffMs = 500;
+const uint8_t HiccupMaxBackoff = 4;
+const uint16_t HiccupWatchMs = 50;
+const uint16_t HiccupTickMs = 10;
+static_assert((HiccupOffMs << HiccupMaxBackoff) / HiccupTickMs <= 0xffff, "Hiccup off time too long to count in ticks");
+
+// The switches are sampled on the Timer2 tick and debounced there, see
+// ButtonDebouncer. Holding one repeats it, faster the longer it's held, in
+// the menu states that take repeats.
+const uint8_t ButtonDebounceMs = 8;
+const uint16_t ButtonLongPressMs = 1000;
+const uint16_t ButtonRepeatDelayMs = 400;
+
+typedef ButtonDebouncer<3, FastTripPollHz, ButtonDebounceMs, ButtonLongPressMs, ButtonRepeatDelayMs> MyButtons;
+
+// Maximum LCD writes (characters and cursor moves) per idle pass, about 45us each
+const uint8_t LCDWritesPerPass = 8;
+
+// The readings are drawn at most DisplayRefreshHz times a second however
+// often they change, so the time spent on the LCD doesn't go up with the
+// sensor rate. A change while a frame is too recent is drawn once it
+// isn't. The readings on the line modes are shown from copies that only
+// follow a reading once it's more than its deadband away, so a value
+// dithering over the last digit doesn't redraw or flicker. The deadbands
+// are in the readings' units, mV and the 0.1mA of the currents, and are a
+// digit of the display or two of the sensor.
+const uint8_t DisplayRefreshHz = 10;
+const uint16_t DisplayFrameMs = 1000 / DisplayRefreshHz;
+const int16_t DisplayMilliVoltsDeadband = 10;
+const int16_t DisplayCurrentDeadband = 2;
+
+// The bar graph line modes show a supply's current against its limit across
+// the whole line, BarCellColumns to a cell. CGRAM characters 1 to
+// BarCellColumns have that many columns filled from the left, and are set
+// up once at startup. Each frame renders the whole bar, and the frame buffer
+// only sends the cells that changed, which are the ones at the end of it.
+const uint8_t BarCells = 16;
+const uint8_t BarCellColumns = 5;
+
+// Work done from EV_IDLE, highest priority first, see g_tasks. Deadlines are
+// in ms, which is what the protection timer ticks at. The ADC deadline is
+// half the time it takes to fill a channel's sample buffer.
+const uint8_t TaskProtection = 0;
+const uint8_t TaskAcquisition = 1;
+const uint8_t TaskDisplay = 2;
+const uint8_t TaskLCD = 3;
+const uint8_t TaskRemote = 4;
+const uint8_t NumTasks = 5;
+
+const uint16_t ProtectionDeadlineMs = 5;
+const uint16_t AcquisitionDeadlineMs = ADCBufferSize * ADCNumChannels / 2;
+const uint16_t DisplayDeadlineMs = 50;
+const uint16_t LCDDeadlineMs = 200;
+const uint16_t RemoteDeadlineMs = 50;
+static_assert(FastTripPollHz == 1000, "Task deadlines assume a 1ms tick");
+
+// The watchdog is fed only when the protection task finishes within its
+// deadline, so if the loop stops getting to it in time for
+// ProtectionWatchdogTimeout the chip resets. That's 20 sensor polls in a
+// row. A hung sensor transfer doesn't stop it, the TWI queue times those
+// out in TWIQueue::TimeoutTicks and the protection task recovers the bus.
+const uint8_t ProtectionWatchdogTimeout = WDTO_500MS;
+
+// Binary telemetry on the serial port, one record every TelemetryPeriodMs
+// (0 turns it off). With two supplies a record is 27 bytes, 2.3ms at
+// 115200 baud, so the buffer holds a couple of records and anything much
+// faster than every 3ms is dropped. See sendTelemetry() for the layout.
+const uint32_t SerialBaud = 115200;
+const uint8_t SerialTxBufferSize = 64;
+const uint16_t TelemetryPeriodMs = 20;
+const uint8_t TelemetryRecordMeasurements = 1;
+const uint8_t TelemetryRecordProfile = 2;
+const uint8_t TelemetryRecordMemory = 3;
+const uint8_t TelemetryRecordCapture = 4;
+const uint8_t TelemetryRecordErrors = 5;
+
+// Remote control on the same port, see CommandInterpreter and
+// g_remoteCommands. Received characters wait in a buffer of
+// SerialRxBufferSize, 5.5ms of them back to back at 115200 baud, and a line
+// of up to RemoteLineSize is run a command at a time by the lowest priority
+// task. A command only runs once there's RemoteReplyRoom in the transmit
+// buffer, so a reply never waits for the port. Replies are lines of text
+// between the telemetry records, which a host tells apart by the sync
+// byte, as it isn't ASCII.
+//
+// The USART stops in ADC noise reduction sleep. While the line is quiet the
+// start bit of a character wakes the CPU in time to receive it, see
+// SerialPort, and for RemoteQuietMs after each character the analog inputs
+// are converted awake instead, so nothing a host sends is lost to a sleep.
+const uint8_t SerialRxBufferSize = 64;
+const uint8_t RemoteLineSize = 48;
+const uint8_t RemoteReplyRoom = 32;
+const uint16_t RemoteQuietMs = 100;
+static_assert(RemoteReplyRoom >= CommandErrorMaxLength, "No room for an error reply");
+
+typedef TextStream<SerialPort<SerialTxBufferSize, SerialRxBufferSize>> MySerial;
+
+// Burst capture of both supplies' shunt current, from the fast trip
+// monitor's samples, so once per ms and only with FastTrip. Armed from the
+// capture page, it keeps CapturePreTrigger samples of history and triggers
+// on a sample over CaptureThresholdMa, a rise of more than CaptureEdgeMa
+// from one sample to the next, or a trip. Samples are packed to 12 bits,
+// about 0.25mA. A frozen capture is dumped as telemetry records, one per
+// telemetry period in place of the measurement record, so it needs
+// TelemetryPeriodMs. It covers the first CaptureSupplies, one per LCD line.
+const uint8_t CaptureSamples = 128;
+const uint8_t CapturePreTrigger = 32;
+const uint16_t CaptureThresholdMa = 200;
+const uint16_t CaptureEdgeMa = 100;
+const uint8_t CaptureRecordSamples = 16;
+const uint16_t CaptureRamBudget = 400;
+const uint8_t CaptureSupplies = 2;
+
+typedef BurstCapture<CaptureSupplies, CaptureSamples, CapturePreTrigger, 3> MyCapture;
+static_assert(MyCapture::RamBytes <= CaptureRamBudget, "Capture buffer is over its share of RAM");
+static_assert(CaptureSamples % CaptureRecordSamples == 0, "Capture records must divide the capture evenly");
+
+// Stack use is checked every StackCheckMs. If the stack gets within
+// StackGuardBytes of the static data, all the supplies are shut down and it's
+// reported as a fatal error (0 turns the check off).
+const uint16_t StackCheckMs = 100;
+const uint8_t StackGuardBytes = 32;
+typedef StackMonitor<StackGuardBytes> MyStackMonitor;
+
+// Errors are queued, up to ErrorQueueSize, and the display task shows each
+// one for ErrorShowMs. They wait while a menu page is up. A fatal error shuts
+// all the supplies down before anything else, goes straight on the display
+// and stays there. The watchdog isn't fed after that, and it's set to reset
+// the chip FatalResetTimeout later.
+// Protection and the rest of the loop keep running until then. After a
+// watchdog reset the supplies stay off until they're turned on from the
+// menu or remotely. The counts go out every StackCheckMs as telemetry.
+const uint8_t ErrorQueueSize = 4;
+const uint16_t ErrorShowMs = 2000;
+const uint8_t FatalResetTimeout = WDTO_2S;
+typedef ErrorQueue<ErrorQueueSize> MyErrorQueue;
+
+// Profiling of the main loop, debug builds only. PROFILE(Section) times the
+// rest of the enclosing scope. The results are on a hidden menu page (third
+// button on the "Save?" screen) and can be streamed as telemetry records.
+#ifndef NDEBUG
+enum class ProfileSection : uint8_t { Sensor, Analog, Display, LCD, Menu, Remote, Count };
+enum class ProfileLatency : uint8_t { Idle, SensorTimer, Analog, Count };
+typedef Profiler<static_cast<uint8_t>(ProfileSection::Count), static_cast<uint8_t>(ProfileLatency::Count)> MyProfiler;
+
+const char profileSensor[] PROGMEM = "Sensor";
+const char profileADC[] PROGMEM = "ADC";
+const char profileDisplay[] PROGMEM = "Displ";
+const char profileLCD[] PROGMEM = "LCD";
+const char profileMenu[] PROGMEM = "Menu";
+const char profileRemote[] PROGMEM = "Remote";
+const char profileIdle[] PROGMEM = "IdleLt";
+const char profileSensorTimer[] PROGMEM = "TmrLt";
+const char profileADCLatency[] PROGMEM = "ADCLt";
+const char* const profileNames[] PROGMEM = {
+    profileSensor, profileADC, profileDisplay, profileLCD, profileMenu, profileRemote,
+    profileIdle, profileSensorTimer, profileADCLatency
+};
+static_assert(sizeof(profileNames) / sizeof(profileNames[0]) == MyProfiler::NumEntries, "Need a name for each profile entry");
+
+const uint8_t DiagnosticsState = 12;
+const uint8_t CaptureState = 15;
+
+#define PROFILE(section) ProfileScope<MyProfiler> profileScope(_profiler, static_cast<uint8_t>(ProfileSection::section))
+#define PROFILE_MARK(latency) _profiler.mark(static_cast<uint8_t>(ProfileLatency::latency))
+#define PROFILE_SERVICED(latency) _profiler.serviced(static_cast<uint8_t>(ProfileLatency::latency))
+#define PROFILE_INTERVAL(latency, nominal) _profiler.interval(static_cast<uint8_t>(ProfileLatency::latency), nominal)
+#else
+const uint8_t CaptureState = 12;
+const uint8_t DiagnosticsState = CaptureState;
+
+#define PROFILE(section)
+#define PROFILE_MARK(latency)
+#define PROFILE_SERVICED(latency)
+#define PROFILE_INTERVAL(latency, nominal)
+#endif
+
+const uint8_t OutputsOnState = CaptureState + 3;
+const uint8_t FineAdjustState = OutputsOnState + 1;
+const uint8_t CalibrateState = FineAdjustState + 3;
+const uint8_t FilterState = CalibrateState + 11;
+
+// Settings kept over power cycles, in a ring of EEPROM slots. Each slot is
+// 6 bytes plus 2 per supply, 4 per calibration and 1 per analog input, and
+// is rewritten for every 16 saves.
+struct Settings
+{
+    uint16_t _currentLimitMa[NumSupplies];
+    uint8_t _lineDisplayMode[2];
+    Calibration _calibration[NumCalibrations];
+    uint8_t _adcFilter[ADCNumChannels];
+};
+
+const uint16_t SettingsAddress = 0;
+const uint8_t SettingsSlots = 16;
+typedef SettingsStore<Settings, SettingsAddress, SettingsSlots> MySettingsStore;
 
 class MyApp;
 
+typedef TaskScheduler<MyApp, NumTasks> MyScheduler;
+typedef CommandInterpreter<MyApp, MySerial, RemoteLineSize> MyRemote;
+
 class MyErrorReporter : public ErrorReporter {
 public:
     virtual void reportError(char c, uint32_t, ErrorConditionType);
@@ -79,84 +445,478 @@ const char bannerString[] PROGMEM = "AVR Power Supply\n      v0.1";
 const char curLimit[] PROGMEM = "Cur Limit";
 const char accept[] PROGMEM = "Save? (UP=YES)";
 const char accepted[] PROGMEM = "Cur Limit Set";
-const uint8_t curLimitValues[] PROGMEM = { 1, 5, 10, 20, 40, 60, 80, 100 };
-const uint8_t numCurLimitValues = sizeof(curLimitValues);
+const char outputsOn[] PROGMEM = "Outputs On";
+const char calibrated[] PROGMEM = "Calibration Set";
+const char filtersSet[] PROGMEM = "Filters Set";
+const char identity[] PROGMEM = "m8r,AVR Power Supply,0,v0.1\n";
+static_assert(sizeof(identity) - 1 <= RemoteReplyRoom, "No room for the identity reply");
 
-class MyApp : public EventListener, public Menu<MyApp>
+class MyApp : public EventListener, public StateMenu<MyApp>
 {    
 public:
-    friend class MyErrorReporter;
+    static const uint8_t NumButtons = 3;
+
     MyApp();
     
     // EventListener override
     virtual void handleEvent(EventType type, EventParam);
     
     void updateADC();
+    void updateAVCC();
+    void handleADCInterrupt()
+    {
+        _adcSampler.handleInterrupt();
+        _scheduler.ready(TaskAcquisition);
+        PROFILE_MARK(Analog);
+    }
+    void handleTWIInterrupt()
+    {
+        if (_twi.handleInterrupt()) {
+            _scheduler.ready(TaskProtection);
+        }
+    }
+    void handleSerialTxInterrupt() { _serial.handleDataRegisterEmptyInterrupt(); }
+    void handleSerialRxInterrupt()
+    {
+        _serial.handleReceiveInterrupt();
+        _remoteActive = true;
+        _remoteRxTick = ticks();
+        _scheduler.ready(TaskRemote);
+    }
+    void handleSerialStartInterrupt()
+    {
+        _serial.handleStartInterrupt();
+        _remoteActive = true;
+        _remoteRxTick = ticks();
+    }
+    void handleEEPROMInterrupt() { _settingsStore.handleReadyInterrupt(); }
+#ifndef NDEBUG
+    void handleProfilerInterrupt() { _profiler.handleOverflowInterrupt(); }
+    void showProfile();
+    void showMemory();
+    void showBus();
+    void sendProfile();
+#endif
+    void handleProtectionInterrupt()
+    {
+        if (_twi.tick()) {
+            _scheduler.ready(TaskProtection);
+        }
+        uint8_t tripped = _overcurrentMonitor.handleInterrupt();
+        for (uint8_t i = 0; i < NumSupplies; ++i) {
+            if (tripped & (1 << i)) {
+                setCurrentLimit(i);
+            }
+        }
+        if (FastTrip) {
+            int16_t samples[CaptureSupplies];
+            for (uint8_t i = 0; i < CaptureSupplies; ++i) {
+                samples[i] = _overcurrentMonitor.shuntVoltage(i);
+            }
+            _capture.add(samples);
+        }
+        _buttons.sample((_switch0 ? 0 : 1) | (_switch1 ? 0 : 2) | (_switch2 ? 0 : 4));
+    }
+    void dispatchButtons();
+    uint16_t ticks() const { return _overcurrentMonitor.ticks(); }
+
     void updateDisplay();
+    bool flushDisplay();
+    void invalidateDisplay() { _scheduler.ready(TaskDisplay); }
+
+    // For readings, which are drawn in the next frame pollDisplay() paces
+    void invalidateReadings() { _displayWanted = true; }
+    void pollDisplay();
+    void showSupplyLabel(uint8_t supply);
     void showPSVoltageAndCurrent(uint8_t channel, uint8_t line);
-    void showPSCurrents(uint8_t line);
+    void showPSCurrents(uint8_t first, uint8_t line);
     void showTestVoltages(uint8_t channel0, uint8_t channel1, uint8_t line);
+    void showTripLatency(uint8_t first, uint8_t line);
+    void showDeadlineMisses(uint8_t line);
+    void defineBarCharacters();
+    void showCurrentBar(uint8_t supply, uint8_t line);
     
-    enum class CurrentLimitArrow { None, Supply, Current };
+    enum class CurrentLimitArrow { None, Supply, Coarse, Fine };
     void showCurrentLimit(uint8_t supply, CurrentLimitArrow);
     
-    void updateCurrentSensor();
+    bool updateCurrentSensor();
+    void updateSensorHealth(uint8_t supply);
+    void pollCurrentSensors();
+    void startSensorReads();
+    void checkStack();
+    void postError(char code, uint32_t value, ErrorConditionType);
+    bool showError();
+    void sleep();
+    void sendTelemetry();
+    void sendMemory();
+    void sendErrors();
+    void showCapture();
+    void sendCapture();
+    void updateCalibration();
+    int16_t calibrationReading(uint8_t channel) const;
+    void calibrate();
+    void showCalibration();
+    void showCalibrationValue(uint8_t channel, int16_t value);
+    void showFilters();
+    bool updateRemote();
 
     // Menu
-    virtual void show(const _FlashString& s)
+    void show(const _FlashString& s)
     {
         _displayEnabled = false;
-        _lcd << TextLCDClear() << s;
+        _lcd << FrameClear() << s;
+        _scheduler.ready(TaskLCD);
     }
     
+    // Called from the protection interrupt as well as the main loop
     void setCurrentLimit(uint8_t supply)
     {
-        if (supply == 0) {
-            _shutdownA = true;
-        } else {
-            _shutdownB = true;
+        _capture.trigger(MyCapture::Trigger::External);
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            _trippedSupplies |= 1 << supply;
+            shutdownSupplies();
         }
         _statusLED = true;
     }
+
+    // With interrupts off. A supply is off if it's tripped or disabled.
+    void shutdownSupplies() { _supplies.shutdown(_trippedSupplies | _disabledSupplies); }
+
+    // Off without a trip, so no capture trigger, trip light or hiccup. It
+    // stays off until the outputs are turned back on.
+    void disableSupply(uint8_t supply)
+    {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            _disabledSupplies |= 1 << supply;
+            shutdownSupplies();
+        }
+    }
     
     void resetCurrentLimit()
     {
-        _shutdownA = false;
-        _shutdownB = false;
-        _statusLED = false;
+        _disabledSupplies = 0;
+        for (uint8_t i = 0; i < NumSupplies; ++i) {
+            _hiccup[i] = Hiccup::On;
+            _hiccupRetries[i] = 0;
+            enableSupply(i);
+        }
+    }
+
+    // All in one go, so a trip from the interrupt comes before or after.
+    // Nothing comes back on after a fatal error.
+    void enableSupply(uint8_t supply)
+    {
+        if (_fatal) {
+            return;
+        }
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            _overcurrentMonitor.reset(supply);
+            _trippedSupplies &= ~(1 << supply);
+            shutdownSupplies();
+            _statusLED = _trippedSupplies != 0;
+        }
+    }
+
+    void updateHiccup();
+
+    // A limit past the end of the shunt range trips on a full scale reading.
+    // The limit is a calibrated current, so it goes back through the
+    // calibration to what the sensor reads at it.
+    void updateTripThresholds()
+    {
+        for (uint8_t i = 0; i < NumSupplies; ++i) {
+            int32_t tenths = _calibration[CalibrationCurrent + i].unapply(_currentLimitMa[i] * 10);
+            uint32_t counts = (tenths > 0) ? static_cast<uint32_t>(tenths) * ShuntCountsPerMa / 10 : 0;
+            _overcurrentMonitor.setThreshold(i, (counts < ShuntFullScale) ? counts : ShuntFullScale - 1);
+        }
     }
 
+    // Tasks, see g_tasks. Each returns true if it has more to do.
+    // Ready again from the TWI as each sensor transfer finishes, so it
+    // doesn't spin on the reads in flight. A timeout readies it too, and the
+    // bus is recovered here, out of the interrupt.
+    static bool protectionTask(MyApp* app)
+    {
+        app->_twi.recover();
+        app->updateCurrentSensor();
+        return false;
+    }
+    static bool acquisitionTask(MyApp* app) { app->updateADC(); return false; }
+    static bool displayTask(MyApp* app) { app->updateDisplay(); return false; }
+    static bool lcdTask(MyApp* app) { return app->flushDisplay(); }
+    static bool remoteTask(MyApp* app) { return app->updateRemote(); }
+
     static void display(MyApp* app)
     {
         app->_displayEnabled = true;
+        app->_displayPage = DisplayPage::Lines;
+        app->invalidateDisplay();
     }
     static void nextLine0(MyApp* app) { app->advanceLineDisplay(0); }
     static void nextLine1(MyApp* app) { app->advanceLineDisplay(1); }
-    static void curLimit0(MyApp* app) { app->showCurrentLimit(0, CurrentLimitArrow::Supply); app->_currentLimitAdjustSupply = 0; }
-    static void curLimit1(MyApp* app) { app->showCurrentLimit(1, CurrentLimitArrow::Supply); app->_currentLimitAdjustSupply = 1; }
-    static void adjustCurLimit(MyApp* app) { app->showCurrentLimit(app->_currentLimitAdjustSupply, CurrentLimitArrow::Current); }
+    static void firstCurLimitSupply(MyApp* app) { app->_currentLimitAdjustSupply = 0; }
+    static void nextCurLimitSupply(MyApp* app)
+    {
+        if (++app->_currentLimitAdjustSupply >= NumSupplies) {
+            app->_currentLimitAdjustSupply = 0;
+        }
+    }
+    static void curLimitSupply(MyApp* app) { app->showCurrentLimit(app->_currentLimitAdjustSupply, CurrentLimitArrow::Supply); }
+    static void adjustCurLimit(MyApp* app) { app->showCurrentLimit(app->_currentLimitAdjustSupply, CurrentLimitArrow::Coarse); }
+    static void fineAdjustCurLimit(MyApp* app) { app->showCurrentLimit(app->_currentLimitAdjustSupply, CurrentLimitArrow::Fine); }
     static void showCurLimit(MyApp* app) { app->showCurrentLimit(app->_currentLimitAdjustSupply, CurrentLimitArrow::None); }
-    static void incCurLimit(MyApp* app)
+    static void incCurLimit(MyApp* app) { app->stepCurrentLimit(true, CurrentLimitCoarseMa); }
+    static void decCurLimit(MyApp* app) { app->stepCurrentLimit(false, CurrentLimitCoarseMa); }
+    static void fineIncCurLimit(MyApp* app) { app->stepCurrentLimit(true, CurrentLimitFineMa); }
+    static void fineDecCurLimit(MyApp* app) { app->stepCurrentLimit(false, CurrentLimitFineMa); }
+    static void acceptCurLimit(MyApp* app)
     {
-        if (++app->_currentLimitAdjustIndex[app->_currentLimitAdjustSupply] >= numCurLimitValues) {
-            app->_currentLimitAdjustIndex[app->_currentLimitAdjustSupply] = 0;
+        for (uint8_t i = 0; i < NumSupplies; ++i) {
+            app->_currentLimitMa[i] = app->_currentLimitAdjustMa[i];
         }
+        app->updateTripThresholds();
+        app->saveSettings();
     }
-    static void decCurLimit(MyApp* app)
+    static void enableOutputs(MyApp* app) { app->resetCurrentLimit(); }
+    static void rejectCurLimit(MyApp* app)
     {
-        if (app->_currentLimitAdjustIndex[app->_currentLimitAdjustSupply]-- == 0) {
-            app->_currentLimitAdjustIndex[app->_currentLimitAdjustSupply] = numCurLimitValues - 1;
+        for (uint8_t i = 0; i < NumSupplies; ++i) {
+            app->_currentLimitAdjustMa[i] = app->_currentLimitMa[i];
         }
     }
-    static void acceptCurLimit(MyApp* app)
+    static void capture(MyApp* app)
     {
-        app->_currentLimitIndex[0] = app->_currentLimitAdjustIndex[0];
-        app->_currentLimitIndex[1] = app->_currentLimitAdjustIndex[1];
+        app->_displayEnabled = true;
+        app->_displayPage = DisplayPage::Capture;
+        app->invalidateDisplay();
     }
-    static void rejectCurLimit(MyApp* app)
+    static void armCapture(MyApp* app) { app->_capture.arm(CaptureThresholdMa * ShuntCountsPerMa, CaptureEdgeMa * ShuntCountsPerMa); }
+    static void dumpCapture(MyApp* app)
+    {
+        if (app->_capture.state() == MyCapture::State::Frozen) {
+            app->_captureDumpRecord = 1;
+        }
+    }
+    static void firstCalibrationChannel(MyApp* app)
+    {
+        app->_calibrationChannel = 0;
+        app->_calibrationStep = CalibrationStep::Choose;
+    }
+    static void calibration(MyApp* app)
+    {
+        app->_displayEnabled = true;
+        app->_displayPage = DisplayPage::Calibration;
+        app->invalidateDisplay();
+    }
+    static void nextCalibrationChannel(MyApp* app)
+    {
+        if (++app->_calibrationChannel >= NumCalibrations) {
+            app->_calibrationChannel = 0;
+        }
+        app->_calibrationStep = CalibrationStep::Choose;
+    }
+    // The reference starts at the reading, so it's a few steps from where it's set
+    static void startCalibrationReference(MyApp* app)
+    {
+        app->_calibrationReference = app->calibrationReading(app->_calibrationChannel);
+        app->_calibrationStep = CalibrationStep::Adjust;
+    }
+    static void incCalibrationReference(MyApp* app)
+    {
+        if (app->_calibrationReference < 0x7fff) {
+            ++app->_calibrationReference;
+        }
+    }
+    static void decCalibrationReference(MyApp* app)
+    {
+        if (app->_calibrationReference > 0) {
+            --app->_calibrationReference;
+        }
+    }
+    static void applyCalibration(MyApp* app) { app->calibrate(); }
+    static void acceptCalibration(MyApp* app)
+    {
+        for (uint8_t i = 0; i < NumCalibrations; ++i) {
+            app->_savedCalibration[i] = app->_calibration[i];
+        }
+        app->saveSettings();
+    }
+    static void rejectCalibration(MyApp* app)
+    {
+        for (uint8_t i = 0; i < NumCalibrations; ++i) {
+            app->_calibration[i] = app->_savedCalibration[i];
+        }
+        app->updateCalibration();
+    }
+    static void firstFilterChannel(MyApp* app) { app->_filterChannel = 0; }
+    static void filters(MyApp* app)
     {
-        app->_currentLimitAdjustIndex[0] = app->_currentLimitIndex[0];
-        app->_currentLimitAdjustIndex[1] = app->_currentLimitIndex[1];
+        app->_displayEnabled = true;
+        app->_displayPage = DisplayPage::Filters;
+        app->invalidateDisplay();
+    }
+    static void nextFilterChannel(MyApp* app)
+    {
+        if (++app->_filterChannel >= ADCNumChannels) {
+            app->_filterChannel = 0;
+        }
+    }
+    // Straight away, so the reading below it shows what it does
+    static void nextFilter(MyApp* app)
+    {
+        uint8_t channel = app->_filterChannel;
+        app->_adcFilters.set(channel, MyADCFilters::next(app->_adcFilters.setting(channel)));
+    }
+    static void acceptFilters(MyApp* app)
+    {
+        for (uint8_t i = 0; i < ADCNumChannels; ++i) {
+            app->_savedADCFilter[i] = app->_adcFilters.setting(i);
+        }
+        app->saveSettings();
+    }
+    static void rejectFilters(MyApp* app)
+    {
+        for (uint8_t i = 0; i < ADCNumChannels; ++i) {
+            if (app->_adcFilters.setting(i) != app->_savedADCFilter[i]) {
+                app->_adcFilters.set(i, app->_savedADCFilter[i]);
+            }
+        }
+    }
+#ifndef NDEBUG
+    static void diagnostics(MyApp* app)
+    {
+        app->_displayEnabled = true;
+        app->_displayPage = DisplayPage::Profile;
+        app->invalidateDisplay();
+    }
+    // The memory and bus reports are the last entries, after the profile
+    static void nextProfileEntry(MyApp* app)
+    {
+        if (++app->_profileEntry > MyProfiler::NumEntries + 1) {
+            app->_profileEntry = 0;
+        }
+    }
+    static void toggleProfileStreaming(MyApp* app) { app->_profileStreaming = !app->_profileStreaming; }
+#endif
+
+    // Remote commands, see g_remoteCommands. Supplies are numbered from 1.
+    static CommandResult remoteSupply(CommandParams& params, uint8_t& supply)
+    {
+        uint16_t number;
+        CommandResult result = params.number(number, 1, NumSupplies);
+        supply = number - 1;
+        return result;
+    }
+    static CommandResult remoteQuerySupply(CommandParams& params, uint8_t& supply)
+    {
+        CommandResult result = remoteSupply(params, supply);
+        return (result == CommandResult::Ok) ? params.done() : result;
+    }
+    static CommandResult remoteIdentify(MyApp* app, CommandParams& params)
+    {
+        CommandResult result = params.done();
+        if (result == CommandResult::Ok) {
+            app->_serial << FS(identity);
+        }
+        return result;
+    }
+    static CommandResult remoteOperationComplete(MyApp* app, CommandParams& params)
+    {
+        CommandResult result = params.done();
+        if (result == CommandResult::Ok) {
+            app->_serial << FS("1\n");
+        }
+        return result;
+    }
+    // Accepted as from the menu, but just for the one supply, so a change
+    // half made in the menu is dropped rather than saved along with it
+    static CommandResult remoteSetCurrentLimit(MyApp* app, CommandParams& params)
+    {
+        uint8_t supply;
+        uint16_t milliAmps;
+        CommandResult result = remoteSupply(params, supply);
+        if (result == CommandResult::Ok) {
+            result = params.number(milliAmps, CurrentLimitMinMa, CurrentLimitMaxMa);
+        }
+        if (result == CommandResult::Ok) {
+            result = params.done();
+        }
+        if (result == CommandResult::Ok) {
+            rejectCurLimit(app);
+            app->_currentLimitAdjustMa[supply] = milliAmps;
+            acceptCurLimit(app);
+        }
+        return result;
+    }
+    static CommandResult remoteCurrentLimit(MyApp* app, CommandParams& params)
+    {
+        uint8_t supply;
+        CommandResult result = remoteQuerySupply(params, supply);
+        if (result == CommandResult::Ok) {
+            app->_serial << app->_currentLimitMa[supply] << '\n';
+        }
+        return result;
+    }
+    // On is the menu's "Outputs On", which also clears any trips. Off
+    // disables the outputs, see disableSupply().
+    static CommandResult remoteOutput(MyApp* app, CommandParams& params)
+    {
+        bool on;
+        CommandResult result = params.boolean(on);
+        if (result == CommandResult::Ok) {
+            result = params.done();
+        }
+        if (result != CommandResult::Ok) {
+            return result;
+        }
+        if (on) {
+            enableOutputs(app);
+            return result;
+        }
+        for (uint8_t i = 0; i < NumSupplies; ++i) {
+            app->disableSupply(i);
+        }
+        return result;
+    }
+    static CommandResult remoteOutputState(MyApp* app, CommandParams& params)
+    {
+        uint8_t supply;
+        CommandResult result = remoteQuerySupply(params, supply);
+        if (result == CommandResult::Ok) {
+            uint8_t off = 0;
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                off = app->_trippedSupplies | app->_disabledSupplies;
+            }
+            app->_serial << ((off & (1 << supply)) ? '0' : '1') << '\n';
+        }
+        return result;
+    }
+    static CommandResult remoteMeasureVoltage(MyApp* app, CommandParams& params)
+    {
+        uint8_t supply;
+        CommandResult result = remoteQuerySupply(params, supply);
+        if (result == CommandResult::Ok) {
+            app->_serial << Decimal(app->_busMilliVolts[supply], 3, 3) << '\n';
+        }
+        return result;
+    }
+    static CommandResult remoteMeasureCurrent(MyApp* app, CommandParams& params)
+    {
+        uint8_t supply;
+        CommandResult result = remoteQuerySupply(params, supply);
+        if (result == CommandResult::Ok) {
+            app->_serial << Decimal(app->_shuntMilliAmps[supply], 4, 4) << '\n';
+        }
+        return result;
+    }
+    static CommandResult remoteMeasurePower(MyApp* app, CommandParams& params)
+    {
+        uint8_t supply;
+        CommandResult result = remoteQuerySupply(params, supply);
+        if (result == CommandResult::Ok) {
+            app->_serial << Decimal(app->_milliWatts[supply], 3, 3) << '\n';
+        }
+        return result;
     }
 
 private:    
@@ -164,220 +924,1163 @@ private:
     {
         _lineDisplayMode[line] = (LineDisplayMode)((uint8_t)_lineDisplayMode[line] + 1);
         if (_lineDisplayMode[line] == LineDisplayMode::Last) {
-            _lineDisplayMode[line] = LineDisplayMode::PS1VA;
+            _lineDisplayMode[line] = LineDisplayMode::PSVA;
         }
-        _needsDisplay = true;
+        invalidateDisplay();
+        saveSettings();
     }
+
+    void loadSettings();
+    void saveSettings();
     
-    uint16_t curLimitAdjustMa(uint8_t supply) const { return (uint16_t) pgm_read_byte(&curLimitValues[_currentLimitAdjustIndex[supply]]) * 10; }
-    uint16_t curLimitMa(uint8_t supply) const { return (uint16_t) pgm_read_byte(&curLimitValues[_currentLimitIndex[supply]]) * 10; }
+    void stepCurrentLimit(bool up, uint8_t stepMa);
 
 
     MyErrorReporter _errorReporter;
+    MySettingsStore _settingsStore;
 
     StatusLED _statusLED;
-    ShutdownA _shutdownA;
-    ShutdownB _shutdownB;
-    DeviceStream<TextLCD<16, 2, LCD_DEFAULT, LCDRS, NullOutputBit, LCDEnable, LCDD0, LCDD1, LCDD2, LCDD3> > _lcd;
+    MySupplies _supplies;
+    TextStream<LCDFrameBuffer<16, 2, HD44780<LCDRS, LCDEnable, LCDD0, LCDD1, LCDD2, LCDD3> > > _lcd;
     TimerEventMgr<Timer0, TimerClockDIV64> _timerEventMgr;
     RepeatingTimerEvent _timerEvent;
     
-    INA219 _currentSensor[2];
-    int16_t _busMilliVolts[2];
-    int16_t _shuntMilliAmps[2];
-    bool _captureSensorValues;
+    MySerial _serial;
+    Telemetry<MySerial> _telemetry;
+    RepeatingTimerEvent _telemetryEvent;
+    MyRemote _remote;
+    volatile bool _remoteActive = false;    // A character in the last RemoteQuietMs
+    volatile uint16_t _remoteRxTick = 0;
+    
+    TWIQueue _twi;
+    AsyncINA219 _currentSensor[NumSupplies];
+    MyOvercurrentMonitor _overcurrentMonitor;
+    uint8_t _trippedSupplies = 0;   // Bit per supply shut down by setCurrentLimit()
+    uint8_t _disabledSupplies = 0;  // And by disableSupply()
+
+    enum class Hiccup : uint8_t { On, Off, Watch, Latched };
+    RepeatingTimerEvent _hiccupEvent;
+    Hiccup _hiccup[NumSupplies] = { };  // All On
+    uint8_t _hiccupRetries[NumSupplies] = { };
+    uint16_t _hiccupCountdown[NumSupplies] = { };
+    MySensorPoller _sensorPoller;
+    uint8_t _sensorsDue = 0;        // Bit per supply waiting for a read to start
+    uint8_t _nextSensor = 0;        // Where the next round robin pass starts
+    int16_t _sensorShuntReference[NumSupplies] = { };
+    int16_t _sensorMilliVoltsReference[NumSupplies] = { };
+    AsyncINA219::Health _sensorHealth[NumSupplies] = { };  // All Good
+    int16_t _busMilliVolts[NumSupplies];
+    int16_t _shuntMilliAmps[NumSupplies];
+    uint16_t _milliWatts[NumSupplies];
+    int16_t _shownBusMilliVolts[NumSupplies] = { };
+    int16_t _shownMilliAmps[NumSupplies] = { };
     
-    bool _needsDisplay = true;
+    MyScheduler _scheduler;
+    MyStackMonitor _stackMonitor;
+    uint16_t _stackCheckTick = 0;
+
+    MyErrorQueue _errors;
+    MyErrorQueue::Error _error;     // On the display while _errorShowing
+    bool _errorShowing = false;
+    uint16_t _errorTick = 0;
+    bool _fatal = false;            // Waiting for the watchdog
+
+    // What the display task shows when it's enabled. The profile page is
+    // only there in debug builds.
+    enum class DisplayPage : uint8_t { Lines, Profile, Capture, Calibration, Filters };
     bool _displayEnabled = false;
+    DisplayPage _displayPage = DisplayPage::Lines;
+    bool _displayWanted = false;    // A reading changed since the last frame
+    uint16_t _displayFrameTick = 0;
+
+    MyCapture _capture;
+    uint8_t _captureDumpRecord = 0;   // Next record to send, from 1, 0 when not dumping
+
+    MyADCSampler _adcSampler;
+    MyADCFilters _adcFilters;
+    uint8_t _savedADCFilter[ADCNumChannels];    // As loaded or last accepted
+    uint8_t _filterChannel = 0;
+    uint16_t _adcVoltage[ADCNumChannels];
+    int16_t _shownADCVoltage[ADCNumChannels] = { };
+    uint16_t _adcSampleTick = 0;
+    MyBandgapOversampler _bandgap;
+    uint16_t _avccMilliVolts = ADCRefMilliVolts;
+    uint16_t _adcScale[ADCNumChannels];     // AVCC through each input's gain
 
-    ADC _adc;
-    uint16_t _adcAccumulator[4];
-    uint16_t _adcVoltage[4];
-    uint8_t _adcCurrentChannel;
-    uint8_t _adcCurrentSamples;
-    bool _captureADCValue;
+    // Applied to the readings as they come in. The saved ones are as loaded
+    // or last accepted, for a rejected calibration to go back to.
+    enum class CalibrationStep : uint8_t { Choose, Adjust, Refused };
+    Calibration _calibration[NumCalibrations];
+    Calibration _savedCalibration[NumCalibrations];
+    uint8_t _calibrationChannel = 0;
+    CalibrationStep _calibrationStep = CalibrationStep::Choose;
+    int16_t _calibrationReference = 0;
     
-    uint8_t _currentLimitIndex[2];
-    uint8_t _currentLimitAdjustIndex[2];
+    uint16_t _currentLimitMa[NumSupplies];
+    uint16_t _currentLimitAdjustMa[NumSupplies];
     uint8_t _currentLimitAdjustSupply = 0;
-    uint8_t _overCurrentCount[2] = { 0, 0 };
     
-    enum class LineDisplayMode { PS1VA, PS2VA, PS12A, V1V2, V3V4, Last };
+    // Voltage and current and the current bar come once for each supply,
+    // the currents and trip latencies once for each pair of supplies, A and
+    // B first
+    static const uint8_t NumSupplyPairs = (NumSupplies + 1) / 2;
+    enum class LineDisplayMode : uint8_t {
+        PSVA = 0,
+        PSCurrents = PSVA + NumSupplies,
+        V1V2 = PSCurrents + NumSupplyPairs,
+        V3V4,
+        Trip,
+        Late = Trip + NumSupplyPairs,
+        Bar,
+        Last = Bar + NumSupplies
+    };
 
     LineDisplayMode _lineDisplayMode[2];
 
-    ButtonSet<Switch0, Switch1, Switch2> _buttons;
+    Switch0 _switch0;
+    Switch1 _switch1;
+    Switch2 _switch2;
+    MyButtons _buttons;
+
+#ifndef NDEBUG
+    MyProfiler _profiler;
+    bool _profileStreaming = false;
+    uint8_t _profileEntry = 0;
+    uint8_t _profileStreamEntry = 0;
+#endif
 };
 
-typedef Menu<MyApp> MyMenu;
-const MenuOpType g_menuOps[] = {
+typedef StateMenu<MyApp> MyMenu;
+constexpr MyMenu::Op g_menuOps[] PROGMEM = {
     MyMenu::Show(bannerString), MyMenu::Pause(2000),
     
-    MyMenu::State( 0), MyMenu::XEQ(MyApp::display), MyMenu::Buttons(), 1, 2, 3,         // Normal display
+    MyMenu::State( 0), MyMenu::XEQ(MyApp::display), MyMenu::Buttons(MyMenu::RouteLong), // Normal display. Long press 1
+                       1, 2, 3, CalibrateState, FilterState, OutputsOnState,            // calibrates, 2 filters, 3 outputs on
     MyMenu::State( 1), MyMenu::XEQ(MyApp::nextLine0), MyMenu::Goto(0),                  // Show next display for line 0
     MyMenu::State( 2), MyMenu::XEQ(MyApp::nextLine1), MyMenu::Goto(0),                  // Show next display for line 1
-    MyMenu::State( 3), MyMenu::Show(curLimit), MyMenu::Goto(4),                         // Show cur limit
-    MyMenu::State( 4), MyMenu::XEQ(MyApp::curLimit0), MyMenu::Buttons(), 5, 6, 0,       // Set cur limit adjust to supply A
-    MyMenu::State( 5), MyMenu::XEQ(MyApp::curLimit1), MyMenu::Buttons(), 4, 6, 0,       // Set cur limit adjust to supply B
-    MyMenu::State( 6), MyMenu::XEQ(MyApp::adjustCurLimit), MyMenu::Buttons(), 7, 8, 9,  // Start cur limit adjust
+    MyMenu::State( 3), MyMenu::Show(curLimit), MyMenu::XEQ(MyApp::firstCurLimitSupply), // Show cur limit, starting at supply A
+                       MyMenu::Goto(4),
+    MyMenu::State( 4), MyMenu::XEQ(MyApp::curLimitSupply), MyMenu::Buttons(), 5, 6, 0,  // Choose the supply to adjust
+    MyMenu::State( 5), MyMenu::XEQ(MyApp::nextCurLimitSupply), MyMenu::Goto(4),         // Next supply
+    MyMenu::State( 6), MyMenu::XEQ(MyApp::adjustCurLimit),                              // Start coarse cur limit adjust, inc
+                       MyMenu::Buttons(MyMenu::RouteRepeat), 7, 8, FineAdjustState,     // and dec repeat
     MyMenu::State( 7), MyMenu::XEQ(MyApp::incCurLimit), MyMenu::Goto(6),                // inc cur limit
     MyMenu::State( 8), MyMenu::XEQ(MyApp::decCurLimit), MyMenu::Goto(6),                // dec cur limit
     MyMenu::State( 9), MyMenu::Show(accept), MyMenu::XEQ(MyApp::showCurLimit),          // Ask to accept new cur limit settings
-                       MyMenu::Buttons(), 10, 11, 11,
+                       MyMenu::Buttons(), 10, 11, DiagnosticsState,
     MyMenu::State(10), MyMenu::Show(accepted), MyMenu::XEQ(MyApp::acceptCurLimit),      // Accept new cur limit settings
                        MyMenu::Pause(2000), MyMenu::Goto(0),
     MyMenu::State(11), MyMenu::XEQ(MyApp::rejectCurLimit), MyMenu::Goto(0),             // Reject new cur limit settings
+#ifndef NDEBUG
+    MyMenu::State(12), MyMenu::XEQ(MyApp::diagnostics), MyMenu::Buttons(),              // Profile page
+                       13, 14, CaptureState,
+    MyMenu::State(13), MyMenu::XEQ(MyApp::nextProfileEntry), MyMenu::Goto(12),          // Show next profile entry
+    MyMenu::State(14), MyMenu::XEQ(MyApp::toggleProfileStreaming), MyMenu::Goto(12),    // Stream profile on serial on/off
+#endif
+    MyMenu::State(CaptureState), MyMenu::XEQ(MyApp::capture), MyMenu::Buttons(),        // Capture page
+                       CaptureState + 1, CaptureState + 2, 11,
+    MyMenu::State(CaptureState + 1), MyMenu::XEQ(MyApp::armCapture),                    // Arm the capture, or rearm it
+                       MyMenu::Goto(CaptureState),
+    MyMenu::State(CaptureState + 2), MyMenu::XEQ(MyApp::dumpCapture),                   // Dump a frozen capture on serial
+                       MyMenu::Goto(CaptureState),
+    MyMenu::State(OutputsOnState), MyMenu::Show(outputsOn),                             // Turn tripped outputs back on
+                       MyMenu::XEQ(MyApp::enableOutputs), MyMenu::Pause(1000), MyMenu::Goto(0),
+    MyMenu::State(FineAdjustState), MyMenu::XEQ(MyApp::fineAdjustCurLimit),             // Fine cur limit adjust
+                       MyMenu::Buttons(MyMenu::RouteRepeat),
+                       FineAdjustState + 1, FineAdjustState + 2, 9,
+    MyMenu::State(FineAdjustState + 1), MyMenu::XEQ(MyApp::fineIncCurLimit),            // fine inc cur limit
+                       MyMenu::Goto(FineAdjustState),
+    MyMenu::State(FineAdjustState + 2), MyMenu::XEQ(MyApp::fineDecCurLimit),            // fine dec cur limit
+                       MyMenu::Goto(FineAdjustState),
+    MyMenu::State(CalibrateState), MyMenu::XEQ(MyApp::firstCalibrationChannel),         // Calibration, starting at input a
+                       MyMenu::Goto(CalibrateState + 1),
+    MyMenu::State(CalibrateState + 1), MyMenu::XEQ(MyApp::calibration),                 // Choose the channel to calibrate
+                       MyMenu::Buttons(), CalibrateState + 2, CalibrateState + 3, CalibrateState + 8,
+    MyMenu::State(CalibrateState + 2), MyMenu::XEQ(MyApp::nextCalibrationChannel),      // Next channel
+                       MyMenu::Goto(CalibrateState + 1),
+    MyMenu::State(CalibrateState + 3), MyMenu::XEQ(MyApp::startCalibrationReference),   // Start setting the reference
+                       MyMenu::Goto(CalibrateState + 4),
+    MyMenu::State(CalibrateState + 4), MyMenu::XEQ(MyApp::calibration),                 // Reference inc and dec repeat,
+                       MyMenu::Buttons(MyMenu::RouteRepeat),                            // then calibrate to it
+                       CalibrateState + 5, CalibrateState + 6, CalibrateState + 7,
+    MyMenu::State(CalibrateState + 5), MyMenu::XEQ(MyApp::incCalibrationReference),     // inc reference
+                       MyMenu::Goto(CalibrateState + 4),
+    MyMenu::State(CalibrateState + 6), MyMenu::XEQ(MyApp::decCalibrationReference),     // dec reference
+                       MyMenu::Goto(CalibrateState + 4),
+    MyMenu::State(CalibrateState + 7), MyMenu::XEQ(MyApp::applyCalibration),            // Zero or span the channel
+                       MyMenu::Goto(CalibrateState + 1),
+    MyMenu::State(CalibrateState + 8), MyMenu::Show(accept),                            // Ask to accept the calibration,
+                       MyMenu::Buttons(), CalibrateState + 9, CalibrateState + 10,      // or go back to it
+                       CalibrateState + 1,
+    MyMenu::State(CalibrateState + 9), MyMenu::Show(calibrated),                        // Accept and save the calibration
+                       MyMenu::XEQ(MyApp::acceptCalibration), MyMenu::Pause(2000), MyMenu::Goto(0),
+    MyMenu::State(CalibrateState + 10), MyMenu::XEQ(MyApp::rejectCalibration),          // Reject it, back to the last saved
+                       MyMenu::Goto(0),
+    MyMenu::State(FilterState), MyMenu::XEQ(MyApp::firstFilterChannel),                 // Filters, starting at input a
+                       MyMenu::Goto(FilterState + 1),
+    MyMenu::State(FilterState + 1), MyMenu::XEQ(MyApp::filters), MyMenu::Buttons(),     // Choose the input and its filter
+                       FilterState + 2, FilterState + 3, FilterState + 4,
+    MyMenu::State(FilterState + 2), MyMenu::XEQ(MyApp::nextFilterChannel),              // Next input
+                       MyMenu::Goto(FilterState + 1),
+    MyMenu::State(FilterState + 3), MyMenu::XEQ(MyApp::nextFilter),                     // Next filter for it
+                       MyMenu::Goto(FilterState + 1),
+    MyMenu::State(FilterState + 4), MyMenu::Show(accept),                               // Ask to accept the filters,
+                       MyMenu::Buttons(), FilterState + 5, FilterState + 6,             // or go back to them
+                       FilterState + 1,
+    MyMenu::State(FilterState + 5), MyMenu::Show(filtersSet),                           // Accept and save the filters
+                       MyMenu::XEQ(MyApp::acceptFilters), MyMenu::Pause(2000), MyMenu::Goto(0),
+    MyMenu::State(FilterState + 6), MyMenu::XEQ(MyApp::rejectFilters),                  // Reject them, back to the last saved
+                       MyMenu::Goto(0),
     MyMenu::End()
 };
 
+typedef StateMenuIndex<MyMenu::Op, g_menuOps> MyMenuIndex;
+
+const MyScheduler::Task g_tasks[NumTasks] PROGMEM = {
+    { MyApp::protectionTask, ProtectionDeadlineMs },    // Sensor readings and limit checks
+    { MyApp::acquisitionTask, AcquisitionDeadlineMs },  // Analog inputs
+    { MyApp::displayTask, DisplayDeadlineMs },          // Render into the frame buffer
+    { MyApp::lcdTask, LCDDeadlineMs },                  // Send changes to the LCD, a few at a time
+    { MyApp::remoteTask, RemoteDeadlineMs },            // Remote commands, one at a time
+};
+
+// Remote commands. Numbers in replies are in V, A and W, limits in mA.
+//
+//  *IDN?                       identity
+//  *OPC?                       1, once everything before it has run
+//  CURRent:LIMit <supply>,<mA> set and save a supply's current limit
+//  CURRent:LIMit? <supply>
+//  OUTPut ON|OFF               turn tripped supplies back on, or all off
+//  OUTPut? <supply>            1 unless it's shut down
+//  MEASure:VOLTage? <supply>
+//  MEASure:CURRent? <supply>
+//  MEASure:POWer? <supply>
+const char headerIdentity[] PROGMEM = "*IDN?";
+const char headerOperationComplete[] PROGMEM = "*OPC?";
+const char headerCurrentLimitSet[] PROGMEM = "CURRent:LIMit";
+const char headerCurrentLimit[] PROGMEM = "CURRent:LIMit?";
+const char headerOutputSet[] PROGMEM = "OUTPut";
+const char headerOutput[] PROGMEM = "OUTPut?";
+const char headerMeasureVoltage[] PROGMEM = "MEASure:VOLTage?";
+const char headerMeasureCurrent[] PROGMEM = "MEASure:CURRent?";
+const char headerMeasurePower[] PROGMEM = "MEASure:POWer?";
+
+const MyRemote::Command g_remoteCommands[] PROGMEM = {
+    { headerIdentity, MyApp::remoteIdentify },
+    { headerOperationComplete, MyApp::remoteOperationComplete },
+    { headerCurrentLimitSet, MyApp::remoteSetCurrentLimit },
+    { headerCurrentLimit, MyApp::remoteCurrentLimit },
+    { headerOutputSet, MyApp::remoteOutput },
+    { headerOutput, MyApp::remoteOutputState },
+    { headerMeasureVoltage, MyApp::remoteMeasureVoltage },
+    { headerMeasureCurrent, MyApp::remoteMeasureCurrent },
+    { headerMeasurePower, MyApp::remoteMeasurePower },
+};
+const uint8_t NumRemoteCommands = sizeof(g_remoteCommands) / sizeof(g_remoteCommands[0]);
+
 MyApp g_app;
 
 MyApp::MyApp()
-    : Menu(&_buttons, g_menuOps, this)
-    , _timerEvent(100)
-    , _captureSensorValues(true)
-    , _adc(0, ADC_PS_DIV128, ADC_REF_AVCC)
-    , _adcCurrentChannel(0)
-    , _adcCurrentSamples(0)
-    , _captureADCValue(false)
-    , _currentLimitIndex{ numCurLimitValues - 1, numCurLimitValues - 1 }
-    , _currentLimitAdjustIndex{ numCurLimitValues - 1, numCurLimitValues - 1 }
-    , _lineDisplayMode{ LineDisplayMode::PS1VA, LineDisplayMode::PS2VA }
-{
-    _currentSensor[0].setAddress(0x40);
-    _currentSensor[1].setAddress(0x41);
-    _adc.setEnabled(true);
+    : MyMenu(g_menuOps, MyMenuIndex::Offsets, this)
+    , _timerEvent(SensorPollMs)
+    , _telemetry(_serial)
+    , _telemetryEvent(TelemetryPeriodMs)
+    , _remote(g_remoteCommands, NumRemoteCommands, this, _serial)
+    , _hiccupEvent(HiccupTickMs)
+    , _scheduler(g_tasks, this)
+    , _lineDisplayMode{ LineDisplayMode::PSVA, static_cast<LineDisplayMode>(static_cast<uint8_t>(LineDisplayMode::PSVA) + 1) }
+{
+#ifndef NDEBUG
+    _profiler.start();
+#endif
+    _lcd.init();
+    defineBarCharacters();
+    _serial.init(SerialBaud);
+    _serial.armStartWake();
+    _twi.init();
+    for (uint8_t i = 0; i < NumSupplies; ++i) {
+        _currentLimitMa[i] = CurrentLimitMaxMa;
+        _currentLimitAdjustMa[i] = CurrentLimitMaxMa;
+    }
+    for (uint8_t i = 0; i < ADCNumChannels; ++i) {
+        _savedADCFilter[i] = pgm_read_byte(&ADCDefaultFilters[i]);
+        _adcFilters.set(i, _savedADCFilter[i]);
+    }
+    loadSettings();
+    for (uint8_t i = 0; i < NumSupplies; ++i) {
+        _currentSensor[i].init(&_twi, MySupplies::sensorAddress(i));
+        _overcurrentMonitor.setSensor(i, &_twi, MySupplies::sensorAddress(i));
+    }
+    updateCalibration();
+
+    // Whatever the watchdog reset the chip for may not have gone away
+    if (Watchdog::causedReset()) {
+        for (uint8_t i = 0; i < NumSupplies; ++i) {
+            _hiccup[i] = Hiccup::Latched;
+        }
+        _trippedSupplies = (1 << NumSupplies) - 1;
+        _statusLED = true;
+        postError('W', Watchdog::resetFlags(), ErrorConditionWarning);
+    }
 
     sei();
-    _shutdownA = false;
-    _shutdownB = false;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        shutdownSupplies();
+    }
     System::startEventTimer(&_timerEvent);
-    _currentSensor[0].setConfiguration(INA219::Range16V);
-    _currentSensor[1].setConfiguration(INA219::Range16V);
+    if (TelemetryPeriodMs) {
+        System::startEventTimer(&_telemetryEvent);
+    }
+    if (HiccupRetries) {
+        System::startEventTimer(&_hiccupEvent);
+    }
+    for (uint8_t i = 0; i < NumSupplies; ++i) {
+        _currentSensor[i].setConfiguration(SensorConfiguration);
+        _currentSensor[i].setCalibration(SensorCalibration);
+    }
+
+    // The protection timer always runs, it's also the scheduler's clock
+    _overcurrentMonitor.setStoppedUs(FastTripStoppedUs);
+    _overcurrentMonitor.start(FastTrip);
+    Watchdog::arm(ProtectionWatchdogTimeout);
 
-    _adc.startConversion();
+    _adcSampler.start(ADCNoiseReduction ? MyADCSampler::Trigger::Sleep : MyADCSampler::Trigger::Timer0Overflow);
+}
+
+// Anything out of range, e.g. from an older layout, keeps its default
+void MyApp::loadSettings()
+{
+    Settings settings;
+    if (!_settingsStore.load(settings)) {
+        return;
+    }
+    for (uint8_t i = 0; i < NumSupplies; ++i) {
+        if (settings._currentLimitMa[i] >= CurrentLimitMinMa && settings._currentLimitMa[i] <= CurrentLimitMaxMa) {
+            _currentLimitMa[i] = settings._currentLimitMa[i];
+            _currentLimitAdjustMa[i] = settings._currentLimitMa[i];
+        }
+    }
+    for (uint8_t i = 0; i < 2; ++i) {
+        if (settings._lineDisplayMode[i] < static_cast<uint8_t>(LineDisplayMode::Last)) {
+            _lineDisplayMode[i] = static_cast<LineDisplayMode>(settings._lineDisplayMode[i]);
+        }
+    }
+    for (uint8_t i = 0; i < NumCalibrations; ++i) {
+        if (settings._calibration[i].valid(CalibrationMaxOffset)) {
+            _calibration[i] = settings._calibration[i];
+            _savedCalibration[i] = settings._calibration[i];
+        }
+    }
+    for (uint8_t i = 0; i < ADCNumChannels; ++i) {
+        if (MyADCFilters::valid(settings._adcFilter[i])) {
+            _savedADCFilter[i] = settings._adcFilter[i];
+            _adcFilters.set(i, settings._adcFilter[i]);
+        }
+    }
+}
+
+void MyApp::saveSettings()
+{
+    Settings settings;
+    for (uint8_t i = 0; i < NumSupplies; ++i) {
+        settings._currentLimitMa[i] = _currentLimitMa[i];
+    }
+    for (uint8_t i = 0; i < 2; ++i) {
+        settings._lineDisplayMode[i] = static_cast<uint8_t>(_lineDisplayMode[i]);
+    }
+    for (uint8_t i = 0; i < NumCalibrations; ++i) {
+        settings._calibration[i] = _savedCalibration[i];
+    }
+    for (uint8_t i = 0; i < ADCNumChannels; ++i) {
+        settings._adcFilter[i] = _savedADCFilter[i];
+    }
+    _settingsStore.save(settings);
+}
+
+// The supply's letter, then ':', or '?' while its sensor is being retried
+// and the values are the last it gave. A failed sensor has no values.
+void MyApp::showSupplyLabel(uint8_t supply)
+{
+    _lcd << static_cast<char>(supply + 'A') << ((_sensorHealth[supply] == AsyncINA219::Health::Good) ? ':' : '?');
 }
 
 void MyApp::showPSVoltageAndCurrent(uint8_t channel, uint8_t line)
 {
-    _lcd << TextLCDSetLine(line) << static_cast<char>(channel + 'A') << ':';
-    _lcd << FixedPoint8_8(_busMilliVolts[channel], 1000).toString(2) << FS("v ");
-    _lcd << FixedPoint8_8(_shuntMilliAmps[channel], 10).toString(1) << FS("ma");
+    _lcd << FrameSetLine(line);
+    showSupplyLabel(channel);
+    if (_sensorHealth[channel] == AsyncINA219::Health::Failed) {
+        _lcd << FS(" sensor fault");
+        return;
+    }
+    _lcd << Decimal(_shownBusMilliVolts[channel], 3, 2, 5) << FS("v ");
+    _lcd << Decimal(_shownMilliAmps[channel], 1, 1, 5) << FS("ma");
 }
 
-void MyApp::showPSCurrents(uint8_t line)
+// The pair from first, or just first if it's the last supply
+void MyApp::showPSCurrents(uint8_t first, uint8_t line)
 {
-    _lcd << TextLCDSetLine(line);
-    _lcd << FS("A:") << FixedPoint8_8(_shuntMilliAmps[0], 10).toString(1) << FS("ma");
-    _lcd << FS(" B:") << FixedPoint8_8(_shuntMilliAmps[1], 10).toString(1) << FS("ma");
+    _lcd << FrameSetLine(line);
+    for (uint8_t i = first; i < first + 2 && i < NumSupplies; ++i) {
+        if (i != first) {
+            _lcd << ' ';
+        }
+        showSupplyLabel(i);
+        if (_sensorHealth[i] == AsyncINA219::Health::Failed) {
+            _lcd << FS("----");
+        } else {
+            _lcd << Decimal(_shownMilliAmps[i], 1, 1) << FS("ma");
+        }
+    }
 }
 
 void MyApp::showTestVoltages(uint8_t channel0, uint8_t channel1, uint8_t line)
 {
-    _lcd << TextLCDSetLine(line);
-    _lcd << static_cast<char>('a' + channel0) << ':' << FixedPoint8_8(_adcVoltage[channel0], 1000).toString(2) << FS("v ");
-    _lcd << static_cast<char>('a' + channel1) << ':' << FixedPoint8_8(_adcVoltage[channel1], 1000).toString(2) << FS("v");
+    _lcd << FrameSetLine(line);
+    _lcd << static_cast<char>('a' + channel0) << ':' << Decimal(_shownADCVoltage[channel0], 3, 2) << FS("v ");
+    _lcd << static_cast<char>('a' + channel1) << ':' << Decimal(_shownADCVoltage[channel1], 3, 2) << FS("v");
+}
+
+void MyApp::showTripLatency(uint8_t first, uint8_t line)
+{
+    _lcd << FrameSetLine(line);
+    _lcd << FS("Trip ") << static_cast<char>('A' + first) << ':' << static_cast<uint16_t>(_overcurrentMonitor.maxLatencyUs(first) / 1000) << FS("ms");
+    if (first + 1 < NumSupplies) {
+        _lcd << ' ' << static_cast<char>('B' + first) << ':' << static_cast<uint16_t>(_overcurrentMonitor.maxLatencyUs(first + 1) / 1000) << FS("ms");
+    }
+}
+
+void MyApp::showDeadlineMisses(uint8_t line)
+{
+    _lcd << FrameSetLine(line) << FS("Late");
+    for (uint8_t i = 0; i < NumTasks; ++i) {
+        _lcd << ' ' << static_cast<uint16_t>(_scheduler.misses(i));
+    }
+}
+
+// A bar of rows 1-6, so bars on the two lines don't run together
+void MyApp::defineBarCharacters()
+{
+    uint8_t rows[8] = { };
+    for (uint8_t columns = 1; columns <= BarCellColumns; ++columns) {
+        for (uint8_t i = 1; i < 7; ++i) {
+            rows[i] = ~(0x1f >> columns) & 0x1f;
+        }
+        _lcd.defineCharacter(columns, rows);
+    }
+}
+
+// In columns of the limit, rounded down, so a full bar is at the limit.
+// The shown current is in 0.1mA.
+void MyApp::showCurrentBar(uint8_t supply, uint8_t line)
+{
+    _lcd << FrameSetLine(line);
+    if (_sensorHealth[supply] == AsyncINA219::Health::Failed) {
+        showSupplyLabel(supply);
+        _lcd << FS(" sensor fault");
+        return;
+    }
+    const uint8_t Columns = BarCells * BarCellColumns;
+    uint32_t columns = static_cast<uint32_t>(_shownMilliAmps[supply]) * Columns / (_currentLimitMa[supply] * 10U);
+    uint8_t remaining = (columns < Columns) ? columns : Columns;
+    for (uint8_t i = 0; i < BarCells; ++i) {
+        uint8_t cell = (remaining < BarCellColumns) ? remaining : BarCellColumns;
+        remaining -= cell;
+        _lcd << (cell ? static_cast<char>(cell) : ' ');
+    }
 }
 
 void MyApp::showCurrentLimit(uint8_t supply, CurrentLimitArrow arrow)
 {
     resetCurrentLimit();
     _displayEnabled = false;
-    _lcd << TextLCDClearLine(1)
+    _lcd << FrameSetLine(1)
          << ((arrow == CurrentLimitArrow::Supply) ? '\x7e' : ' ')
-         << static_cast<char>('A' + supply) << ':' << curLimitAdjustMa(supply) << FS("ma")
-         << ((arrow == CurrentLimitArrow::Current) ? '\x7f' : ' ');
+         << static_cast<char>('A' + supply) << ':' << _currentLimitAdjustMa[supply] << FS("ma");
+    if (arrow == CurrentLimitArrow::Coarse || arrow == CurrentLimitArrow::Fine) {
+        _lcd << '\x7f' << static_cast<uint16_t>((arrow == CurrentLimitArrow::Coarse) ? CurrentLimitCoarseMa : CurrentLimitFineMa) << FS("ma");
+    }
+    _scheduler.ready(TaskLCD);
+}
+
+// Onto the next multiple of the step up or down, so a coarse step from a
+// fine setting lands back on the coarse grid
+void MyApp::stepCurrentLimit(bool up, uint8_t stepMa)
+{
+    uint16_t ma = _currentLimitAdjustMa[_currentLimitAdjustSupply];
+    ma = up ? (ma / stepMa + 1) * stepMa : (ma - 1) / stepMa * stepMa;
+    if (ma < CurrentLimitMinMa) {
+        ma = CurrentLimitMinMa;
+    } else if (ma > CurrentLimitMaxMa) {
+        ma = CurrentLimitMaxMa;
+    }
+    _currentLimitAdjustMa[_currentLimitAdjustSupply] = ma;
+}
+
+// A frame for the readings once the last one, for whatever reason, was at
+// least DisplayFrameMs ago, so a burst of changes is drawn once. Anything
+// else, like a button press, is drawn straight away.
+void MyApp::pollDisplay()
+{
+    if (_displayWanted && static_cast<uint16_t>(ticks() - _displayFrameTick) >= DisplayFrameMs) {
+        _scheduler.ready(TaskDisplay);
+    }
 }
 
 void MyApp::updateDisplay()
 {
-    if (!_displayEnabled || !_needsDisplay) {
+    PROFILE(Display);
+    _displayWanted = false;
+    _displayFrameTick = ticks();
+    if (showError() || !_displayEnabled) {
         return;
     }
-    _lcd << TextLCDClear();
-    _needsDisplay = false;
+    _scheduler.ready(TaskLCD);
+
+    switch (_displayPage) {
+        case DisplayPage::Lines: break;
+#ifndef NDEBUG
+        case DisplayPage::Profile: showProfile(); return;
+#endif
+        case DisplayPage::Capture: showCapture(); return;
+        case DisplayPage::Calibration: showCalibration(); return;
+        case DisplayPage::Filters: showFilters(); return;
+        default: return;
+    }
     
     for (uint8_t i = 0; i < 2; ++i) {
-        switch(_lineDisplayMode[i]) {
-            case LineDisplayMode::PS1VA: showPSVoltageAndCurrent(0, i); break;
-            case LineDisplayMode::PS2VA: showPSVoltageAndCurrent(1, i); break;
-            case LineDisplayMode::PS12A: showPSCurrents(i); break;
-            case LineDisplayMode::V1V2: showTestVoltages(0, 1, i); break;
-            case LineDisplayMode::V3V4: showTestVoltages(2, 3, i); break;
-            default: break;
+        uint8_t mode = static_cast<uint8_t>(_lineDisplayMode[i]);
+        if (mode < static_cast<uint8_t>(LineDisplayMode::PSCurrents)) {
+            showPSVoltageAndCurrent(mode, i);
+        } else if (mode < static_cast<uint8_t>(LineDisplayMode::V1V2)) {
+            showPSCurrents((mode - static_cast<uint8_t>(LineDisplayMode::PSCurrents)) * 2, i);
+        } else if (mode >= static_cast<uint8_t>(LineDisplayMode::Trip) && mode < static_cast<uint8_t>(LineDisplayMode::Late)) {
+            showTripLatency((mode - static_cast<uint8_t>(LineDisplayMode::Trip)) * 2, i);
+        } else if (mode >= static_cast<uint8_t>(LineDisplayMode::Bar)) {
+            showCurrentBar(mode - static_cast<uint8_t>(LineDisplayMode::Bar), i);
+        } else {
+            switch(_lineDisplayMode[i]) {
+                case LineDisplayMode::V1V2: showTestVoltages(0, 1, i); break;
+                case LineDisplayMode::V3V4: showTestVoltages(2, 3, i); break;
+                case LineDisplayMode::Late: showDeadlineMisses(i); break;
+                default: break;
+            }
         }
     }
 }
 
 void MyApp::updateADC()
 {
-    _adcAccumulator[_adcCurrentChannel++] += _adc.lastConversion10Bit();
-    if (_adcCurrentChannel >= 4) {
-        _adcCurrentChannel = 0;
-        if (++_adcCurrentSamples >= ADCAverageCount) {
-            _adcCurrentSamples = 0;
-            for (uint8_t i = 0; i < 4; ++i) {
-                uint32_t v = (_adcAccumulator[i] + ADCAverageCount / 2) / ADCAverageCount;
-                v *= 5000;
-                v /= 1024;
-                _adcVoltage[i] = v;
-                _adcAccumulator[i] = 0;
-            }
+    PROFILE(Analog);
+    PROFILE_SERVICED(Analog);
+
+    // Drain whatever the ADC interrupt has collected since the last pass,
+    // with a new value for every sample
+    uint16_t sample;
+    for (uint8_t i = 0; i < ADCNumChannels; ++i) {
+        while (_adcSampler.read(i, sample)) {
+            int16_t milliVolts = _calibration[CalibrationAnalog + i].applyScaled(_adcFilters.add(i, sample), _adcScale[i]);
+            _adcVoltage[i] = (milliVolts > 0) ? milliVolts : 0;
+        }
+        if (MySensorPoller::outside(_adcVoltage[i], _shownADCVoltage[i], DisplayMilliVoltsDeadband)) {
+            invalidateReadings();
         }
     }
+    if (_adcSampler.readBandgap(sample) && _bandgap.add(sample)) {
+        updateAVCC();
+    }
 }
 
-void MyApp::updateCurrentSensor()
+// AVCC from the latest bandgap value, if there's been one and it's in
+// range, then each input's scale from it
+void MyApp::updateAVCC()
 {
-    for (uint8_t i = 0; i < 2; ++i) {
-        int16_t value = _currentSensor[i].busMilliVolts();
-        if (value != _busMilliVolts[i]) {
-            _busMilliVolts[i] = value;
-            _needsDisplay = true;
-        }
-        int32_t v = _currentSensor[i].shuntMilliVolts();
-        if (v < 0) {
-            v = 0;
-        }
-        v = (v * 100 + 165) / 330;
-        if (v != _shuntMilliAmps[i]) {
-            _shuntMilliAmps[i] = v;
-            _needsDisplay = true;
-        }
-        if (_shuntMilliAmps[i] > (int16_t) curLimitMa(i) * 10) {
-            if (_overCurrentCount[i]++ > 3) {
-                setCurrentLimit(i);
-            }
-        } else {
-            _overCurrentCount[i] = 0;
+    uint16_t value = _bandgap.value();
+    if (value) {
+        uint32_t bandgap = static_cast<uint32_t>(_calibration[CalibrationAVCC].applyGain(BandgapMilliVolts)) << MyBandgapOversampler::OutputBits;
+        uint32_t milliVolts = (bandgap + value / 2) / value;
+        if (milliVolts >= AVCCMinMilliVolts && milliVolts <= AVCCMaxMilliVolts) {
+            _avccMilliVolts = milliVolts;
+        }
+    }
+    for (uint8_t i = 0; i < ADCNumChannels; ++i) {
+        _adcScale[i] = _calibration[CalibrationAnalog + i].applyGain(_avccMilliVolts);
+    }
+}
+
+// Returns true while either sensor still has a read in progress
+bool MyApp::updateCurrentSensor()
+{
+    PROFILE(Sensor);
+    bool reading = false;
+    for (uint8_t i = 0; i < NumSupplies; ++i) {
+        bool complete = _currentSensor[i].readComplete();
+        updateSensorHealth(i);
+        if (!complete) {
+            reading |= _currentSensor[i].reading();
+            continue;
+        }
+        const Calibration& voltage = _calibration[CalibrationBusVoltage + i];
+        const Calibration& current = _calibration[CalibrationCurrent + i];
+        int16_t value = voltage.apply(_currentSensor[i].busMilliVolts());
+        _busMilliVolts[i] = value;
+        int16_t v = _currentSensor[i].shuntVoltage();
+        int16_t threshold = _overcurrentMonitor.threshold(i);
+        if (!FastTrip && v > threshold) {
+            setCurrentLimit(i);
+        }
+        bool active = MySensorPoller::outside(v, _sensorShuntReference[i], SensorShuntDeadband);
+        active |= MySensorPoller::outside(value, _sensorMilliVoltsReference[i], SensorMilliVoltsDeadband);
+        _sensorPoller.settled(i, active || v >= threshold - (threshold >> SensorNearLimitShift));
+        int16_t milliAmps = current.apply(_currentSensor[i].current());
+        if (milliAmps < 0) {
+            milliAmps = 0;
+        }
+        _shuntMilliAmps[i] = milliAmps;
+        bool moved = MySensorPoller::outside(value, _shownBusMilliVolts[i], DisplayMilliVoltsDeadband);
+        if (MySensorPoller::outside(milliAmps, _shownMilliAmps[i], DisplayCurrentDeadband) || moved) {
+            invalidateReadings();
+        }
+
+        // The power register is the sensor's own product of the two, so
+        // it takes both gains. The offsets are left out.
+        _milliWatts[i] = current.applyGain(voltage.applyGain(_currentSensor[i].power() * SensorPowerLsbMilliWatts));
+    }
+    if (_sensorsDue) {
+        startSensorReads();
+        reading = true;
+    }
+    return reading;
+}
+
+// A sensor that stops answering is read every poll until it answers again
+// or has failed. With a failed sensor the supply can't be protected, so it's
+// tripped, and stays tripped while the sensor is failed. Hiccup mode keeps
+// trying it, or the outputs can be turned back on, once it's answering.
+void MyApp::updateSensorHealth(uint8_t supply)
+{
+    AsyncINA219::Health health = _currentSensor[supply].health();
+    if (health == AsyncINA219::Health::Failed && !(_trippedSupplies & (1 << supply))) {
+        setCurrentLimit(supply);
+    }
+    if (health == _sensorHealth[supply]) {
+        return;
+    }
+    if (health == AsyncINA219::Health::Failed) {
+        postError('I', _currentSensor[supply].address(), ErrorConditionWarning);
+    }
+    if (health != AsyncINA219::Health::Good) {
+        _sensorPoller.wake(supply);
+    }
+    _sensorHealth[supply] = health;
+    invalidateDisplay();
+}
+
+// Button events from the Timer2 tick go straight to the menu
+void MyApp::dispatchButtons()
+{
+    EventType type;
+    uint8_t button;
+    while (_buttons.read(type, button)) {
+        if (_fatal) {
+            continue;   // The menu is stopped until the reset
+        }
+        PROFILE(Menu);
+        MyMenu::handleEvent(type, reinterpret_cast<EventParam>(static_cast<uintptr_t>(button)));
+    }
+}
+
+// A trip seen while On or Watching starts the off time, or latches the
+// supply off once it's out of retries. The retry count only starts over
+// when a supply has stayed on through the watch.
+void MyApp::updateHiccup()
+{
+    uint8_t tripped = 0;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        tripped = _trippedSupplies;
+    }
+    for (uint8_t i = 0; i < NumSupplies; ++i) {
+        bool trip = tripped & (1 << i);
+        switch (_hiccup[i]) {
+            case Hiccup::Watch:
+                if (!trip) {
+                    if (--_hiccupCountdown[i] == 0) {
+                        _hiccup[i] = Hiccup::On;
+                        _hiccupRetries[i] = 0;
+                    }
+                    break;
+                }
+                // Fall through, it tripped again straight away
+            case Hiccup::On:
+                if (!trip) {
+                    break;
+                }
+                if (_hiccupRetries[i] >= HiccupRetries) {
+                    _hiccup[i] = Hiccup::Latched;
+                    break;
+                }
+                _hiccup[i] = Hiccup::Off;
+                _hiccupCountdown[i] = (HiccupOffMs << ((_hiccupRetries[i] < HiccupMaxBackoff) ? _hiccupRetries[i] : HiccupMaxBackoff)) / HiccupTickMs;
+                break;
+            case Hiccup::Off:
+                if (--_hiccupCountdown[i] == 0) {
+                    ++_hiccupRetries[i];
+                    _hiccup[i] = Hiccup::Watch;
+                    _hiccupCountdown[i] = HiccupWatchMs / HiccupTickMs;
+                    enableSupply(i);
+                }
+                break;
+            case Hiccup::Latched:
+                break;
+        }
+    }
+}
+
+// From the sensor timer, starts the reads that are due
+void MyApp::pollCurrentSensors()
+{
+    for (uint8_t i = 0; i < NumSupplies; ++i) {
+        if (FastTrip && MySensorPoller::outside(_overcurrentMonitor.shuntVoltage(i), _sensorShuntReference[i], SensorShuntDeadband)) {
+            _sensorPoller.wake(i);
+        }
+        if (_sensorPoller.due(i)) {
+            _sensorsDue |= 1 << i;
+        }
+    }
+    startSensorReads();
+    _scheduler.ready(TaskProtection);
+}
+
+// Up to SensorReadsInFlight at once, round robin from the supply after the
+// last one started
+void MyApp::startSensorReads()
+{
+    uint8_t reading = 0;
+    for (uint8_t i = 0; i < NumSupplies; ++i) {
+        reading += _currentSensor[i].reading();
+    }
+    for (uint8_t n = 0; n < NumSupplies && _sensorsDue && reading < SensorReadsInFlight; ++n) {
+        uint8_t i = _nextSensor;
+        _nextSensor = (i + 1 < NumSupplies) ? i + 1 : 0;
+        if ((_sensorsDue & (1 << i)) && _currentSensor[i].startRead()) {
+            _sensorsDue &= ~(1 << i);
+            ++reading;
+        }
+    }
+}
+
+// Protection can't be trusted once the stack runs into the static data
+void MyApp::checkStack()
+{
+    if (!_stackMonitor.check()) {
+        postError('S', _stackMonitor.unused(), ErrorConditionFatal);
+    }
+    if (TelemetryPeriodMs) {
+        sendMemory();
+        sendErrors();
+    }
+}
+
+// Counted and queued for the display. A fatal error shuts the supplies
+// down first, then arms the watchdog and goes straight on the display.
+void MyApp::postError(char code, uint32_t value, ErrorConditionType type)
+{
+    _errors.post(code, value, type);
+    if (type == ErrorConditionFatal) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            _trippedSupplies = (1 << NumSupplies) - 1;
+            shutdownSupplies();
+        }
+        _statusLED = true;
+        if (!_fatal) {
+            _fatal = true;
+            Watchdog::arm(FatalResetTimeout);
+            _error = { code, value, type };
+            _errorShowing = true;
+        }
+    }
+    invalidateDisplay();
+}
+
+// Returns true until the LCD is up to date
+bool MyApp::flushDisplay()
+{
+    PROFILE(LCD);
+    return !_lcd.flush(LCDWritesPerPass);
+}
+
+// Measurement record, payload is all 16 bit:
+//  dropped record count
+//  bus mV, shunt 0.1mA, mW for each supply from A
+//  analog inputs a-d in mV
+void MyApp::sendTelemetry()
+{
+    if (!_telemetry.begin(TelemetryRecordMeasurements, 2 + NumSupplies * 6 + ADCNumChannels * 2)) {
+        return;
+    }
+    _telemetry.put16(_telemetry.dropped());
+    for (uint8_t i = 0; i < NumSupplies; ++i) {
+        _telemetry.put16(_busMilliVolts[i]);
+        _telemetry.put16(_shuntMilliAmps[i]);
+        _telemetry.put16(_milliWatts[i]);
+    }
+    for (uint8_t i = 0; i < ADCNumChannels; ++i) {
+        _telemetry.put16(_adcVoltage[i]);
+    }
+    _telemetry.end();
+}
+
+// Memory record, payload is all 16 bit, in bytes:
+//  free below the stack pointer at the last check
+//  never used since reset
+//  deepest stack
+void MyApp::sendMemory()
+{
+    if (!_telemetry.begin(TelemetryRecordMemory, 6)) {
+        return;
+    }
+    _telemetry.put16(_stackMonitor.free());
+    _telemetry.put16(_stackMonitor.unused());
+    _telemetry.put16(_stackMonitor.maxDepth());
+    _telemetry.end();
+}
+
+// Error record, payload is all 16 bit: the notes, warnings and fatal errors
+// posted since reset, then how many of them the queue had to drop
+void MyApp::sendErrors()
+{
+    if (!_telemetry.begin(TelemetryRecordErrors, MyErrorQueue::NumTypes * 2 + 2)) {
+        return;
+    }
+    for (uint8_t i = 0; i < MyErrorQueue::NumTypes; ++i) {
+        _telemetry.put16(_errors.count(static_cast<ErrorConditionType>(i)));
+    }
+    _telemetry.put16(_errors.dropped());
+    _telemetry.end();
+}
+
+// Takes what has come in until there's a line, then runs it a command at a
+// time as there's room for the replies. Lost characters are checked for
+// between each one taken, so a loss goes with the line it was lost from.
+bool MyApp::updateRemote()
+{
+    PROFILE(Remote);
+    uint8_t c;
+    while (!_remote.ready()) {
+        if (_serial.takeReceiveError()) {
+            _remote.receiveError();
+        }
+        if (!_serial.read(c)) {
+            break;
         }
+        _remote.add(c);
     }
+    if (!_remote.ready()) {
+        return false;
+    }
+    if (_serial.room() >= RemoteReplyRoom) {
+        _remote.step();
+    }
+    return true;
+}
+
+// Armed or running, the threshold that triggers it. Frozen, each supply's
+// peak and the time it was over the threshold, with what triggered it at
+// the end of the first line: level, edge or trip.
+void MyApp::showCapture()
+{
+    MyCapture::State state = _capture.state();
+    if (state != MyCapture::State::Frozen) {
+        _lcd << FrameSetLine(0) << FS("Capture ")
+             << ((state == MyCapture::State::Idle) ? FS("off") : (state == MyCapture::State::Armed) ? FS("armed") : FS("run"));
+        _lcd << FrameSetLine(1) << FS("Trig >") << CaptureThresholdMa << FS("ma");
+        return;
+    }
+    for (uint8_t i = 0; i < CaptureSupplies; ++i) {
+        _lcd << FrameSetLine(i) << static_cast<char>('A' + i) << ':'
+             << Decimal(_calibration[CalibrationCurrent + i].apply(ShuntToTenthMilliAmps::apply(_capture.peak(i))), 1, 0, 4) << FS("ma ")
+             << Decimal(_capture.samplesOver(i), 0, 0, 3) << FS("ms");
+        if (i == 0) {
+            _lcd << ' ' << " LEX"[static_cast<uint8_t>(_capture.source())];
+        }
+    }
+}
+
+// Capture record, one per telemetry period until the capture is all sent:
+//  supply, index of the first sample, index of the trigger sample, trigger
+//  (1 level, 2 edge, 3 trip), all 8 bit
+//  CaptureRecordSamples samples in 0.1mA, 16 bit, 1ms apart
+void MyApp::sendCapture()
+{
+    const uint8_t recordsPerSupply = CaptureSamples / CaptureRecordSamples;
+    uint8_t record = _captureDumpRecord - 1;
+    uint8_t supply = record / recordsPerSupply;
+    uint8_t first = (record % recordsPerSupply) * CaptureRecordSamples;
+    if (!_telemetry.begin(TelemetryRecordCapture, 4 + CaptureRecordSamples * 2)) {
+        return;
+    }
+    _telemetry.put8(supply);
+    _telemetry.put8(first);
+    _telemetry.put8(MyCapture::TriggerIndex);
+    _telemetry.put8(static_cast<uint8_t>(_capture.source()));
+    for (uint8_t i = 0; i < CaptureRecordSamples; ++i) {
+        _telemetry.put16(_calibration[CalibrationCurrent + supply].apply(ShuntToTenthMilliAmps::apply(_capture.sample(supply, first + i))));
+    }
+    _telemetry.end();
+    _captureDumpRecord = (record + 1 < CaptureSupplies * recordsPerSupply) ? record + 2 : 0;
+}
+
+// After the calibration changes, everything worked out from it
+void MyApp::updateCalibration()
+{
+    updateAVCC();
+    updateTripThresholds();
+}
+
+// Calibrated, in the channel's units
+int16_t MyApp::calibrationReading(uint8_t channel) const
+{
+    if (channel < CalibrationBusVoltage) {
+        return _adcVoltage[channel - CalibrationAnalog];
+    }
+    if (channel < CalibrationCurrent) {
+        return _busMilliVolts[channel - CalibrationBusVoltage];
+    }
+    if (channel < CalibrationAVCC) {
+        return _shuntMilliAmps[channel - CalibrationCurrent];
+    }
+    return _avccMilliVolts;
+}
+
+// A reference of 0 zeroes the channel, anything else spans it. AVCC can
+// only be spanned, and its new value is worked out straight away from the
+// last bandgap value, the rest come with their next readings.
+void MyApp::calibrate()
+{
+    Calibration& calibration = _calibration[_calibrationChannel];
+    int16_t reading = calibrationReading(_calibrationChannel);
+    bool done;
+    if (_calibrationReference) {
+        done = calibration.span(reading, _calibrationReference);
+    } else {
+        done = _calibrationChannel != CalibrationAVCC && calibration.zero(reading, CalibrationMaxOffset);
+    }
+    _calibrationStep = done ? CalibrationStep::Choose : CalibrationStep::Refused;
+    updateCalibration();
+}
+
+// The channel and its calibrated reading, then its gain and offset, the
+// reference being set or that the last one was refused
+void MyApp::showCalibration()
+{
+    uint8_t channel = _calibrationChannel;
+    _lcd << FrameSetLine(0) << FS("Cal ");
+    if (channel < CalibrationBusVoltage) {
+        _lcd << static_cast<char>('a' + channel - CalibrationAnalog);
+    } else if (channel < CalibrationCurrent) {
+        _lcd << static_cast<char>('A' + channel - CalibrationBusVoltage) << FS(":V");
+    } else if (channel < CalibrationAVCC) {
+        _lcd << static_cast<char>('A' + channel - CalibrationCurrent) << FS(":I");
+    } else {
+        _lcd << FS("Vcc");
+    }
+    _lcd << ' ';
+    showCalibrationValue(channel, calibrationReading(channel));
+
+    _lcd << FrameSetLine(1);
+    switch (_calibrationStep) {
+        case CalibrationStep::Choose:
+            _lcd << 'x' << Decimal(static_cast<uint32_t>(_calibration[channel]._gain) * 10000 >> Calibration::GainShift, 4, 4) << ' ';
+            showCalibrationValue(channel, _calibration[channel]._offset);
+            break;
+        case CalibrationStep::Adjust:
+            _lcd << FS("Ref ");
+            showCalibrationValue(channel, _calibrationReference);
+            _lcd << '\x7f';
+            break;
+        case CalibrationStep::Refused:
+            _lcd << FS("Ref refused");
+            break;
+    }
+}
+
+void MyApp::showCalibrationValue(uint8_t channel, int16_t value)
+{
+    if (channel >= CalibrationCurrent && channel < CalibrationAVCC) {
+        _lcd << Decimal(value, 1, 1) << FS("ma");
+    } else {
+        _lcd << Decimal(value, 3, 3) << 'v';
+    }
+}
+
+// The input and its filter, the window length or the time constant in
+// samples, then what it reads now
+void MyApp::showFilters()
+{
+    uint8_t setting = _adcFilters.setting(_filterChannel);
+    char input = 'a' + _filterChannel;
+    _lcd << FrameSetLine(0) << FS("Filter ") << input << FS(": ");
+    if (MyADCFilters::iir(setting)) {
+        _lcd << FS("iir ") << static_cast<uint16_t>(1 << MyADCFilters::shift(setting));
+    } else if (MyADCFilters::shift(setting)) {
+        _lcd << FS("avg ") << static_cast<uint16_t>(1 << MyADCFilters::shift(setting));
+    } else {
+        _lcd << FS("off");
+    }
+    _lcd << FrameSetLine(1) << FS("Reads ") << Decimal(_adcVoltage[_filterChannel], 3, 3) << 'v';
+}
+
+#ifndef NDEBUG
+// Two lines per entry: name and mean, then min-max, all in us. A '*' at
+// the end of the first line shows the profile is being streamed.
+void MyApp::showProfile()
+{
+    if (_profileEntry == MyProfiler::NumEntries) {
+        showMemory();
+        return;
+    }
+    if (_profileEntry == MyProfiler::NumEntries + 1) {
+        showBus();
+        return;
+    }
+    const ProfileStats& stats = _profiler.stats(_profileEntry);
+    uint16_t min = stats._count ? MyProfiler::microseconds(stats._min) : 0;
+    _lcd << FrameSetLine(0) << reinterpret_cast<const _FlashString*>(pgm_read_ptr(&profileNames[_profileEntry]))
+         << ' ' << MyProfiler::microseconds(stats.mean()) << FS("us") << (_profileStreaming ? " *" : "");
+    _lcd << FrameSetLine(1) << min << '-' << MyProfiler::microseconds(stats._max) << FS("us");
+}
+
+// Free RAM now and at its lowest, then the deepest the stack has been
+void MyApp::showMemory()
+{
+    _lcd << FrameSetLine(0) << FS("Free ") << _stackMonitor.free() << FS(" low ") << _stackMonitor.unused();
+    _lcd << FrameSetLine(1) << FS("Stack max ") << _stackMonitor.maxDepth();
+}
+
+// TWI timeouts, how many recoveries left SDA stuck and the longest outage,
+// then each sensor's retried reads
+void MyApp::showBus()
+{
+    _lcd << FrameSetLine(0) << FS("TWI ") << _twi.timeouts() << '/' << _twi.stuck()
+         << ' ' << _twi.longestOutageTicks() << FS("ms");
+    _lcd << FrameSetLine(1) << FS("Retry");
+    for (uint8_t i = 0; i < NumSupplies; ++i) {
+        _lcd << ' ' << static_cast<char>('A' + i) << static_cast<uint16_t>(_currentSensor[i].errors());
+    }
+}
+
+// Profile record, one entry per record in turn, all 16 bit except the index:
+//  entry index
+//  sample count, min, max and mean in us
+//  for latencies, the histogram counts from the shortest bucket up
+void MyApp::sendProfile()
+{
+    uint8_t entry = _profileStreamEntry;
+    bool latency = entry >= static_cast<uint8_t>(ProfileSection::Count);
+    if (!_telemetry.begin(TelemetryRecordProfile, latency ? 9 + MyProfiler::HistogramBuckets * 2 : 9)) {
+        return;
+    }
+    if (++_profileStreamEntry >= MyProfiler::NumEntries) {
+        _profileStreamEntry = 0;
+    }
+    const ProfileStats& stats = _profiler.stats(entry);
+    _telemetry.put8(entry);
+    _telemetry.put16(stats._count);
+    _telemetry.put16(stats._count ? MyProfiler::microseconds(stats._min) : 0);
+    _telemetry.put16(MyProfiler::microseconds(stats._max));
+    _telemetry.put16(MyProfiler::microseconds(stats.mean()));
+    if (latency) {
+        for (uint8_t i = 0; i < MyProfiler::HistogramBuckets; ++i) {
+            _telemetry.put16(_profiler.histogram(entry - static_cast<uint8_t>(ProfileSection::Count), i));
+        }
+    }
+    _telemetry.end();
+}
+#endif
+
+// Called at the end of each idle pass. An ADC conversion that is due is
+// taken asleep even if there is work waiting, but only when the TWI and
+// serial port are quiet, since their clocks stop too. While remote commands
+// are coming in, or a supply is over its threshold and Timer2 has to keep
+// counting, it's taken awake instead. Otherwise, with no task ready, the CPU
+// idles until the next interrupt, at most a ms away.
+// Interrupts are off from the checks to the sleep instruction, so an
+// interrupt in between wakes the CPU straight away.
+void MyApp::sleep()
+{
+    cli();
+    uint16_t now = ticks();
+    if (_remoteActive && static_cast<uint16_t>(now - _remoteRxTick) >= RemoteQuietMs) {
+        // A character already on its way would be cut short by a sleep, so
+        // the next conversion waits long enough for it to come in
+        _remoteActive = false;
+        _serial.armStartWake();
+        _adcSampleTick = now;
+    }
+    if (ADCNoiseReduction && static_cast<uint16_t>(now - _adcSampleTick) >= ADCSamplePeriodMs && !_adcSampler.converting()) {
+        bool awake = _remoteActive || _overcurrentMonitor.overThreshold();
+        if (!awake && _twi.idle() && _serial.idle()) {
+            _adcSampleTick = now;
+            _adcSampler.convertAsleep();
+            return;
+        }
+        if (awake) {
+            _adcSampleTick = now;
+            _adcSampler.convertAwake();
+        }
+    }
+    if (_scheduler.idle()) {
+        set_sleep_mode(SLEEP_MODE_IDLE);
+        sleep_enable();
+        sei();
+        sleep_cpu();
+        sleep_disable();
+    }
+    sei();
 }
 
 void MyApp::handleEvent(EventType type, EventParam param)
 {
-    Menu::handleEvent(type, param);
+    {
+        PROFILE(Menu);
+        MyMenu::handleEvent(type, param);
+    }
     
     switch(type) {
         case EV_IDLE:
-        if (_captureSensorValues) {
-            _captureSensorValues = false;
-            updateCurrentSensor();
-        }
-        if (_captureADCValue) {
-            _captureADCValue = false;
-            updateADC();
-            _adc.setChannel(_adcCurrentChannel);
-            _adc.startConversion();
+        PROFILE_INTERVAL(Idle, 0);
+        dispatchButtons();
+        pollDisplay();
+        _scheduler.runNext();
+        if (_scheduler.finishedOnTime(TaskProtection) && !_fatal) {
+            Watchdog::feed();
         }
-        updateDisplay();
+        sleep();
         break;
-        case EV_ADC:
-            _captureADCValue = true;
-            break;
         case EV_EVENT_TIMER:
             if (param == &_timerEvent) {
-                _captureSensorValues = true;
+                PROFILE_INTERVAL(SensorTimer, SensorPollMs * (F_CPU / 1000));
+                pollCurrentSensors();
+                _adcSampler.sampleBandgap();
+                if (static_cast<uint16_t>(ticks() - _stackCheckTick) >= StackCheckMs) {
+                    _stackCheckTick = ticks();
+                    checkStack();
+                }
+                if (_displayPage != DisplayPage::Lines || _errorShowing) {
+                    invalidateReadings();
+                }
+            } else if (param == &_hiccupEvent) {
+                updateHiccup();
+            } else if (param == &_telemetryEvent) {
+                if (_captureDumpRecord) {
+                    sendCapture();
+                } else {
+                    sendTelemetry();
+                }
+#ifndef NDEBUG
+                if (_profileStreaming) {
+                    sendProfile();
+                }
+#endif
             }
             break;
         case EV_BUTTON_DOWN:
@@ -404,6 +2107,48 @@ void MyApp::handleEvent(EventType type, EventParam param)
     }
 }
 
+ISR(ADC_vect)
+{
+    g_app.handleADCInterrupt();
+}
+
+ISR(TWI_vect)
+{
+    g_app.handleTWIInterrupt();
+}
+
+ISR(TIMER2_COMPA_vect)
+{
+    g_app.handleProtectionInterrupt();
+}
+
+ISR(USART_UDRE_vect)
+{
+    g_app.handleSerialTxInterrupt();
+}
+
+ISR(USART_RX_vect)
+{
+    g_app.handleSerialRxInterrupt();
+}
+
+ISR(PCINT2_vect)
+{
+    g_app.handleSerialStartInterrupt();
+}
+
+ISR(EE_READY_vect)
+{
+    g_app.handleEEPROMInterrupt();
+}
+
+#ifndef NDEBUG
+ISR(TIMER1_OVF_vect)
+{
+    g_app.handleProfilerInterrupt();
+}
+#endif
+
 static char* toHex(char* buf, uint32_t u)
 {
     buf += 10;
@@ -426,21 +2171,41 @@ static char* toHex(char* buf, uint32_t u)
     return buf;
 }
 
-void
-MyErrorReporter::reportError(char c, uint32_t code, ErrorConditionType type)
+// Only ever queues the error, so it's safe wherever the event loop is,
+// see postError()
+void MyErrorReporter::reportError(char c, uint32_t code, ErrorConditionType type)
 {
-    g_app._lcd << TextLCDClear();
-    switch(type) {
-        case ErrorConditionNote: g_app._lcd << "Note:"; break;
-        case ErrorConditionWarning: g_app._lcd << "Warn:"; break;
-        case ErrorConditionFatal: g_app._lcd << "Fatl:"; break;
+    g_app.postError(c, code, type);
+}
+
+// The error being shown, or the next one if it's been up for ErrorShowMs.
+// Only on the normal display, unless it's fatal, which stays up until the
+// reset. Returns false if there's none to show.
+bool MyApp::showError()
+{
+    if (_errorShowing && _error._type != ErrorConditionFatal
+            && (!_displayEnabled || static_cast<uint16_t>(ticks() - _errorTick) >= ErrorShowMs)) {
+        _errorShowing = false;
+    }
+    if (!_errorShowing) {
+        if (!_displayEnabled || !_errors.take(_error)) {
+            return false;
+        }
+        _errorShowing = true;
+        _errorTick = ticks();
+    }
+
+    _lcd << FrameClear();
+    switch (_error._type) {
+        case ErrorConditionNote: _lcd << FS("Note:"); break;
+        case ErrorConditionWarning: _lcd << FS("Warn:"); break;
+        case ErrorConditionFatal: _lcd << FS("Fatl:"); break;
     }
     char buf[12];
-    char* p = toHex(buf, code);
-    g_app._lcd << p;
-    if (type == ErrorConditionFatal)
-        while (1) ;
-    
-    System::msDelay<1000>();
+    _lcd << _error._code << ' ' << toHex(buf, _error._value);
+    if (_errors.pending() && _error._type != ErrorConditionFatal) {
+        _lcd << FrameSetLine(1) << static_cast<uint16_t>(_errors.pending()) << FS(" more");
+    }
+    _scheduler.ready(TaskLCD);
+    return true;
 }
-
@@ -0,0 +1,81 @@
+//
+//  AdaptivePoller.h
+//
+//  Per channel poll rate that backs off while readings are steady
+//
+
+#pragma once
+
+#include <stdint.h>
+
+//
+// Runs off a fixed base period, the fastest any channel is polled. due() is
+// called once per period for each channel and says whether to poll it now.
+// After each poll the result is reported to settled(): if the reading was
+// quiet the channel's interval doubles, up to MaxInterval periods; if it was
+// active the channel goes back to every period. wake() does the same from
+// outside the polls, e.g. when a step shows up in some other measurement.
+//
+// outside() is the usual test for activity: a reading is active when it is
+// more than a deadband from where it last settled, and it then becomes the
+// new reference, so a slow drift is caught once it has built up as well as a
+// step.
+//
+
+template<uint8_t NumChannels, uint8_t MaxInterval>
+class AdaptivePoller {
+    static_assert(MaxInterval > 0, "MaxInterval must be at least 1");
+
+public:
+    AdaptivePoller()
+    {
+        for (uint8_t i = 0; i < NumChannels; ++i) {
+            _interval[i] = 1;
+            _countdown[i] = 1;
+        }
+    }
+
+    bool due(uint8_t channel)
+    {
+        if (--_countdown[channel]) {
+            return false;
+        }
+        _countdown[channel] = _interval[channel];
+        return true;
+    }
+
+    void settled(uint8_t channel, bool active)
+    {
+        if (active) {
+            _interval[channel] = 1;
+        } else if (_interval[channel] <= MaxInterval / 2) {
+            _interval[channel] <<= 1;
+        } else {
+            _interval[channel] = MaxInterval;
+        }
+    }
+
+    // Poll on the next period
+    void wake(uint8_t channel)
+    {
+        _interval[channel] = 1;
+        _countdown[channel] = 1;
+    }
+
+    // Periods between polls now
+    uint8_t interval(uint8_t channel) const { return _interval[channel]; }
+
+    static bool outside(int16_t value, int16_t& reference, int16_t deadband)
+    {
+        int32_t delta = static_cast<int32_t>(value) - reference;
+        if (delta <= deadband && delta >= -deadband) {
+            return false;
+        }
+        reference = value;
+        return true;
+    }
+
+private:
+    uint8_t _interval[NumChannels];
+    uint8_t _countdown[NumChannels];
+};
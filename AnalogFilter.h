@@ -0,0 +1,110 @@
+//
+//  AnalogFilter.h
+//
+//  Per channel sliding window or exponential filter of ADC samples, chosen at runtime
+//
+
+#pragma once
+
+#include <stdint.h>
+
+//
+// Every add() takes one raw sample and gives a new value, so a filter adds
+// its smoothing but no wait for a block to fill. Each channel has its own
+// setting, a byte: the shift, and IIR for the exponential filter.
+//
+// The window is the average of the last 2^shift samples, kept as a running
+// sum: each sample is added in and the one it pushes out of a ring is
+// taken off, so it's the same work whatever the length. The ring has room
+// for the longest window on every channel. The exponential filter moves its
+// value 1/2^shift of the way to each sample, a subtract and a shift, so
+// its time constant is about 2^shift samples and it needs no history.
+//
+// Values are a 16 bit fraction of full scale. The window's sum has shift
+// more bits than a sample, so there's more resolution than a sample has once
+// the noise dithers it. The exponential filter keeps its value with shift
+// more bits, so what each step has below the last bit carries over instead
+// of being lost, and it settles on exactly a steady input. A channel starts,
+// and starts over on a new setting, from its first sample, rather than
+// working its way up from 0.
+//
+
+template<uint8_t NumChannels, uint8_t MaxWindowShift, uint8_t MaxIIRShift, uint8_t InputBits = 10>
+class AnalogFilterBank {
+    static_assert(NumChannels <= 8, "Channels are a bit each in a byte");
+    static_assert(MaxWindowShift + InputBits <= 16, "Window sums are 16 bit");
+    static_assert(MaxIIRShift > 0 && MaxIIRShift <= 16 - InputBits, "Exponential filter shift out of range");
+
+public:
+    static const uint8_t IIR = 0x80;
+    static const uint8_t ShiftMask = 0x0f;
+    static const uint8_t MaxWindow = 1 << MaxWindowShift;
+
+    static uint8_t shift(uint8_t setting) { return setting & ShiftMask; }
+    static bool iir(uint8_t setting) { return setting & IIR; }
+
+    static bool valid(uint8_t setting)
+    {
+        return (setting & ~(IIR | ShiftMask)) == 0
+            && (iir(setting) ? shift(setting) > 0 && shift(setting) <= MaxIIRShift : shift(setting) <= MaxWindowShift);
+    }
+
+    // Every window from the shortest, then every exponential filter, and round again
+    static uint8_t next(uint8_t setting)
+    {
+        if (!iir(setting)) {
+            return (shift(setting) < MaxWindowShift) ? setting + 1 : IIR | 1;
+        }
+        return (shift(setting) < MaxIIRShift) ? setting + 1 : 0;
+    }
+
+    uint8_t setting(uint8_t channel) const { return _setting[channel]; }
+
+    void set(uint8_t channel, uint8_t setting)
+    {
+        _setting[channel] = setting;
+        _started &= ~(1 << channel);
+    }
+
+    // Returns the new value
+    uint16_t add(uint8_t channel, uint16_t sample)
+    {
+        uint8_t setting = _setting[channel];
+        uint8_t n = shift(setting);
+        uint16_t input = sample << (16 - InputBits);
+        if (!(_started & (1 << channel))) {
+            _started |= 1 << channel;
+            for (uint8_t i = 0; i < MaxWindow; ++i) {
+                _window[channel][i] = sample;
+            }
+            _sum[channel] = static_cast<uint32_t>(iir(setting) ? input : sample) << n;
+            _head[channel] = 0;
+            _value[channel] = input;
+            return input;
+        }
+
+        if (iir(setting)) {
+            uint32_t sum = _sum[channel];
+            sum += input - (sum >> n);
+            _sum[channel] = sum;
+            _value[channel] = sum >> n;
+            return _value[channel];
+        }
+        uint8_t head = _head[channel];
+        _sum[channel] = _sum[channel] + sample - _window[channel][head];
+        _window[channel][head] = sample;
+        _head[channel] = (head + 1) & ((1 << n) - 1);
+        _value[channel] = _sum[channel] << (16 - InputBits - n);
+        return _value[channel];
+    }
+
+    uint16_t value(uint8_t channel) const { return _value[channel]; }
+
+private:
+    uint16_t _window[NumChannels][MaxWindow];
+    uint32_t _sum[NumChannels];       // The window's sum, or the exponential filter's value << shift
+    uint16_t _value[NumChannels] = { };
+    uint8_t _head[NumChannels];
+    uint8_t _setting[NumChannels] = { };
+    uint8_t _started = 0;             // Bit per channel that has had a sample since it was set
+};
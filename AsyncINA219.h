@@ -0,0 +1,220 @@
+//
+//  AsyncINA219.h
+//
+//  INA219 current sensor read through the TWIQueue
+//
+
+#pragma once
+
+#include "TWIQueue.h"
+
+//
+// startRead() queues a read of the bus voltage register and returns
+// immediately. If its conversion ready (CNVR) bit shows a conversion has
+// completed since the last fetch, the shunt voltage and current are read,
+// followed by the power register, which clears CNVR. readComplete() then
+// returns true, after which busMilliVolts(), shuntVoltage(), current() and
+// power() return the new values. So each completed conversion is fetched
+// exactly once, and a poll that finds nothing new costs a single register
+// read.
+//
+// The current and power registers read 0 until the calibration register is
+// set. calibration() works it out from the current LSB wanted and the shunt,
+// as 0.04096 / (LSB * R): with a round LSB the current register is already
+// in the units needed and the AVR has nothing left to scale. The LSB has to
+// be at least minCurrentLsbMicroAmps() of the largest current to be read,
+// or the register overflows. The power LSB is 20 times the current LSB.
+//
+// A read that fails is left for the next startRead() to try again, and
+// counted in errors(). health() is Good while the last read went through,
+// Retrying after a failure and Failed after FailedAfter in a row, until a
+// read gets through again.
+//
+
+class AsyncINA219 {
+public:
+    enum Register : uint8_t { RegConfig = 0, RegShuntVoltage = 1, RegBusVoltage = 2, RegPower = 3, RegCurrent = 4, RegCalibration = 5 };
+
+    enum BusRange : uint16_t { Bus16V = 0x0000, Bus32V = 0x2000 };
+    enum ShuntRange : uint16_t { Shunt40mV = 0x0000, Shunt80mV = 0x0800, Shunt160mV = 0x1000, Shunt320mV = 0x1800 };
+
+    // ADC resolution, or 12 bit with hardware averaging over up to 128 samples
+    enum ADCMode : uint8_t {
+        ADC9Bit = 0x0, ADC10Bit = 0x1, ADC11Bit = 0x2, ADC12Bit = 0x3,
+        Average2 = 0x9, Average4 = 0xa, Average8 = 0xb, Average16 = 0xc, Average32 = 0xd, Average64 = 0xe, Average128 = 0xf
+    };
+
+    enum OperatingMode : uint8_t {
+        PowerDown = 0, ShuntTriggered = 1, BusTriggered = 2, ShuntAndBusTriggered = 3,
+        ADCOff = 4, ShuntContinuous = 5, BusContinuous = 6, ShuntAndBusContinuous = 7
+    };
+
+    static constexpr uint16_t configuration(BusRange bus, ShuntRange shunt, ADCMode busADC, ADCMode shuntADC, OperatingMode mode)
+    {
+        return bus | shunt | (static_cast<uint16_t>(busADC) << 7) | (shuntADC << 3) | mode;
+    }
+
+    // Time for one conversion in each ADC mode
+    static constexpr uint32_t conversionTimeUs(ADCMode adc)
+    {
+        return (adc <= ADC12Bit) ? ((adc == ADC9Bit) ? 84 : (adc == ADC10Bit) ? 148 : (adc == ADC11Bit) ? 276 : 532)
+                                 : 532UL << (adc - ADC12Bit - 5);
+    }
+
+    // Smallest current LSB that reads up to maxMilliAmps
+    static constexpr uint16_t minCurrentLsbMicroAmps(uint16_t maxMilliAmps)
+    {
+        return (static_cast<uint32_t>(maxMilliAmps) * 1000 + 32767) / 32768;
+    }
+
+    // To the nearest even value, bit 0 of the register is always 0
+    static constexpr uint16_t calibration(uint16_t currentLsbMicroAmps, uint16_t shuntMilliOhms)
+    {
+        return (40960000UL / (static_cast<uint32_t>(currentLsbMicroAmps) * shuntMilliOhms) + 1) & 0xfffe;
+    }
+
+    // Most transactions a read has in the TWIQueue at once
+    static const uint8_t MaxQueued = 3;
+
+    enum class Health : uint8_t { Good, Retrying, Failed };
+    static const uint8_t FailedAfter = 3;
+
+    uint8_t address() const { return _address; }
+
+    void init(TWIQueue* twi, uint8_t address)
+    {
+        _twi = twi;
+        _address = address;
+    }
+
+    bool setConfiguration(uint16_t configuration)
+    {
+        if (_config.busy()) {
+            return false;
+        }
+        _config.setWrite(_address, RegConfig, configuration);
+        return _twi->submit(_config);
+    }
+
+    bool setCalibration(uint16_t calibration)
+    {
+        if (_calibration.busy()) {
+            return false;
+        }
+        _calibration.setWrite(_address, RegCalibration, calibration);
+        return _twi->submit(_calibration);
+    }
+
+    // Returns false if the previous read has not finished yet
+    bool startRead()
+    {
+        if (_state != State::Idle) {
+            return false;
+        }
+        _bus.setRead(_address, RegBusVoltage);
+        _twi->submit(_bus);
+        _state = State::ReadingBus;
+        return true;
+    }
+
+    // True from startRead() until readComplete() has finished with the read
+    bool reading() const { return _state != State::Idle; }
+
+    // Returns true once for each completed conversion fetched
+    bool readComplete()
+    {
+        switch (_state) {
+            case State::Idle:
+                return false;
+            case State::ReadingBus:
+                if (_bus.busy()) {
+                    return false;
+                }
+                if (_bus.status() != TWITransaction::Status::Done) {
+                    return failed();
+                }
+                if (!(_bus.value() & CNVR)) {
+                    _state = State::Idle;
+                    _failures = 0;
+                    return false;
+                }
+                _shunt.setRead(_address, RegShuntVoltage);
+                _current.setRead(_address, RegCurrent);
+                _power.setRead(_address, RegPower);
+                _twi->submit(_shunt);
+                _twi->submit(_current);
+                _twi->submit(_power);
+                _state = State::ReadingShunt;
+                return false;
+            case State::ReadingShunt:
+                if (_shunt.busy() || _current.busy() || _power.busy()) {
+                    return false;
+                }
+                if (_shunt.status() != TWITransaction::Status::Done || _current.status() != TWITransaction::Status::Done
+                        || _power.status() != TWITransaction::Status::Done) {
+                    return failed();
+                }
+                _state = State::Idle;
+                _failures = 0;
+
+                // Bus voltage is in bits 15:3 with an LSB of 4mV
+                _busMilliVolts = (_bus.value() >> 3) * 4;
+                _shuntVoltage = static_cast<int16_t>(_shunt.value());
+                _currentValue = static_cast<int16_t>(_current.value());
+                _powerValue = _power.value();
+                return true;
+        }
+        return false;
+    }
+
+    int16_t busMilliVolts() const { return _busMilliVolts; }
+
+    // Raw shunt voltage register, LSB is 10uV
+    int16_t shuntVoltage() const { return _shuntVoltage; }
+
+    // Current and power registers, in the LSBs set by the calibration
+    int16_t current() const { return _currentValue; }
+    uint16_t power() const { return _powerValue; }
+
+    uint8_t errors() const { return _errors; }
+
+    Health health() const
+    {
+        return (_failures == 0) ? Health::Good : (_failures < FailedAfter) ? Health::Retrying : Health::Failed;
+    }
+
+private:
+    static const uint16_t CNVR = 0x0002;
+
+    enum class State : uint8_t { Idle, ReadingBus, ReadingShunt };
+
+    bool failed()
+    {
+        _state = State::Idle;
+        if (_errors != 0xff) {
+            ++_errors;
+        }
+        if (_failures < FailedAfter) {
+            ++_failures;
+        }
+        return false;
+    }
+
+    TWIQueue* _twi = nullptr;
+    uint8_t _address = 0;
+    State _state = State::Idle;
+    uint8_t _errors = 0;
+    uint8_t _failures = 0;
+
+    TWITransaction _config;
+    TWITransaction _calibration;
+    TWITransaction _bus;
+    TWITransaction _shunt;
+    TWITransaction _current;
+    TWITransaction _power;
+
+    int16_t _busMilliVolts = 0;
+    int16_t _shuntVoltage = 0;
+    int16_t _currentValue = 0;
+    uint16_t _powerValue = 0;
+};
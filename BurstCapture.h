@@ -0,0 +1,178 @@
+//
+//  BurstCapture.h
+//
+//  Triggered capture of a few channels into a packed pre-trigger ring
+//
+
+#pragma once
+
+#include <util/atomic.h>
+
+//
+// Once armed, every add() writes one sample per channel into a ring of Size
+// samples. A channel's samples are non-negative and are stored shifted right
+// by Shift into 12 bits, packed two to three bytes: a 128 sample ring is 192
+// bytes per channel. Triggers are only taken once PreTrigger samples are in,
+// so there is always that much history: a sample over the threshold, a rise
+// of more than the edge from one sample to the next, on any channel, or
+// trigger() from outside, where the trigger sample is the last one in. The
+// capture then runs on until the trigger sample is PreTrigger from the
+// oldest one and freezes.
+//
+// add() is meant to be called from an ISR, everything else from the main
+// loop. Once frozen the ISR leaves the buffer alone, so sample() and the
+// results need no locking. The results cover the whole window: the peak of
+// each channel and how many samples were over the threshold.
+//
+
+template<uint8_t NumChannels, uint8_t Size, uint8_t PreTrigger, uint8_t Shift>
+class BurstCapture {
+    static_assert((Size & (Size - 1)) == 0, "Size must be a power of 2");
+    static_assert(PreTrigger < Size, "PreTrigger must leave room for the trigger");
+    static_assert((0x7fff >> Shift) < 0x1000, "Shift must bring samples into 12 bits");
+
+public:
+    enum class State : uint8_t { Idle, Armed, Triggered, Frozen };
+    enum class Trigger : uint8_t { None, Threshold, Edge, External };
+
+    static const uint16_t RamBytes = NumChannels * (Size * 3 / 2);
+    static const uint8_t TriggerIndex = PreTrigger;
+
+    void arm(int16_t threshold, int16_t edge)
+    {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            _threshold = threshold;
+            _edge = edge;
+            _filled = 0;
+            _trigger = Trigger::None;
+            _analyzed = false;
+            for (uint8_t i = 0; i < NumChannels; ++i) {
+                _previous[i] = 0;
+            }
+            _state = State::Armed;
+        }
+    }
+
+    void trigger(Trigger trigger)
+    {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            if (_state == State::Armed && _filled >= PreTrigger) {
+                triggered(trigger);
+            }
+        }
+    }
+
+    // Called from the ISR, with one sample per channel
+    void add(const int16_t* samples)
+    {
+        if (_state != State::Armed && _state != State::Triggered) {
+            return;
+        }
+        Trigger trigger = Trigger::None;
+        for (uint8_t i = 0; i < NumChannels; ++i) {
+            int16_t sample = (samples[i] < 0) ? 0 : samples[i];
+            put(i, _head, sample >> Shift);
+            if (sample > _threshold) {
+                trigger = Trigger::Threshold;
+            } else if (trigger == Trigger::None && sample - _previous[i] > _edge) {
+                trigger = Trigger::Edge;
+            }
+            _previous[i] = sample;
+        }
+        _head = (_head + 1) & (Size - 1);
+
+        if (_state == State::Armed) {
+            if (_filled < PreTrigger) {
+                ++_filled;
+            } else if (trigger != Trigger::None) {
+                triggered(trigger);
+            }
+        } else if (--_remaining == 0) {
+            _state = State::Frozen;
+        }
+    }
+
+    State state() const
+    {
+        State state;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            state = _state;
+        }
+        return state;
+    }
+
+    // The rest is for a frozen capture only
+
+    Trigger source() const { return _trigger; }
+
+    // Sample index from the oldest, the trigger is at TriggerIndex
+    int16_t sample(uint8_t channel, uint8_t index) const
+    {
+        return static_cast<int16_t>(get(channel, (_head + index) & (Size - 1))) << Shift;
+    }
+
+    int16_t peak(uint8_t channel) { analyze(); return _peak[channel]; }
+    uint8_t samplesOver(uint8_t channel) { analyze(); return _over[channel]; }
+
+private:
+    void triggered(Trigger trigger)
+    {
+        // The trigger sample is already in, so the rest of the ring is after it
+        _trigger = trigger;
+        _remaining = Size - PreTrigger - 1;
+        _state = _remaining ? State::Triggered : State::Frozen;
+    }
+
+    void put(uint8_t channel, uint8_t index, uint16_t value)
+    {
+        uint8_t* p = &_samples[channel][(index >> 1) * 3];
+        if (index & 1) {
+            p[1] = (p[1] & 0x0f) | (value << 4);
+            p[2] = value >> 4;
+        } else {
+            p[0] = value;
+            p[1] = (p[1] & 0xf0) | (value >> 8);
+        }
+    }
+
+    uint16_t get(uint8_t channel, uint8_t index) const
+    {
+        const uint8_t* p = &_samples[channel][(index >> 1) * 3];
+        return (index & 1) ? (p[1] >> 4) | (static_cast<uint16_t>(p[2]) << 4)
+                           : p[0] | (static_cast<uint16_t>(p[1] & 0x0f) << 8);
+    }
+
+    void analyze()
+    {
+        if (_analyzed) {
+            return;
+        }
+        for (uint8_t i = 0; i < NumChannels; ++i) {
+            _peak[i] = 0;
+            _over[i] = 0;
+            for (uint8_t j = 0; j < Size; ++j) {
+                int16_t value = sample(i, j);
+                if (value > _peak[i]) {
+                    _peak[i] = value;
+                }
+                if (value > _threshold) {
+                    ++_over[i];
+                }
+            }
+        }
+        _analyzed = true;
+    }
+
+    uint8_t _samples[NumChannels][Size * 3 / 2];
+    int16_t _previous[NumChannels];
+    int16_t _peak[NumChannels];
+    uint8_t _over[NumChannels];
+    int16_t _threshold = 0;
+    int16_t _edge = 0;
+    uint8_t _head = 0;
+    uint8_t _filled = 0;
+    uint8_t _remaining = 0;
+    State _state = State::Idle;
+    Trigger _trigger = Trigger::None;
+    bool _analyzed = false;
+};
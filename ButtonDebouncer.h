@@ -0,0 +1,152 @@
+//
+//  ButtonDebouncer.h
+//
+//  Integrator debounce of a few buttons from a timer tick, with long press and auto-repeat
+//
+
+#pragma once
+
+#include <util/atomic.h>
+
+#include "EventListener.h"
+
+//
+// sample() is called from a timer interrupt at TickHz with a bit set for
+// every button that reads down. Each button has an integrator that counts
+// up while it reads down and down while it reads up, from 0 to the number
+// of ticks in DebounceMs. It's pressed when the count gets to the top and
+// released when it gets back to 0, so a bounce only delays the change. The
+// work is the same on every tick, whatever the main loop is doing.
+//
+// Events are left as pending bits for the main loop to take with read():
+//
+//  EV_BUTTON_DOWN  on the press, and again as the button repeats, with
+//                  ButtonRepeat set in the param. The first repeat comes
+//                  RepeatDelayMs after the press, the next half that later
+//                  and each one after that a quarter sooner, down to an
+//                  eighth of RepeatDelayMs.
+//  EV_BUTTON_LONG  once, when the button has been down for LongPressMs
+//  EV_BUTTON_UP    on the release, with ButtonLong set in the param if the
+//                  press got that far
+//
+// The param is otherwise the button's index. Pending events of the same
+// kind for a button merge, so a late main loop drops repeats rather than
+// queueing them.
+//
+// m8r has no event for a long press. EV_BUTTON_LONG is a value past
+// EV_BUTTON_UP that only ever goes from read() to the app's own
+// handleEvent(), never through System::postEvent().
+//
+
+const m8r::EventType EV_BUTTON_LONG = static_cast<m8r::EventType>(m8r::EV_BUTTON_UP + 1);
+const uint8_t ButtonIndexMask = 0x3f;
+const uint8_t ButtonLong = 0x40;
+const uint8_t ButtonRepeat = 0x80;
+
+template<uint8_t NumButtons, uint16_t TickHz, uint8_t DebounceMs, uint16_t LongPressMs, uint16_t RepeatDelayMs>
+class ButtonDebouncer {
+    static_assert(NumButtons <= 8, "Buttons are a bit each in a byte");
+    static_assert(DebounceMs * TickHz / 1000 > 0 && DebounceMs * TickHz / 1000 < 256, "DebounceMs out of range for TickHz");
+
+public:
+    static const uint8_t DebounceTicks = DebounceMs * TickHz / 1000;
+    static const uint16_t LongPressTicks = static_cast<uint32_t>(LongPressMs) * TickHz / 1000;
+    static const uint16_t RepeatDelayTicks = static_cast<uint32_t>(RepeatDelayMs) * TickHz / 1000;
+
+    // Called from the timer ISR
+    void sample(uint8_t down)
+    {
+        for (uint8_t i = 0; i < NumButtons; ++i) {
+            uint8_t bit = 1 << i;
+            if (down & bit) {
+                if (_level[i] < DebounceTicks) {
+                    ++_level[i];
+                }
+            } else if (_level[i]) {
+                --_level[i];
+            }
+
+            if (!(_down & bit)) {
+                if (_level[i] == DebounceTicks) {
+                    _down |= bit;
+                    _pressed |= bit;
+                    _heldTicks[i] = 0;
+                    _repeatTicks[i] = RepeatDelayTicks;
+                    _repeatInterval[i] = RepeatDelayTicks / 2;
+                }
+                continue;
+            }
+            if (_level[i] == 0) {
+                _down &= ~bit;
+                _released |= bit;
+                if (_heldTicks[i] >= LongPressTicks) {
+                    _releasedLong |= bit;
+                }
+                continue;
+            }
+            if (_heldTicks[i] < LongPressTicks && ++_heldTicks[i] == LongPressTicks) {
+                _long |= bit;
+            }
+            if (--_repeatTicks[i] == 0) {
+                _repeated |= bit;
+                _repeatTicks[i] = _repeatInterval[i];
+                if (_repeatInterval[i] - (_repeatInterval[i] >> 2) >= RepeatDelayTicks / 8) {
+                    _repeatInterval[i] -= _repeatInterval[i] >> 2;
+                }
+            }
+        }
+    }
+
+    // Takes the next pending event, presses first, then repeats, long
+    // presses and releases
+    bool read(m8r::EventType& type, uint8_t& param)
+    {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            if (take(_pressed, param)) {
+                type = m8r::EV_BUTTON_DOWN;
+                return true;
+            }
+            if (take(_repeated, param)) {
+                type = m8r::EV_BUTTON_DOWN;
+                param |= ButtonRepeat;
+                return true;
+            }
+            if (take(_long, param)) {
+                type = EV_BUTTON_LONG;
+                return true;
+            }
+            if (take(_released, param)) {
+                type = m8r::EV_BUTTON_UP;
+                if (_releasedLong & (1 << param)) {
+                    _releasedLong &= ~(1 << param);
+                    param |= ButtonLong;
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+private:
+    static bool take(uint8_t& pending, uint8_t& button)
+    {
+        for (button = 0; button < NumButtons; ++button) {
+            if (pending & (1 << button)) {
+                pending &= ~(1 << button);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    uint8_t _level[NumButtons] = { };
+    uint16_t _heldTicks[NumButtons];
+    uint16_t _repeatTicks[NumButtons];
+    uint16_t _repeatInterval[NumButtons];
+    uint8_t _down = 0;
+    uint8_t _pressed = 0;
+    uint8_t _repeated = 0;
+    uint8_t _long = 0;
+    uint8_t _released = 0;
+    uint8_t _releasedLong = 0;
+};
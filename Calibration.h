@@ -0,0 +1,76 @@
+//
+//  Calibration.h
+//
+//  Per channel gain and offset in fixed point, applied with a multiply and a shift
+//
+
+#pragma once
+
+#include <stdint.h>
+
+//
+// A Calibration takes a reading to what it should have read. The gain is
+// Q1.15, so UnityGain is 1 and it runs up to just under 2, and the offset is
+// in the units of the result. apply() is one 16x16 bit multiply, a shift and
+// an add. A channel that's a fraction of a full scale only known at runtime,
+// like an ADC input against AVCC, has the full scale folded into the gain
+// with applyGain() when it changes, and each sample then goes through
+// applyScaled() as a 16 bit fraction: the multiply, the top half of the
+// product and the offset.
+//
+// Calibrating takes two points from the calibrated readings, so nothing has
+// to be kept from before the calibration. zero() takes the reading with
+// nothing on the input and moves the offset so it reads 0. span() takes a
+// reading and what it should be and scales the gain by the ratio of the
+// two, less the offset, so the zero is done first. Either refuses a result
+// out of range and leaves the calibration as it was: a gain that far from
+// 1 is more likely a wrong reference than the part.
+//
+
+struct Calibration
+{
+    static const uint8_t GainShift = 15;
+    static const uint16_t UnityGain = 1U << GainShift;
+    static const uint16_t MinGain = UnityGain - (UnityGain >> 2);
+    static const uint16_t MaxGain = UnityGain + (UnityGain >> 2);
+
+    int16_t apply(int16_t value) const { return (static_cast<int32_t>(value) * _gain >> GainShift) + _offset; }
+    uint16_t applyGain(uint16_t value) const { return static_cast<uint32_t>(value) * _gain >> GainShift; }
+    int16_t applyScaled(uint16_t fraction, uint16_t scale) const { return (static_cast<uint32_t>(fraction) * scale >> 16) + _offset; }
+
+    // What a calibrated value read before the calibration, rounded down
+    int16_t unapply(int16_t value) const { return (static_cast<int32_t>(value) - _offset) * UnityGain / _gain; }
+
+    bool zero(int16_t reading, int16_t maxOffset)
+    {
+        int16_t offset = _offset - reading;
+        if (offset > maxOffset || offset < -maxOffset) {
+            return false;
+        }
+        _offset = offset;
+        return true;
+    }
+
+    bool span(int16_t reading, int16_t reference)
+    {
+        int32_t from = static_cast<int32_t>(reading) - _offset;
+        int32_t to = static_cast<int32_t>(reference) - _offset;
+        if (from <= 0 || to <= 0) {
+            return false;
+        }
+        uint32_t gain = static_cast<uint32_t>(_gain) * to / from;
+        if (gain < MinGain || gain > MaxGain) {
+            return false;
+        }
+        _gain = gain;
+        return true;
+    }
+
+    bool valid(int16_t maxOffset) const
+    {
+        return _gain >= MinGain && _gain <= MaxGain && _offset <= maxOffset && _offset >= -maxOffset;
+    }
+
+    uint16_t _gain = UnityGain;
+    int16_t _offset = 0;
+};
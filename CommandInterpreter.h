@@ -0,0 +1,319 @@
+//
+//  CommandInterpreter.h
+//
+//  SCPI style text commands, tokenized in place and looked up in a PROGMEM table
+//
+
+#pragma once
+
+#include "m8r.h"
+
+#include <avr/pgmspace.h>
+
+//
+// Characters go into a line buffer with add() until a newline. The line is
+// then parsed where it is, with nothing copied or allocated: each separator
+// is written over with a NUL, and the header and parameters are pointers into
+// the buffer. A line holds one or more commands separated by ';', each a
+// header and then its parameters, with a space before them and commas
+// between them:
+//
+//  CURRent:LIMit 1,250;CURR:LIM? 1
+//
+// Headers in the table are nodes separated by ':', each with its short form
+// in capitals and the rest in lower case, as in SCPI. An input node matches
+// if it's the short form or the whole node, in either case. A trailing '?'
+// makes it a query and has to match too.
+//
+// step() runs one command of the line, so a long line doesn't hold up the
+// rest of the loop, and returns false when the line is done and add() can
+// take the next one. A handler reads its parameters through CommandParams
+// and returns Ok or the error for step() to report. Errors are reported on
+// the port as SCPI numbers them, a negative code and a description. A line
+// too long for the buffer, or one that lost characters on the way in, is
+// thrown away whole and reported once.
+//
+
+enum class CommandResult : uint8_t {
+    Ok,
+    UndefinedHeader,
+    MissingParameter,
+    ParameterNotAllowed,
+    IllegalParameter,
+    DataOutOfRange,
+    CommunicationError,
+    InputOverrun
+};
+
+const char commandErrorUndefinedHeader[] PROGMEM = "-113,\"Undefined header\"\n";
+const char commandErrorMissingParameter[] PROGMEM = "-109,\"Missing parameter\"\n";
+const char commandErrorParameterNotAllowed[] PROGMEM = "-108,\"Parameter not allowed\"\n";
+const char commandErrorIllegalParameter[] PROGMEM = "-224,\"Illegal parameter value\"\n";
+const char commandErrorDataOutOfRange[] PROGMEM = "-222,\"Data out of range\"\n";
+const char commandErrorCommunication[] PROGMEM = "-360,\"Communication error\"\n";
+const char commandErrorInputOverrun[] PROGMEM = "-363,\"Input buffer overrun\"\n";
+const char* const commandErrors[] PROGMEM = {
+    commandErrorUndefinedHeader, commandErrorMissingParameter, commandErrorParameterNotAllowed,
+    commandErrorIllegalParameter, commandErrorDataOutOfRange, commandErrorCommunication,
+    commandErrorInputOverrun
+};
+static_assert(sizeof(commandErrors) / sizeof(commandErrors[0]) == static_cast<uint8_t>(CommandResult::InputOverrun),
+              "Need a message for each error");
+
+// The longest error message, for callers checking room for a reply
+const uint8_t CommandErrorMaxLength = sizeof(commandErrorParameterNotAllowed) - 1;
+
+// The parameters of one command, taken in order
+class CommandParams {
+public:
+    CommandParams(char* p) : _p(p) { }
+
+    // The next parameter without its spaces, or nullptr at the end
+    char* next()
+    {
+        while (*_p == ' ' || *_p == '\t') {
+            ++_p;
+        }
+        if (!*_p) {
+            return nullptr;
+        }
+        char* param = _p;
+        while (*_p && *_p != ',') {
+            ++_p;
+        }
+        char* end = _p;
+        if (*_p) {
+            *_p++ = '\0';
+        }
+        while (end > param && (end[-1] == ' ' || end[-1] == '\t')) {
+            *--end = '\0';
+        }
+        return param;
+    }
+
+    CommandResult number(uint16_t& value, uint16_t min, uint16_t max)
+    {
+        const char* param = next();
+        if (!param) {
+            return CommandResult::MissingParameter;
+        }
+        uint32_t n = 0;
+        for (const char* p = param; *p; ++p) {
+            if (*p < '0' || *p > '9') {
+                return CommandResult::IllegalParameter;
+            }
+            n = n * 10 + (*p - '0');
+            if (n > 0xffff) {
+                return CommandResult::DataOutOfRange;
+            }
+        }
+        if (n < min || n > max) {
+            return CommandResult::DataOutOfRange;
+        }
+        value = n;
+        return CommandResult::Ok;
+    }
+
+    // ON, OFF, 1 or 0
+    CommandResult boolean(bool& value)
+    {
+        const char* param = next();
+        if (!param) {
+            return CommandResult::MissingParameter;
+        }
+        if (equal(param, "1") || equal(param, "ON")) {
+            value = true;
+        } else if (equal(param, "0") || equal(param, "OFF")) {
+            value = false;
+        } else {
+            return CommandResult::IllegalParameter;
+        }
+        return CommandResult::Ok;
+    }
+
+    // For handlers to finish with, so extra parameters are an error
+    CommandResult done() { return next() ? CommandResult::ParameterNotAllowed : CommandResult::Ok; }
+
+    static char upper(char c) { return (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c; }
+
+private:
+    // In either case, against capitals
+    static bool equal(const char* param, const char* word)
+    {
+        while (*word && upper(*param) == *word) {
+            ++param;
+            ++word;
+        }
+        return !*param && !*word;
+    }
+
+    char* _p;
+};
+
+template<typename Owner, typename Port, uint8_t LineSize>
+class CommandInterpreter {
+    static_assert(LineSize > 1 && LineSize < 0xff, "LineSize out of range");
+
+public:
+    typedef CommandResult (*Handler)(Owner*, CommandParams&);
+
+    struct Command
+    {
+        const char* _header;        // PROGMEM
+        Handler _handler;
+    };
+
+    CommandInterpreter(const Command* commands, uint8_t count, Owner* owner, Port& port)
+        : _commands(commands), _count(count), _owner(owner), _port(port) { }
+
+    // Returns true when there's a line for step()
+    bool add(char c)
+    {
+        if (c == '\n' || c == '\r') {
+            if (_error == CommandResult::Ok && _length == 0) {
+                return false;   // Blank line, or the other half of CRLF
+            }
+            _line[_length] = '\0';
+            _cursor = 0;
+            _ready = true;
+            return true;
+        }
+        if (_error != CommandResult::Ok) {
+            return false;
+        }
+        if (_length >= LineSize - 1) {
+            _error = CommandResult::InputOverrun;
+        } else {
+            _line[_length++] = c;
+        }
+        return false;
+    }
+
+    // Characters were lost from the line being added, so it's no good. It's
+    // thrown away at its terminator. The caller only says so once it has
+    // added what came in before the loss.
+    void receiveError()
+    {
+        if (_error == CommandResult::Ok) {
+            _error = CommandResult::CommunicationError;
+        }
+    }
+
+    bool ready() const { return _ready; }
+
+    // Runs the next command in the line. Returns false when the line is done.
+    bool step()
+    {
+        if (!_ready) {
+            return false;
+        }
+        if (_error != CommandResult::Ok) {
+            report(_error);
+            return finish();
+        }
+
+        char* command = _line + _cursor;
+        char* end = command;
+        while (*end && *end != ';') {
+            ++end;
+        }
+        _cursor = *end ? end + 1 - _line : LineDone;
+        *end = '\0';
+
+        while (*command == ' ' || *command == '\t') {
+            ++command;
+        }
+        char* params = command;
+        while (*params && *params != ' ' && *params != '\t') {
+            ++params;
+        }
+        if (*params) {
+            *params++ = '\0';
+        }
+        if (*command) {
+            run(command, params);
+        }
+        return (_cursor == LineDone) ? finish() : true;
+    }
+
+private:
+    static const uint8_t LineDone = 0xff;
+
+    void run(const char* header, char* params)
+    {
+        for (uint8_t i = 0; i < _count; ++i) {
+            if (matches(reinterpret_cast<const char*>(pgm_read_ptr(&_commands[i]._header)), header)) {
+                Handler handler = reinterpret_cast<Handler>(pgm_read_ptr(&_commands[i]._handler));
+                CommandParams commandParams(params);
+                CommandResult result = handler(_owner, commandParams);
+                if (result != CommandResult::Ok) {
+                    report(result);
+                }
+                return;
+            }
+        }
+        report(CommandResult::UndefinedHeader);
+    }
+
+    void report(CommandResult result)
+    {
+        _port << reinterpret_cast<const m8r::_FlashString*>(pgm_read_ptr(&commandErrors[static_cast<uint8_t>(result) - 1]));
+    }
+
+    bool finish()
+    {
+        _length = 0;
+        _error = CommandResult::Ok;
+        _ready = false;
+        return false;
+    }
+
+    static bool terminator(char c) { return c == ':' || c == '?' || c == '\0'; }
+
+    // Node by node. Once an input node goes past the short form it has to
+    // be the whole node.
+    static bool matches(const char* header, const char* input)
+    {
+        while (true) {
+            bool intoLong = false;
+            char c;
+            while (!terminator(c = pgm_read_byte(header))) {
+                bool required = c < 'a' || c > 'z';
+                if (terminator(*input)) {
+                    if (required || intoLong) {
+                        return false;
+                    }
+                    while (!terminator(pgm_read_byte(header))) {
+                        ++header;
+                    }
+                    break;
+                }
+                if (CommandParams::upper(*input) != CommandParams::upper(c)) {
+                    return false;
+                }
+                intoLong |= !required;
+                ++header;
+                ++input;
+            }
+            c = pgm_read_byte(header);
+            if (c != *input) {
+                return false;
+            }
+            if (!c) {
+                return true;
+            }
+            ++header;
+            ++input;
+        }
+    }
+
+    const Command* _commands;
+    uint8_t _count;
+    Owner* _owner;
+    Port& _port;
+    char _line[LineSize];
+    uint8_t _length = 0;
+    uint8_t _cursor = 0;
+    CommandResult _error = CommandResult::Ok;
+    bool _ready = false;
+};
@@ -0,0 +1,52 @@
+//
+//  ErrorQueue.h
+//
+//  Errors kept for the display to show later, and counted
+//
+
+#pragma once
+
+#include "RingBuffer.h"
+#include "m8r.h"
+
+//
+// post() only queues the error and counts it by type, so reporting one
+// never holds up the caller. The display takes them off with take() when
+// it's ready to show them. A full queue drops the error but it's still
+// counted, along with the drop. post() and take() are for the event loop
+// only, not ISRs.
+//
+
+template<uint8_t Size>
+class ErrorQueue {
+public:
+    struct Error
+    {
+        char _code;
+        uint32_t _value;
+        m8r::ErrorConditionType _type;
+    };
+
+    static const uint8_t NumTypes = m8r::ErrorConditionFatal + 1;
+
+    void post(char code, uint32_t value, m8r::ErrorConditionType type)
+    {
+        if (_count[type] != 0xffff) {
+            ++_count[type];
+        }
+        if (!_errors.push({ code, value, type }) && _dropped != 0xffff) {
+            ++_dropped;
+        }
+    }
+
+    bool take(Error& error) { return _errors.pop(error); }
+    uint8_t pending() const { return _errors.count(); }
+
+    uint16_t count(m8r::ErrorConditionType type) const { return _count[type]; }
+    uint16_t dropped() const { return _dropped; }
+
+private:
+    RingBuffer<Error, Size> _errors;
+    uint16_t _count[NumTypes] = { };
+    uint16_t _dropped = 0;
+};
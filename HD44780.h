@@ -0,0 +1,98 @@
+//
+//  HD44780.h
+//
+//  Minimal write only driver for HD44780 compatible text LCDs in 4 bit mode
+//
+
+#pragma once
+
+#include <util/delay.h>
+
+//
+// RW is tied low, so the busy flag can't be read and every transfer waits
+// out the worst case execution time instead. D4-D7 are the LCD's upper data
+// lines, which are the only ones used in 4 bit mode.
+//
+
+template<typename RS, typename E, typename D4, typename D5, typename D6, typename D7>
+class HD44780 {
+public:
+    void init()
+    {
+        _rs = false;
+        _e = false;
+
+        // Power on reset wait, then force 8 bit mode three times and switch to 4 bit
+        _delay_ms(50);
+        writeNibble(0x03);
+        _delay_ms(5);
+        writeNibble(0x03);
+        _delay_us(150);
+        writeNibble(0x03);
+        _delay_us(150);
+        writeNibble(0x02);
+        _delay_us(150);
+
+        command(0x28);  // 4 bit, 2 lines, 5x8 font
+        command(0x0c);  // Display on, cursor off
+        command(0x06);  // Increment, no shift
+        clear();
+    }
+
+    void clear()
+    {
+        command(0x01);
+        _delay_ms(2);
+    }
+
+    void setCursor(uint8_t col, uint8_t row) { command(0x80 | (row * 0x40 + col)); }
+
+    // Character code index (0-7) from 8 rows, top first, in the low 5 bits of
+    // each. This leaves the LCD's address in CGRAM, so the next character
+    // has to come after a setCursor().
+    void defineCharacter(uint8_t index, const uint8_t* rows)
+    {
+        command(0x40 | (index << 3));
+        for (uint8_t i = 0; i < 8; ++i) {
+            write(rows[i]);
+        }
+    }
+
+    void write(char c)
+    {
+        _rs = true;
+        writeByte(c);
+    }
+
+    void command(uint8_t c)
+    {
+        _rs = false;
+        writeByte(c);
+    }
+
+private:
+    void writeByte(uint8_t b)
+    {
+        writeNibble(b >> 4);
+        writeNibble(b);
+        _delay_us(40);
+    }
+
+    void writeNibble(uint8_t n)
+    {
+        _d4 = n & 0x01;
+        _d5 = n & 0x02;
+        _d6 = n & 0x04;
+        _d7 = n & 0x08;
+        _e = true;
+        _delay_us(1);
+        _e = false;
+    }
+
+    RS _rs;
+    E _e;
+    D4 _d4;
+    D5 _d5;
+    D6 _d6;
+    D7 _d7;
+};
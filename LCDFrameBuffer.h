@@ -0,0 +1,167 @@
+//
+//  LCDFrameBuffer.h
+//
+//  RAM shadow of a text LCD, flushed incrementally
+//
+
+#pragma once
+
+#include "TextStream.h"
+
+//
+// Everything is rendered into a Width x Height character buffer. Writing a
+// character that is already in a cell is free, anything else marks the cell
+// dirty. flush() sends only dirty cells to the LCD, moving the cursor only
+// when the next dirty cell doesn't follow the last one written, and stops
+// after a given number of LCD writes so a full redraw can be spread over
+// several idle passes. Since nothing is ever cleared on the LCD itself there
+// is no flicker and no 1.5ms clear command.
+//
+// A line that has been started (with FrameSetLine, '\n' or FrameClear) is
+// treated as complete: any part of it that isn't written is blank.
+//
+// Formatting comes from TextStream, so the app uses
+// TextStream<LCDFrameBuffer<...>>.
+//
+
+struct FrameClear { };
+struct FrameSetLine
+{
+    FrameSetLine(uint8_t line) : _line(line) { }
+    uint8_t _line;
+};
+
+template<uint8_t Width, uint8_t Height, typename LCD>
+class LCDFrameBuffer {
+public:
+    static const uint8_t Size = Width * Height;
+
+    void init()
+    {
+        _lcd.init();
+        for (uint8_t i = 0; i < Size; ++i) {
+            _buffer[i] = ' ';
+        }
+        setLine(0);
+    }
+
+    void clear()
+    {
+        for (uint8_t i = 0; i < Size; ++i) {
+            put(i, ' ');
+        }
+        setLine(0);
+    }
+
+    void setLine(uint8_t line)
+    {
+        padLine();
+        if (line >= Height) {
+            _cursor = _lineEnd = Size;
+            return;
+        }
+        _cursor = line * Width;
+        _lineEnd = _cursor + Width;
+    }
+
+    void write(char c)
+    {
+        if (c == '\n') {
+            setLine(_lineEnd / Width);
+        } else if (_cursor < _lineEnd) {
+            put(_cursor++, c);
+        }
+    }
+
+    bool dirty() const
+    {
+        for (uint8_t i = 0; i < sizeof(_dirty); ++i) {
+            if (_dirty[i]) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Send at most maxWrites characters and cursor moves to the LCD. Returns
+    // true when the LCD is up to date. Each call carries on from where the
+    // last one stopped, so no part of the screen is starved.
+    bool flush(uint8_t maxWrites)
+    {
+        padLine();
+        for (uint8_t n = 0; n < Size; ++n) {
+            uint8_t i = _flushNext + n;
+            if (i >= Size) {
+                i -= Size;
+            }
+            if (!(_dirty[i >> 3] & (1 << (i & 7)))) {
+                continue;
+            }
+            if ((i != _lcdCursor && maxWrites < 2) || maxWrites == 0) {
+                _flushNext = i;
+                return false;
+            }
+            if (i != _lcdCursor) {
+                _lcd.setCursor(i % Width, i / Width);
+                --maxWrites;
+            }
+            _lcd.write(_buffer[i]);
+            --maxWrites;
+            _dirty[i >> 3] &= ~(1 << (i & 7));
+
+            // The LCD's address doesn't run on from the end of one line to the next
+            _lcdCursor = ((i + 1) % Width) ? i + 1 : 0xff;
+        }
+        return true;
+    }
+
+    void flushAll() { flush(0xff); }
+
+    // A character for the LCD's CGRAM. What's on the screen stays as it is.
+    void defineCharacter(uint8_t index, const uint8_t* rows)
+    {
+        _lcd.defineCharacter(index, rows);
+        _lcdCursor = 0xff;
+    }
+
+    LCD& lcd() { return _lcd; }
+
+private:
+    void put(uint8_t i, char c)
+    {
+        if (_buffer[i] != c) {
+            _buffer[i] = c;
+            _dirty[i >> 3] |= 1 << (i & 7);
+        }
+    }
+
+    // Blank from the cursor to the end of the current line, without moving the cursor
+    void padLine()
+    {
+        for (uint8_t i = _cursor; i < _lineEnd; ++i) {
+            put(i, ' ');
+        }
+    }
+
+    LCD _lcd;
+    char _buffer[Size];
+    uint8_t _dirty[(Size + 7) / 8] = { };
+    uint8_t _cursor = 0;
+    uint8_t _lineEnd = 0;
+    uint8_t _lcdCursor = 0xff;
+    uint8_t _flushNext = 0;
+};
+
+template<uint8_t Width, uint8_t Height, typename LCD>
+TextStream<LCDFrameBuffer<Width, Height, LCD>>& operator<<(TextStream<LCDFrameBuffer<Width, Height, LCD>>& s, const FrameClear&)
+{
+    s.clear();
+    return s;
+}
+
+template<uint8_t Width, uint8_t Height, typename LCD>
+TextStream<LCDFrameBuffer<Width, Height, LCD>>& operator<<(TextStream<LCDFrameBuffer<Width, Height, LCD>>& s, const FrameSetLine& l)
+{
+    s.setLine(l._line);
+    return s;
+}
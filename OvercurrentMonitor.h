@@ -0,0 +1,211 @@
+//
+//  OvercurrentMonitor.h
+//
+//  High rate overcurrent detection run from the Timer2 interrupt
+//
+
+#pragma once
+
+#include <avr/io.h>
+#include <util/atomic.h>
+
+#include "AsyncINA219.h"
+
+//
+// Timer2 runs in CTC mode at PollHz. Each tick, for every supply, the result
+// of the shunt register read queued on the previous tick is compared against
+// the supply's threshold (in raw shunt register units), and the next read is
+// queued. After FilterCount consecutive samples over the threshold the supply
+// is reported as tripped from handleInterrupt(), still in interrupt context.
+//
+// The sensors must be in a continuous conversion mode. The measured latency
+// runs from the submission of the first over threshold read to the tick that
+// trips. The age of the conversion that read returned (at most one INA219
+// conversion time) comes on top of it.
+//
+// Timer2 runs off the I/O clock, so it stops in ADC noise reduction sleep and
+// a tick then lasts longer than PollPeriodUs. setStoppedUs() gives the most
+// it can stop for between a read being queued and the tick that checks it.
+// It's added to the measured latency, so that can read high by as much but
+// never low. Once a supply's samples are over its threshold the owner keeps
+// the timer running until it trips or drops back, see overThreshold(), so
+// that's the only stop that can fall inside the latency.
+//
+// The timer can also run without polling, just to keep ticks() going as a
+// time base for the rest of the app.
+//
+
+template<uint8_t NumSupplies, uint16_t PollHz, uint8_t FilterCount>
+class OvercurrentMonitor {
+    static_assert(FilterCount > 0, "FilterCount must be at least 1");
+    static_assert(F_CPU / 128 / PollHz > 0 && F_CPU / 128 / PollHz <= 256, "PollHz out of range for Timer2 with a 128 prescaler");
+
+public:
+    static const uint16_t TimerCount = F_CPU / 128 / PollHz;
+    static const uint16_t PollPeriodUs = TimerCount * (1000000UL * 128 / F_CPU);
+
+    // Worst case from an overload appearing on the shunt to handleInterrupt()
+    // reporting the trip, given the INA219's conversion time and the longest
+    // the timer can be stopped for, see above
+    static constexpr uint32_t worstCaseLatencyUs(uint16_t conversionUs, uint16_t stoppedUs = 0)
+    {
+        return conversionUs + static_cast<uint32_t>(FilterCount + 1) * PollPeriodUs + stoppedUs;
+    }
+
+    void setSensor(uint8_t supply, TWIQueue* twi, uint8_t address)
+    {
+        _twi = twi;
+        _address[supply] = address;
+    }
+
+    void setThreshold(uint8_t supply, int16_t threshold)
+    {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            _threshold[supply] = threshold;
+        }
+    }
+
+    int16_t threshold(uint8_t supply) const
+    {
+        int16_t threshold = 0;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            threshold = _threshold[supply];
+        }
+        return threshold;
+    }
+
+    // Clear the trip state after the outputs have been re-enabled
+    void reset()
+    {
+        for (uint8_t i = 0; i < NumSupplies; ++i) {
+            reset(i);
+        }
+    }
+
+    void reset(uint8_t supply)
+    {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            _tripped &= ~(1 << supply);
+            _overCount[supply] = 0;
+        }
+    }
+
+    void setStoppedUs(uint16_t us) { _stoppedUs = us; }
+
+    // True while any supply that hasn't tripped has samples over its
+    // threshold, when the timer must not stop
+    bool overThreshold() const
+    {
+        bool over = false;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            for (uint8_t i = 0; i < NumSupplies; ++i) {
+                if (_overCount[i] && !(_tripped & (1 << i))) {
+                    over = true;
+                }
+            }
+        }
+        return over;
+    }
+
+    void start(bool poll = true)
+    {
+        _polling = poll;
+        TCCR2A = _BV(WGM21);
+        TCCR2B = _BV(CS22) | _BV(CS20);
+        OCR2A = TimerCount - 1;
+        TIMSK2 |= _BV(OCIE2A);
+    }
+
+    void stop()
+    {
+        TIMSK2 &= ~_BV(OCIE2A);
+    }
+
+    // Worst measured latency in us, see above
+    uint16_t maxLatencyUs(uint8_t supply) const
+    {
+        uint16_t latency = 0;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            latency = _maxLatencyUs[supply];
+        }
+        return latency;
+    }
+
+    // Free running count of timer ticks, at PollHz
+    uint16_t ticks() const
+    {
+        uint16_t ticks = 0;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            ticks = _ticks;
+        }
+        return ticks;
+    }
+
+    // Latest shunt register value seen by the monitor
+    int16_t shuntVoltage(uint8_t supply) const
+    {
+        int16_t value = 0;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            value = _shuntVoltage[supply];
+        }
+        return value;
+    }
+
+    // Called from ISR(TIMER2_COMPA_vect). Returns a bit mask of the supplies
+    // that tripped on this tick.
+    uint8_t handleInterrupt()
+    {
+        ++_ticks;
+        uint8_t tripped = 0;
+        if (!_polling) {
+            return tripped;
+        }
+
+        for (uint8_t i = 0; i < NumSupplies; ++i) {
+            TWITransaction& read = _read[i];
+            if (read.busy()) {
+                continue;
+            }
+            if (read.status() == TWITransaction::Status::Done) {
+                _shuntVoltage[i] = static_cast<int16_t>(read.value());
+                if (_shuntVoltage[i] > _threshold[i]) {
+                    if (_overCount[i] == 0) {
+                        _overStart[i] = _readTick[i];
+                    }
+                    if (_overCount[i] != 0xff) {
+                        ++_overCount[i];
+                    }
+                    if (_overCount[i] >= FilterCount && !(_tripped & (1 << i))) {
+                        _tripped |= 1 << i;
+                        tripped |= 1 << i;
+                        uint16_t latency = (_ticks - _overStart[i]) * PollPeriodUs + _stoppedUs;
+                        if (latency > _maxLatencyUs[i]) {
+                            _maxLatencyUs[i] = latency;
+                        }
+                    }
+                } else {
+                    _overCount[i] = 0;
+                }
+            }
+            read.setRead(_address[i], AsyncINA219::RegShuntVoltage);
+            _readTick[i] = _ticks;
+            _twi->submit(read);
+        }
+        return tripped;
+    }
+
+private:
+    TWIQueue* _twi = nullptr;
+    uint8_t _address[NumSupplies];
+    TWITransaction _read[NumSupplies];
+    int16_t _threshold[NumSupplies];
+    int16_t _shuntVoltage[NumSupplies];
+    uint8_t _overCount[NumSupplies];
+    uint16_t _readTick[NumSupplies];
+    uint16_t _overStart[NumSupplies];
+    uint16_t _maxLatencyUs[NumSupplies];
+    uint16_t _ticks = 0;
+    uint16_t _stoppedUs = 0;
+    uint8_t _tripped = 0;
+    bool _polling = false;
+};
@@ -0,0 +1,68 @@
+//
+//  Oversampler.h
+//
+//  Compile time configured oversampling and decimation of ADC samples
+//
+
+#pragma once
+
+#include "Scaling.h"
+
+//
+// Oversampler<SampleCount, ExtraBits> sums SampleCount raw samples and then
+// produces one value with InputBits + ExtraBits of resolution. With
+// ExtraBits = 0 that's the rounded average. Each extra bit needs at least 4x
+// oversampling (e.g. 16 samples for 12 bits from the 10 bit ADC) and enough
+// noise on the input to dither it. The accumulator is the smallest unsigned
+// type that can hold SampleCount full scale samples.
+//
+
+namespace oversampling {
+
+template<bool Condition, typename Then, typename Else> struct Select { typedef Then type; };
+template<typename Then, typename Else> struct Select<false, Then, Else> { typedef Else type; };
+
+template<uint32_t Max>
+struct UIntFor
+{
+    typedef typename Select<(Max <= 0xff), uint8_t, typename Select<(Max <= 0xffff), uint16_t, uint32_t>::type>::type type;
+};
+
+constexpr uint32_t pow4(uint8_t n) { return n ? 4 * pow4(n - 1) : 1; }
+
+}
+
+template<uint16_t SampleCount, uint8_t ExtraBits = 0, uint8_t InputBits = 10>
+class Oversampler {
+    static_assert(SampleCount > 0, "SampleCount must be at least 1");
+    static_assert(SampleCount >= oversampling::pow4(ExtraBits), "Each extra bit of resolution needs 4x oversampling");
+    static_assert(InputBits + ExtraBits <= 16, "Values are 16 bit");
+
+public:
+    static const uint8_t OutputBits = InputBits + ExtraBits;
+    static const uint32_t MaxAccumulator = static_cast<uint32_t>(SampleCount) * ((1UL << InputBits) - 1);
+    static const uint16_t MaxValue = (1UL << OutputBits) - 1;
+    typedef typename oversampling::UIntFor<MaxAccumulator>::type Accumulator;
+    typedef Scale<1UL << ExtraBits, SampleCount, MaxAccumulator> Decimate;
+
+    // Returns true when a new value is ready
+    bool add(uint16_t sample)
+    {
+        _accumulator += sample;
+        if (++_count < SampleCount) {
+            return false;
+        }
+        _value = Decimate::apply(_accumulator);
+        _accumulator = 0;
+        _count = 0;
+        return true;
+    }
+
+    // Latest value, full scale is MaxValue
+    uint16_t value() const { return _value; }
+
+private:
+    Accumulator _accumulator = 0;
+    typename oversampling::UIntFor<SampleCount>::type _count = 0;
+    uint16_t _value = 0;
+};
@@ -0,0 +1,187 @@
+//
+//  Profiler.h
+//
+//  Timer1 cycle counter based section timing and latency histograms
+//
+
+#pragma once
+
+#include <avr/io.h>
+#include <util/atomic.h>
+
+//
+// Timer1 runs free at the CPU clock and its overflow interrupt extends it to
+// 32 bits, so now() is a cycle count good for about 4 minutes at 16MHz. All
+// differences are taken modulo 2^32, which stays right across the wrap.
+//
+// A section is timed from construction to destruction of a ProfileScope.
+// The cost of reading the counter itself is measured once in start() and
+// taken off every sample, so an empty section reads 0.
+//
+// Latencies come in two kinds. mark()/serviced() measure from an event
+// (typically in an ISR) to the code that deals with it; only the first mark
+// before each service counts, so it's the oldest pending event that's
+// timed. interval() measures lateness of something that should happen every
+// 'nominal' cycles. Each latency also has a histogram in powers of 4 from
+// under 4us up to 16ms and more.
+//
+// Every stat keeps min, max and a running mean. When the sum or count gets
+// too big both are halved, so the mean slowly forgets old samples instead of
+// overflowing.
+//
+
+struct ProfileStats
+{
+    void add(uint32_t cycles)
+    {
+        if (cycles < _min) {
+            _min = cycles;
+        }
+        if (cycles > _max) {
+            _max = cycles;
+        }
+        if (_count == 0xffff || _total > 0xffffffff - cycles) {
+            _total >>= 1;
+            _count >>= 1;
+        }
+        _total += cycles;
+        ++_count;
+    }
+
+    uint32_t mean() const { return _count ? _total / _count : 0; }
+
+    uint32_t _min = 0xffffffff;
+    uint32_t _max = 0;
+    uint32_t _total = 0;
+    uint16_t _count = 0;
+};
+
+template<uint8_t NumSections, uint8_t NumLatencies>
+class Profiler {
+    static_assert(NumLatencies <= 8, "Pending marks are kept in a byte");
+
+public:
+    static const uint8_t NumEntries = NumSections + NumLatencies;
+    static const uint8_t HistogramBuckets = 8;
+    static const uint16_t CyclesPerUs = F_CPU / 1000000;
+
+    void start()
+    {
+        TCCR1A = 0;
+        TCCR1B = _BV(CS10);
+        TCNT1 = 0;
+        TIFR1 = _BV(TOV1);
+        TIMSK1 = _BV(TOIE1);
+
+        uint32_t t = now();
+        _overhead = now() - t;
+    }
+
+    void handleOverflowInterrupt() { ++_overflows; }
+
+    // Safe to call with interrupts on or off
+    uint32_t now() const
+    {
+        uint16_t high;
+        uint16_t low = 0;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            high = _overflows;
+            low = TCNT1;
+
+            // An overflow that hasn't been serviced yet belongs to a low count
+            if ((TIFR1 & _BV(TOV1)) && low < 0x8000) {
+                ++high;
+            }
+        }
+        return (static_cast<uint32_t>(high) << 16) | low;
+    }
+
+    void record(uint8_t section, uint32_t startCycles) { _stats[section].add(elapsed(startCycles)); }
+
+    void mark(uint8_t latency)
+    {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            if (!(_pending & (1 << latency))) {
+                _marks[latency] = now();
+                _pending |= 1 << latency;
+            }
+        }
+    }
+
+    void serviced(uint8_t latency)
+    {
+        uint32_t cycles = 0;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            if (!(_pending & (1 << latency))) {
+                return;
+            }
+            _pending &= ~(1 << latency);
+            cycles = elapsed(_marks[latency]);
+        }
+        addLatency(latency, cycles);
+    }
+
+    // Not for use from ISRs
+    void interval(uint8_t latency, uint32_t nominal)
+    {
+        uint32_t t = now();
+        if (_started & (1 << latency)) {
+            uint32_t cycles = t - _marks[latency];
+            addLatency(latency, (cycles > nominal) ? cycles - nominal : 0);
+        }
+        _marks[latency] = t;
+        _started |= 1 << latency;
+    }
+
+    // Entries are the sections followed by the latencies
+    const ProfileStats& stats(uint8_t entry) const { return _stats[entry]; }
+    uint16_t histogram(uint8_t latency, uint8_t bucket) const { return _histograms[latency][bucket]; }
+
+    static uint16_t microseconds(uint32_t cycles)
+    {
+        cycles /= CyclesPerUs;
+        return (cycles > 0xffff) ? 0xffff : cycles;
+    }
+
+private:
+    uint32_t elapsed(uint32_t startCycles) const
+    {
+        uint32_t cycles = now() - startCycles;
+        return (cycles > _overhead) ? cycles - _overhead : 0;
+    }
+
+    void addLatency(uint8_t latency, uint32_t cycles)
+    {
+        _stats[NumSections + latency].add(cycles);
+
+        uint8_t bucket = 0;
+        uint32_t limit = 4UL * CyclesPerUs;
+        while (bucket < HistogramBuckets - 1 && cycles >= limit) {
+            limit <<= 2;
+            ++bucket;
+        }
+        if (_histograms[latency][bucket] != 0xffff) {
+            ++_histograms[latency][bucket];
+        }
+    }
+
+    volatile uint16_t _overflows = 0;
+    uint8_t _overhead = 0;
+    ProfileStats _stats[NumEntries];
+    uint16_t _histograms[NumLatencies][HistogramBuckets] = { };
+    uint32_t _marks[NumLatencies];
+    volatile uint8_t _pending = 0;
+    uint8_t _started = 0;
+};
+
+template<typename P>
+class ProfileScope {
+public:
+    ProfileScope(P& profiler, uint8_t section) : _profiler(profiler), _section(section), _start(profiler.now()) { }
+    ~ProfileScope() { _profiler.record(_section, _start); }
+
+private:
+    P& _profiler;
+    uint8_t _section;
+    uint32_t _start;
+};
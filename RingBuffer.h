@@ -0,0 +1,63 @@
+//
+//  RingBuffer.h
+//
+//  Lock-free single producer/single consumer ring buffer
+//
+
+#pragma once
+
+#include <stdint.h>
+
+//
+// The producer (typically an ISR) only writes _head and the consumer (the
+// event loop) only writes _tail. Both are 8 bit, so reads and writes are
+// atomic on the AVR and no interrupt masking is needed. The indexes run
+// freely and are masked on access, which lets the buffer use all Size slots.
+//
+
+template<typename T, uint8_t Size>
+class RingBuffer {
+    static_assert(Size > 0 && Size <= 128 && (Size & (Size - 1)) == 0, "RingBuffer Size must be a power of 2 no larger than 128");
+
+public:
+    bool empty() const { return _head == _tail; }
+    bool full() const { return static_cast<uint8_t>(_head - _tail) >= Size; }
+    uint8_t count() const { return _head - _tail; }
+    static constexpr uint8_t capacity() { return Size; }
+
+    // Producer side
+    bool push(const T& value)
+    {
+        uint8_t head = _head;
+        if (static_cast<uint8_t>(head - _tail) >= Size) {
+            return false;
+        }
+        _buffer[head & Mask] = value;
+        __asm__ __volatile__("" ::: "memory");
+        _head = head + 1;
+        return true;
+    }
+
+    // Consumer side
+    bool pop(T& value)
+    {
+        uint8_t tail = _tail;
+        if (tail == _head) {
+            return false;
+        }
+        value = _buffer[tail & Mask];
+        __asm__ __volatile__("" ::: "memory");
+        _tail = tail + 1;
+        return true;
+    }
+
+    const T& peek() const { return _buffer[_tail & Mask]; }
+    void clear() { _tail = _head; }
+
+private:
+    static const uint8_t Mask = Size - 1;
+
+    T _buffer[Size];
+    volatile uint8_t _head = 0;
+    volatile uint8_t _tail = 0;
+};
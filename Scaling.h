@@ -0,0 +1,90 @@
+//
+//  Scaling.h
+//
+//  Division free scaling by compile time constant ratios
+//
+
+#pragma once
+
+#include <stdint.h>
+
+//
+// Scale<Num, Den, MaxInput>::apply(x) returns x * Num / Den, rounded to
+// nearest (halves up, the same as the hand written (x * Num + Den / 2) / Den)
+// or down, for 0 <= x <= MaxInput. The ratio is reduced at compile time.
+// If what's left of Den is a power of 2 the result is a multiply and a shift.
+// Otherwise the quotient is estimated with a 16x16 bit multiply by the
+// reciprocal of Den and corrected with a multiply and compare, which gives
+// exactly the result of the division for every input in range. If the
+// largest x * Num + Den / 2, with the ratio reduced, fits in 16 bits it's all
+// 16 bit arithmetic. Otherwise the product and the correction are 32 bit.
+//
+
+namespace scaling {
+
+// C++11 constexpr functions have to be a single return statement
+constexpr uint32_t gcd(uint32_t a, uint32_t b) { return b ? gcd(b, a % b) : a; }
+constexpr bool isPowerOf2(uint32_t v) { return v && !(v & (v - 1)); }
+constexpr uint8_t log2(uint32_t v) { return (v > 1) ? 1 + log2(v >> 1) : 0; }
+
+// Right shift needed to bring max down to 16 bits
+constexpr uint8_t shiftTo16Bits(uint32_t max) { return (max > 0xffff) ? 1 + shiftTo16Bits(max >> 1) : 0; }
+
+// The narrowest unsigned type that holds every dividend
+template<bool Fits16> struct Dividend { typedef uint32_t type; };
+template<> struct Dividend<true> { typedef uint16_t type; };
+
+// floor(x / Divisor) for 0 <= x <= MaxDividend, with x of the type above
+template<uint32_t Divisor, uint32_t MaxDividend, bool PowerOf2 = isPowerOf2(Divisor)>
+struct Divide
+{
+    typedef typename Dividend<(MaxDividend <= 0xffff)>::type Type;
+    static const uint8_t Shift = log2(Divisor);
+    static_assert((MaxDividend >> Shift) <= 0xffff, "Quotient must fit in 16 bits");
+    static uint16_t apply(Type x) { return x >> Shift; }
+};
+
+template<uint32_t Divisor, uint32_t MaxDividend>
+struct Divide<Divisor, MaxDividend, false>
+{
+    typedef typename Dividend<(MaxDividend <= 0xffff)>::type Type;
+    static const uint8_t PreShift = shiftTo16Bits(MaxDividend);
+    static_assert((1UL << PreShift) < Divisor, "Divisor too small for the dividend range");
+    static_assert(Divisor <= 0xffff && MaxDividend / Divisor <= 0xffff, "Quotient must fit in 16 bits");
+
+    // Rounded down, so the estimate below is never more than the real quotient
+    static const uint16_t Reciprocal = (1UL << (16 + PreShift)) / Divisor;
+
+    static uint16_t apply(Type x)
+    {
+        // The estimate is low by at most 2^PreShift / Divisor + 1, so this
+        // loop runs at most twice. q * Divisor is at most x, so it fits Type.
+        uint16_t q = (static_cast<uint32_t>(static_cast<uint16_t>(x >> PreShift)) * Reciprocal) >> 16;
+        Type r = x - static_cast<Type>(static_cast<Type>(q) * static_cast<uint16_t>(Divisor));
+        while (r >= Divisor) {
+            ++q;
+            r -= Divisor;
+        }
+        return q;
+    }
+};
+
+}
+
+enum class Rounding : uint8_t { Down, Nearest };
+
+template<uint32_t Num, uint32_t Den, uint32_t MaxInput, Rounding Round = Rounding::Nearest>
+struct Scale
+{
+    static const uint32_t N = Num / scaling::gcd(Num, Den);
+    static const uint32_t D = Den / scaling::gcd(Num, Den);
+    static const uint32_t Bias = (Round == Rounding::Nearest) ? D / 2 : 0;
+    static_assert(static_cast<uint64_t>(MaxInput) * N + Bias <= 0xffffffff, "Scale overflows 32 bits");
+
+    typedef scaling::Divide<D, MaxInput * N + Bias> Divider;
+    typedef typename Divider::Type Product;
+
+    // In Product throughout, so a 16 bit Product stays a 16x16 bit multiply
+    template<typename T>
+    static uint16_t apply(T x) { return Divider::apply(static_cast<Product>(static_cast<Product>(x) * static_cast<Product>(N) + static_cast<Product>(Bias))); }
+};
@@ -0,0 +1,149 @@
+//
+//  SerialPort.h
+//
+//  Interrupt driven transmit and receive on USART0
+//
+
+#pragma once
+
+#include "RingBuffer.h"
+#include <avr/io.h>
+#include <util/atomic.h>
+
+//
+// Bytes are queued in a ring buffer and sent from the data register empty
+// interrupt, which is only enabled while there is something to send. There
+// are two ways in: write(char) is for text through TextStream and waits for
+// room when the buffer is full, so nothing is lost. tryWrite() never waits,
+// it's for callers like telemetry that check room() for a whole record first
+// and would rather drop it than stall. Since only the event loop writes and
+// the interrupt only frees space, room can't shrink between the check and
+// the writes.
+//
+// Received bytes are put in a second ring buffer by the receive complete
+// interrupt for read() to take. A byte that comes in with a framing error,
+// or with the buffer full, is dropped. Where it was dropped is noted by
+// counting the bytes, and takeReceiveError() only says so once the reader
+// has read up to the gap, so it throws away what was coming in there and
+// not what it was still working on from before. Gaps that come in before
+// the reader gets to the first are merged, and takeReceiveError() says so
+// from the first to the last.
+//
+// The receiver stops with the I/O clock in ADC noise reduction sleep. RXD0 is
+// PD0, which is also PCINT16, and a pin change interrupt wakes the CPU from
+// that sleep a few cycles after the falling edge of a start bit, well inside
+// the first half of the bit, so the receiver still sees the whole byte.
+// armStartWake() turns that on for when the line is quiet. The owner's
+// ISR(PCINT2_vect) calls handleStartInterrupt(), which turns it off again,
+// so bytes back to back don't interrupt on every edge.
+//
+// The baud rate divisor uses double speed mode, which halves the error at
+// the common rates.
+//
+
+template<uint8_t TxBufferSize, uint8_t RxBufferSize>
+class SerialPort {
+public:
+    void init(uint32_t baud)
+    {
+        UBRR0 = (F_CPU / 8 + baud / 2) / baud - 1;
+        UCSR0A = _BV(U2X0);
+        UCSR0C = _BV(UCSZ01) | _BV(UCSZ00);  // 8N1
+        UCSR0B = _BV(TXEN0) | _BV(RXEN0) | _BV(RXCIE0);
+    }
+
+    void armStartWake()
+    {
+        PCIFR = _BV(PCIF2);
+        PCMSK2 |= _BV(PCINT16);
+        PCICR |= _BV(PCIE2);
+    }
+
+    void handleStartInterrupt() { PCMSK2 &= ~_BV(PCINT16); }
+
+    uint8_t room() const { return _tx.capacity() - _tx.count(); }
+
+    // True when the last byte has completely left the shift register
+    bool idle() const { return _tx.empty() && (!_sent || (UCSR0A & _BV(TXC0))); }
+
+    bool tryWrite(uint8_t b)
+    {
+        if (!_tx.push(b)) {
+            return false;
+        }
+        UCSR0B |= _BV(UDRIE0);
+        return true;
+    }
+
+    void write(char c)
+    {
+        while (!tryWrite(c)) ;
+    }
+
+    bool read(uint8_t& b)
+    {
+        if (!_rx.pop(b)) {
+            return false;
+        }
+        ++_read;
+        return true;
+    }
+
+    // True if bytes were lost between the last read() and the next, see above
+    bool takeReceiveError()
+    {
+        bool error = false;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            if (_lost && _read == _lostFrom) {
+                error = true;
+                if (_lostFrom == _lostTo) {
+                    _lost = false;
+                } else {
+                    ++_lostFrom;
+                }
+            }
+        }
+        return error;
+    }
+
+    void handleDataRegisterEmptyInterrupt()
+    {
+        uint8_t b;
+        if (_tx.pop(b)) {
+            // Writing a one clears the transmit complete flag
+            UCSR0A = _BV(U2X0) | _BV(TXC0);
+            UDR0 = b;
+            _sent = true;
+        } else {
+            UCSR0B &= ~_BV(UDRIE0);
+        }
+    }
+
+    void handleReceiveInterrupt()
+    {
+        // The error flags are for the byte in UDR0, so read them first
+        bool error = UCSR0A & (_BV(FE0) | _BV(DOR0));
+        uint8_t b = UDR0;
+        if (!error && _rx.push(b)) {
+            ++_received;
+            return;
+        }
+        if (!_lost) {
+            _lostFrom = _received;
+        }
+        _lostTo = _received;
+        _lost = true;
+    }
+
+private:
+    RingBuffer<uint8_t, TxBufferSize> _tx;
+    RingBuffer<uint8_t, RxBufferSize> _rx;
+    volatile bool _sent = false;
+
+    // Bytes are counted in and out, and a gap is where the count in was
+    volatile uint8_t _received = 0;
+    uint8_t _read = 0;
+    volatile uint8_t _lostFrom = 0;
+    volatile uint8_t _lostTo = 0;
+    volatile bool _lost = false;
+};
@@ -0,0 +1,139 @@
+//
+//  SettingsStore.h
+//
+//  Wear leveled EEPROM record, written in the background
+//
+
+#pragma once
+
+#include <avr/eeprom.h>
+#include <avr/io.h>
+#include <string.h>
+#include <util/atomic.h>
+#include <util/crc16.h>
+
+//
+// The EEPROM from BaseAddress holds a ring of NumSlots slots. Each slot is a
+// 16 bit sequence number, the record and a CRC-16 of both. Every save goes
+// to the slot after the last one, so the wear is spread over the ring. At
+// boot load() reads all of them and takes the valid one with the newest
+// sequence number (compared modulo 2^16, which is fine as long as there are
+// far fewer slots than that).
+//
+// save() only copies the record and returns. The bytes go out one at a time
+// from the EEPROM ready interrupt, about 3.4ms each, and bytes that already
+// hold the right value are skipped. A save while a write is in progress is
+// picked up when the write finishes, so only the latest record is written.
+// The slot being written is never the newest valid one, so losing power
+// part way through just leaves its CRC wrong and the previous record wins.
+//
+
+template<typename Record, uint16_t BaseAddress, uint8_t NumSlots>
+class SettingsStore {
+public:
+    static const uint8_t SlotSize = sizeof(uint16_t) + sizeof(Record) + sizeof(uint16_t);
+    static_assert(NumSlots > 1, "Need at least 2 slots");
+    static_assert(BaseAddress + static_cast<uint32_t>(SlotSize) * NumSlots <= E2END + 1, "Settings don't fit in the EEPROM");
+
+    // Returns false if there is no valid record, leaving record untouched
+    bool load(Record& record)
+    {
+        bool found = false;
+        for (uint8_t slot = 0; slot < NumSlots; ++slot) {
+            uint8_t image[SlotSize];
+            eeprom_read_block(image, reinterpret_cast<const void*>(slotAddress(slot)), SlotSize);
+            if (crc(image) != readWord(image + SlotSize - 2)) {
+                continue;
+            }
+            uint16_t sequence = readWord(image);
+            if (found && static_cast<int16_t>(sequence - _sequence) <= 0) {
+                continue;
+            }
+            found = true;
+            _sequence = sequence;
+            _slot = slot;
+            memcpy(&record, image + 2, sizeof(Record));
+        }
+        if (found) {
+            _record = record;
+        }
+        return found;
+    }
+
+    void save(const Record& record)
+    {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            _record = record;
+            _pending = true;
+            if (!_writing) {
+                startWrite();
+            }
+        }
+    }
+
+    bool busy() const { return _pending || _writing; }
+
+    // Called from ISR(EE_READY_vect) whenever the EEPROM is free
+    void handleReadyInterrupt()
+    {
+        while (_index < SlotSize) {
+            uint16_t address = slotAddress(_slot) + _index;
+            uint8_t value = _image[_index++];
+            EEAR = address;
+            EECR |= _BV(EERE);
+            if (EEDR != value) {
+                EEDR = value;
+                EECR |= _BV(EEMPE);
+                EECR |= _BV(EEPE);
+                return;
+            }
+        }
+
+        _writing = false;
+        if (_pending) {
+            startWrite();
+        } else {
+            EECR &= ~_BV(EERIE);
+        }
+    }
+
+private:
+    static uint16_t slotAddress(uint8_t slot) { return BaseAddress + static_cast<uint16_t>(slot) * SlotSize; }
+    static uint16_t readWord(const uint8_t* p) { return p[0] | (static_cast<uint16_t>(p[1]) << 8); }
+
+    static uint16_t crc(const uint8_t* image)
+    {
+        uint16_t crc = 0xffff;
+        for (uint8_t i = 0; i < SlotSize - 2; ++i) {
+            crc = _crc16_update(crc, image[i]);
+        }
+        return crc;
+    }
+
+    // Interrupts must be off
+    void startWrite()
+    {
+        _pending = false;
+        _writing = true;
+        if (++_slot >= NumSlots) {
+            _slot = 0;
+        }
+        ++_sequence;
+        _image[0] = _sequence;
+        _image[1] = _sequence >> 8;
+        memcpy(_image + 2, &_record, sizeof(Record));
+        uint16_t c = crc(_image);
+        _image[SlotSize - 2] = c;
+        _image[SlotSize - 1] = c >> 8;
+        _index = 0;
+        EECR |= _BV(EERIE);
+    }
+
+    Record _record;
+    uint8_t _image[SlotSize];
+    uint16_t _sequence = 0;
+    uint8_t _slot = NumSlots - 1;
+    volatile uint8_t _index = 0;
+    volatile bool _pending = false;
+    volatile bool _writing = false;
+};
@@ -0,0 +1,104 @@
+//
+//  StackMonitor.h
+//
+//  Stack painting, high water mark and guard zone check
+//
+
+#pragma once
+
+#include <avr/io.h>
+
+//
+// There's no malloc, so all the RAM between the end of the static data
+// (__heap_start) and RAMEND belongs to the stack, which main, the event
+// loop and every ISR share. Before the C runtime sets up the stack, an
+// .init1 hook paints all of it with StackPaint. The stack only ever writes
+// over the paint from the top down, so the paint left at the bottom is what
+// has never been used: unused() is the lowest the free RAM has ever been.
+//
+// check() scans up from __heap_start to the first byte that isn't paint, so
+// it takes about 4 cycles per unused byte, and is meant to be run now and
+// then rather than from an ISR. It also notes how much is free below the
+// stack pointer where it's called from. The bottom GuardBytes are the
+// guard zone: once the stack has reached into them, it is about to run over
+// the static data, and check() returns false.
+//
+// Host builds have no AVR stack. A painted block stands in for the region,
+// so the scans run but always find the whole of it unused.
+//
+
+const uint8_t StackPaint = 0xc5;
+
+#ifdef __AVR__
+extern uint8_t __heap_start;
+
+// Naked and with no C, because r1 isn't zero yet and there's no stack
+__attribute__((naked, used, section(".init1"))) static void paintStack()
+{
+    asm volatile(
+        "    ldi r30, lo8(__heap_start)\n"
+        "    ldi r31, hi8(__heap_start)\n"
+        "    ldi r24, %0\n"
+        "    ldi r25, hi8(%1)\n"
+        "1:  st Z+, r24\n"
+        "    cpi r30, lo8(%1)\n"
+        "    cpc r31, r25\n"
+        "    brlo 1b\n"
+        :: "M" (StackPaint), "i" (RAMEND + 1));
+}
+#endif
+
+template<uint8_t GuardBytes>
+class StackMonitor {
+public:
+    // Returns false if the stack has reached the guard zone
+    bool check()
+    {
+        const uint8_t* p = bottom();
+        const uint8_t* end = top();
+        while (p < end && *p == StackPaint) {
+            ++p;
+        }
+        _unused = p - bottom();
+        _free = stackPointer() - bottom();
+        return _unused >= GuardBytes;
+    }
+
+    // Free now, below the stack pointer at the last check
+    uint16_t free() const { return _free; }
+
+    // Never touched since reset, including the guard zone
+    uint16_t unused() const { return _unused; }
+
+    // Deepest the stack has been
+    uint16_t maxDepth() const { return top() - bottom() - _unused; }
+
+private:
+#ifdef __AVR__
+    static const uint8_t* bottom() { return &__heap_start; }
+    static const uint8_t* top() { return reinterpret_cast<const uint8_t*>(RAMEND + 1); }
+    static const uint8_t* stackPointer() { return reinterpret_cast<const uint8_t*>(SP); }
+#else
+    static const uint16_t HostRegionSize = 1024;
+
+    static const uint8_t* hostRegion()
+    {
+        static uint8_t region[HostRegionSize];
+        static bool painted = false;
+        if (!painted) {
+            for (uint16_t i = 0; i < HostRegionSize; ++i) {
+                region[i] = StackPaint;
+            }
+            painted = true;
+        }
+        return region;
+    }
+
+    static const uint8_t* bottom() { return hostRegion(); }
+    static const uint8_t* top() { return hostRegion() + HostRegionSize; }
+    static const uint8_t* stackPointer() { return top(); }
+#endif
+
+    uint16_t _free = 0;
+    uint16_t _unused = 0;
+};
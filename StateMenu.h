@@ -0,0 +1,218 @@
+//
+//  StateMenu.h
+//
+//  Menu bytecode interpreter with a compile time state index
+//
+
+#pragma once
+
+#include "m8r.h"
+#include "ButtonDebouncer.h"
+#include "EventListener.h"
+
+//
+// The same opcodes as the m8r Menu (Show, Pause, State, XEQ, Buttons, Goto,
+// End), but the program is a constexpr array in PROGMEM. That lets the
+// compiler work out where every State(n) is: StateMenuIndex<Op, ops> is a
+// PROGMEM table from state number to opcode position, so a Goto or a button
+// target is a single table read instead of a search. The same scan checks
+// at compile time that every target names a state that exists.
+//
+// Buttons() is followed by one bare state number per button, T::NumButtons
+// of them, and takes the button events from ButtonDebouncer. Plain
+// Buttons() goes on EV_BUTTON_DOWN, ignoring repeats. Buttons(RouteRepeat)
+// takes the repeats too, as presses. Buttons(RouteLong) is followed by a
+// second state number per button for a long press: a short press then goes
+// on its release, and either only if the button went down in this state, so
+// the press that got here isn't taken again on its way up. Pause(ms) is
+// timed with the owner's ticks(), in ms, and ends on the first event after
+// it runs out (the idle loop wakes at least every ms).
+// Show() calls the owner's show().
+//
+
+template<typename T>
+struct StateMenuOp
+{
+    typedef void (*XEQFunction)(T*);
+    enum class Type : uint8_t { Show, Pause, State, XEQ, Buttons, Target, Goto, End };
+
+    // Buttons() routing
+    static const uint8_t RouteRepeat = 0x01;
+    static const uint8_t RouteLong = 0x02;
+
+    constexpr StateMenuOp(Type type, uint16_t value) : _type(type), _value(value) { }
+    constexpr StateMenuOp(const char* string) : _type(Type::Show), _string(string) { }
+    constexpr StateMenuOp(XEQFunction function) : _type(Type::XEQ), _function(function) { }
+
+    // A button target, written as a bare state number. Taking an int makes
+    // a literal 0 a target rather than a null pointer.
+    constexpr StateMenuOp(int state) : _type(Type::Target), _value(state) { }
+
+    Type _type;
+    union {
+        uint16_t _value;
+        const char* _string;
+        XEQFunction _function;
+    };
+};
+
+namespace statemenu {
+
+static const uint16_t NotFound = 0xffff;
+
+// C++11 constexpr functions have to be a single return statement, so the
+// scans are recursive. Each reads _value only for opcodes that hold one.
+template<typename Op>
+constexpr uint16_t findState(const Op* ops, uint16_t state, uint16_t i = 0)
+{
+    return (ops[i]._type == Op::Type::End) ? NotFound
+         : (ops[i]._type == Op::Type::State && ops[i]._value == state) ? i
+         : findState(ops, state, i + 1);
+}
+
+template<typename Op>
+constexpr uint16_t stateCount(const Op* ops, uint16_t i = 0, uint16_t count = 0)
+{
+    return (ops[i]._type == Op::Type::End) ? count
+         : stateCount(ops, i + 1, (ops[i]._type == Op::Type::State && ops[i]._value >= count) ? ops[i]._value + 1 : count);
+}
+
+template<typename Op>
+constexpr bool targetsValid(const Op* ops, uint16_t i = 0)
+{
+    return (ops[i]._type == Op::Type::End) ? true
+         : ((ops[i]._type == Op::Type::Goto || ops[i]._type == Op::Type::Target) && findState(ops, ops[i]._value) == NotFound) ? false
+         : targetsValid(ops, i + 1);
+}
+
+template<uint16_t... I> struct Indices { };
+template<uint16_t N, uint16_t... I> struct MakeIndices : MakeIndices<N - 1, N - 1, I...> { };
+template<uint16_t... I> struct MakeIndices<0, I...> { typedef Indices<I...> type; };
+
+template<typename Op, const Op* Ops, typename Sequence> struct StateTable;
+
+template<typename Op, const Op* Ops, uint16_t... States>
+struct StateTable<Op, Ops, Indices<States...>>
+{
+    static const uint16_t Offsets[sizeof...(States)];
+};
+
+template<typename Op, const Op* Ops, uint16_t... States>
+const uint16_t StateTable<Op, Ops, Indices<States...>>::Offsets[sizeof...(States)] PROGMEM = { findState(Ops, States)... };
+
+}
+
+template<typename Op, const Op* Ops>
+struct StateMenuIndex : statemenu::StateTable<Op, Ops, typename statemenu::MakeIndices<statemenu::stateCount(Ops)>::type>
+{
+    static_assert(statemenu::targetsValid(Ops), "Menu Goto or button target names a state that doesn't exist");
+};
+
+template<typename T>
+class StateMenu {
+public:
+    typedef StateMenuOp<T> Op;
+    typedef typename Op::Type Type;
+    typedef typename Op::XEQFunction XEQFunction;
+
+    static const uint8_t RouteRepeat = Op::RouteRepeat;
+    static const uint8_t RouteLong = Op::RouteLong;
+
+    static constexpr Op Show(const char* s) { return Op(s); }
+    static constexpr Op Pause(uint16_t ms) { return Op(Type::Pause, ms); }
+    static constexpr Op State(uint8_t state) { return Op(Type::State, state); }
+    static constexpr Op XEQ(XEQFunction function) { return Op(function); }
+    static constexpr Op Buttons(uint8_t routes = 0) { return Op(Type::Buttons, routes); }
+    static constexpr Op Goto(uint8_t state) { return Op(Type::Goto, state); }
+    static constexpr Op End() { return Op(Type::End, 0); }
+
+    StateMenu(const Op* ops, const uint16_t* stateOffsets, T* owner)
+        : _ops(ops), _stateOffsets(stateOffsets), _owner(owner) { }
+
+    void handleEvent(m8r::EventType type, m8r::EventParam param)
+    {
+        if (opType(_pc) == Type::Buttons) {
+            uint8_t flags = (uint8_t)(uintptr_t) param;
+            uint8_t button = flags & ButtonIndexMask;
+            uint16_t target = buttonTarget(type, flags, opValue(_pc));
+            if (target != statemenu::NotFound && opType(target + button) == Type::Target) {
+                gotoState(opValue(target + button));
+            }
+        }
+        run();
+    }
+
+private:
+    // Where the targets for this event start, if this Buttons() takes it
+    uint16_t buttonTarget(m8r::EventType type, uint8_t flags, uint16_t routes)
+    {
+        uint8_t bit = 1 << (flags & ButtonIndexMask);
+        if (!(routes & Op::RouteLong)) {
+            bool take = type == m8r::EV_BUTTON_DOWN && (!(flags & ButtonRepeat) || (routes & Op::RouteRepeat));
+            return take ? _pc + 1 : statemenu::NotFound;
+        }
+        if (type == m8r::EV_BUTTON_DOWN && !(flags & ButtonRepeat)) {
+            _buttonsDown |= bit;
+        } else if (type == EV_BUTTON_LONG && (_buttonsDown & bit)) {
+            _buttonsDown &= ~bit;
+            return _pc + 1 + T::NumButtons;
+        } else if (type == m8r::EV_BUTTON_UP && (_buttonsDown & bit) && !(flags & ButtonLong)) {
+            _buttonsDown &= ~bit;
+            return _pc + 1;
+        }
+        return statemenu::NotFound;
+    }
+
+    Type opType(uint16_t pc) const { return static_cast<Type>(pgm_read_byte(&_ops[pc]._type)); }
+    uint16_t opValue(uint16_t pc) const { return pgm_read_word(&_ops[pc]._value); }
+
+    void gotoState(uint16_t state)
+    {
+        _pc = pgm_read_word(&_stateOffsets[state]);
+        _pausing = false;
+        _buttonsDown = 0;
+    }
+
+    // Runs until the program stops for a Pause, Buttons or End
+    void run()
+    {
+        while (true) {
+            switch (opType(_pc)) {
+                case Type::Show:
+                    _owner->show(*reinterpret_cast<const m8r::_FlashString*>(pgm_read_ptr(&_ops[_pc]._string)));
+                    break;
+                case Type::Pause:
+                    if (!_pausing) {
+                        _pausing = true;
+                        _pauseStart = _owner->ticks();
+                    }
+                    if (static_cast<uint16_t>(_owner->ticks() - _pauseStart) < opValue(_pc)) {
+                        return;
+                    }
+                    _pausing = false;
+                    break;
+                case Type::XEQ:
+                    reinterpret_cast<XEQFunction>(pgm_read_ptr(&_ops[_pc]._function))(_owner);
+                    break;
+                case Type::Goto:
+                    gotoState(opValue(_pc));
+                    continue;
+                case Type::Buttons:
+                case Type::End:
+                    return;
+                case Type::State:
+                case Type::Target:
+                    break;
+            }
+            ++_pc;
+        }
+    }
+
+    const Op* _ops;
+    const uint16_t* _stateOffsets;
+    T* _owner;
+    uint16_t _pc = 0;
+    uint16_t _pauseStart = 0;
+    bool _pausing = false;
+    uint8_t _buttonsDown = 0;   // Went down in a Buttons(RouteLong)
+};
@@ -0,0 +1,61 @@
+//
+//  SupplyChannels.h
+//
+//  The supply outputs as a compile time list of sensor addresses and shutdown pins
+//
+
+#pragma once
+
+#include <stdint.h>
+
+//
+// Each SupplyChannel binds one output's INA219 address to the pin that
+// shuts it down. SupplyChannels lists them in order, and the order is the
+// supply's index everywhere else: the sensors, the limits and the rest of
+// the per supply state are arrays of Count kept by the owner, so each kind
+// of state is together and a loop over the supplies walks straight through
+// it. Only what has to be a type, the pins, lives here.
+//
+// shutdown() sets every pin from its bit in a mask, bit 0 for the first
+// supply. It's one port write per supply and expands to straight line code,
+// so it's safe from the protection interrupt. sensorAddress() is a chain of
+// compares and is meant for setup.
+//
+
+template<uint8_t Address, typename ShutdownPin>
+struct SupplyChannel {
+    static const uint8_t SensorAddress = Address;
+    typedef ShutdownPin Shutdown;
+};
+
+template<typename... Channels>
+class SupplyChannels;
+
+template<>
+class SupplyChannels<> {
+public:
+    static const uint8_t Count = 0;
+
+    static uint8_t sensorAddress(uint8_t) { return 0; }
+    void shutdown(uint8_t) { }
+};
+
+template<typename First, typename... Rest>
+class SupplyChannels<First, Rest...> : private SupplyChannels<Rest...> {
+    typedef SupplyChannels<Rest...> Next;
+
+public:
+    static const uint8_t Count = 1 + Next::Count;
+    static_assert(Count <= 8, "Supplies are a bit each in a byte");
+
+    static uint8_t sensorAddress(uint8_t supply) { return supply ? Next::sensorAddress(supply - 1) : First::SensorAddress; }
+
+    void shutdown(uint8_t mask)
+    {
+        _shutdown = (mask & 1) != 0;
+        Next::shutdown(mask >> 1);
+    }
+
+private:
+    typename First::Shutdown _shutdown;
+};
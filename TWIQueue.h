@@ -0,0 +1,309 @@
+//
+//  TWIQueue.h
+//
+//  Interrupt driven queue of I2C register transactions
+//
+
+#pragma once
+
+#include <avr/io.h>
+#include <util/atomic.h>
+#include <util/delay.h>
+
+#include "RingBuffer.h"
+
+//
+// A transaction is a 16 bit register write or read, which is all the INA219
+// and most other register based I2C devices need. The owner keeps the
+// transaction object alive until status() leaves Queued. The TWI interrupt
+// walks each transaction through the bus states and starts the next one
+// queued as soon as the previous one finishes, so the main loop never waits
+// on TWINT. handleInterrupt() and tick() return true when a transaction has
+// finished, Done or Error, so the owner can wake whatever is waiting for it
+// instead of polling status().
+//
+// A device that loses track of the bus can hold SDA low, and then nothing
+// more ever finishes. tick() is called from a timer interrupt, and a
+// transaction still current on the TimeoutTicks'th tick after it started is
+// abandoned as an Error. As the ticks aren't in step with the start, that's
+// after between TimeoutTicks - 1 and TimeoutTicks tick periods. The TWI is
+// turned off there and the bus is left for recover(), which the owner calls
+// from the event loop once tick() has said so, as it takes about 100us.
+// Transactions submitted in the meantime wait in the queue. SCL is clocked
+// by hand until SDA is let go, up to a byte and its ACK, then a START and a
+// STOP leave the bus idle for the next transaction. An outage runs from the
+// first timeout to the next transaction that's Done, and the longest is
+// kept, in ticks. A recovery that can't free SDA is counted as stuck, and
+// everything queued fails with it rather than each waiting out its own
+// timeout. The next transaction submitted tries again.
+//
+
+class TWITransaction {
+    friend class TWIQueue;
+
+public:
+    enum class Status : uint8_t { Idle, Queued, Done, Error };
+
+    void setWrite(uint8_t address, uint8_t reg, uint16_t value)
+    {
+        _address = address;
+        _reg = reg;
+        _read = false;
+        _data[0] = value >> 8;
+        _data[1] = value;
+    }
+
+    void setRead(uint8_t address, uint8_t reg)
+    {
+        _address = address;
+        _reg = reg;
+        _read = true;
+    }
+
+    Status status() const { return _status; }
+    bool busy() const { return _status == Status::Queued; }
+    uint16_t value() const { return (static_cast<uint16_t>(_data[0]) << 8) | _data[1]; }
+
+private:
+    uint8_t _address = 0;
+    uint8_t _reg = 0;
+    bool _read = false;
+    uint8_t _data[2];
+    volatile Status _status = Status::Idle;
+};
+
+class TWIQueue {
+public:
+    static const uint8_t QueueSize = 8;
+    static const uint32_t DefaultFrequency = 400000;
+
+    // With 1ms ticks 1-2ms, which is many times the longest transaction
+    static const uint8_t TimeoutTicks = 2;
+
+    // Bus recovery, on PC4 and PC5 of the ATmega328P, at about 100kHz
+    static const uint8_t SDABit = 4;
+    static const uint8_t SCLBit = 5;
+    static const uint8_t RecoveryClocks = 9;
+    static const uint8_t RecoveryHalfBitUs = 5;
+
+    // Bus time for one 16 bit register read: START, address and register,
+    // repeated START, address and two bytes, STOP
+    static constexpr uint16_t readTimeUs(uint32_t frequency = DefaultFrequency)
+    {
+        return 48 * 1000000UL / frequency;
+    }
+
+    void init(uint32_t frequency = DefaultFrequency)
+    {
+        TWSR = 0;
+        TWBR = ((F_CPU / frequency) - 16) / 2;
+        TWCR = _BV(TWEN);
+    }
+
+    // Returns false (and marks the transaction as being in error) if the queue is full.
+    // May be called from the event loop or from other interrupts.
+    bool submit(TWITransaction& transaction)
+    {
+        bool queued = false;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            transaction._status = TWITransaction::Status::Queued;
+            queued = _queue.push(&transaction);
+            if (!queued) {
+                transaction._status = TWITransaction::Status::Error;
+            } else if (!_current && !_recovering) {
+                startNext(0);
+            }
+        }
+        return queued;
+    }
+
+    bool idle() const { return !_current && !_recovering; }
+
+    // Called from a timer interrupt, see above. Returns true if a
+    // transaction timed out, and recover() is wanted.
+    bool tick()
+    {
+        if (_outage && _outageTicks != 0xffff) {
+            ++_outageTicks;
+        }
+        if (!_current || ++_busyTicks < TimeoutTicks) {
+            return false;
+        }
+        if (_timeouts != 0xffff) {
+            ++_timeouts;
+        }
+        if (!_outage) {
+            _outage = true;
+            _outageTicks = 0;
+        }
+        _current->_status = TWITransaction::Status::Error;
+        _current = nullptr;
+        _recovering = true;
+        TWCR = 0;
+        return true;
+    }
+
+    // Called from the event loop after tick() has returned true, see above.
+    // Does nothing if there's no recovery wanted. If the bus is stuck, what's
+    // queued has failed by the time it returns.
+    void recover()
+    {
+        if (!_recovering) {
+            return;
+        }
+        bool freed = clearBus();
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            _recovering = false;
+            if (freed) {
+                startNext(0);
+            } else {
+                if (_stuck != 0xffff) {
+                    ++_stuck;
+                }
+                TWITransaction* next;
+                while (_queue.pop(next)) {
+                    next->_status = TWITransaction::Status::Error;
+                }
+            }
+        }
+    }
+
+    uint16_t timeouts() const
+    {
+        uint16_t timeouts = 0;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            timeouts = _timeouts;
+        }
+        return timeouts;
+    }
+
+    uint16_t stuck() const
+    {
+        uint16_t stuck = 0;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            stuck = _stuck;
+        }
+        return stuck;
+    }
+
+    uint16_t longestOutageTicks() const
+    {
+        uint16_t ticks = 0;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            ticks = _longestOutageTicks;
+        }
+        return ticks;
+    }
+
+    // Called from ISR(TWI_vect). Returns true if the transaction finished.
+    bool handleInterrupt()
+    {
+        TWITransaction* t = _current;
+        switch (TWSR & 0xf8) {
+            case 0x08: // START sent
+                _index = 0;
+                TWDR = t->_address << 1;
+                reply(0);
+                break;
+            case 0x10: // Repeated START sent
+                TWDR = (t->_address << 1) | 1;
+                reply(0);
+                break;
+            case 0x18: // SLA+W sent, ACK received
+                TWDR = t->_reg;
+                reply(0);
+                break;
+            case 0x28: // Data sent, ACK received
+                if (t->_read) {
+                    reply(_BV(TWSTA));
+                } else if (_index < 2) {
+                    TWDR = t->_data[_index++];
+                    reply(0);
+                } else {
+                    finish(TWITransaction::Status::Done);
+                }
+                break;
+            case 0x40: // SLA+R sent, ACK received. ACK the first byte, NACK the second
+                reply(_BV(TWEA));
+                break;
+            case 0x50: // Data received, ACK returned
+                t->_data[_index++] = TWDR;
+                reply(0);
+                break;
+            case 0x58: // Data received, NACK returned
+                t->_data[_index] = TWDR;
+                finish(TWITransaction::Status::Done);
+                break;
+            default: // Address or data NACK, arbitration lost or bus error
+                finish(TWITransaction::Status::Error);
+                break;
+        }
+        return _current != t;
+    }
+
+private:
+    static void reply(uint8_t bits) { TWCR = _BV(TWINT) | _BV(TWEN) | _BV(TWIE) | bits; }
+
+    // Send a START if there is anything queued. 'bits' is TWSTO when a STOP
+    // needs to go out first. The TWI sends it followed by the START.
+    void startNext(uint8_t bits)
+    {
+        TWITransaction* next;
+        if (_queue.pop(next)) {
+            _current = next;
+            _busyTicks = 0;
+            reply(bits | _BV(TWSTA));
+        } else {
+            _current = nullptr;
+            if (bits) {
+                TWCR = _BV(TWINT) | _BV(TWEN) | bits;
+            }
+        }
+    }
+
+    void finish(TWITransaction::Status status)
+    {
+        _current->_status = status;
+        if (_outage && status == TWITransaction::Status::Done) {
+            _outage = false;
+            if (_outageTicks > _longestOutageTicks) {
+                _longestOutageTicks = _outageTicks;
+            }
+        }
+        startNext(_BV(TWSTO));
+    }
+
+    // The pins are open drain by hand: driven low through DDRC with PORTC
+    // low, or let go to the pull-ups. PORTC is put back for the TWI after.
+    // Interrupts only stretch the clock. Returns false if SDA is still held
+    bool clearBus()
+    {
+        uint8_t port = PORTC;
+        PORTC = port & ~(_BV(SDABit) | _BV(SCLBit));
+        for (uint8_t i = 0; i < RecoveryClocks && !(PINC & _BV(SDABit)); ++i) {
+            DDRC |= _BV(SCLBit);
+            _delay_us(RecoveryHalfBitUs);
+            DDRC &= ~_BV(SCLBit);
+            _delay_us(RecoveryHalfBitUs);
+        }
+        bool freed = PINC & _BV(SDABit);
+        DDRC |= _BV(SDABit);
+        _delay_us(RecoveryHalfBitUs);
+        DDRC &= ~_BV(SDABit);
+        _delay_us(RecoveryHalfBitUs);
+        PORTC = port;
+        TWCR = _BV(TWEN);
+        return freed;
+    }
+
+    RingBuffer<TWITransaction*, QueueSize> _queue;
+    TWITransaction* volatile _current = nullptr;
+    uint8_t _index = 0;
+    uint8_t _busyTicks = 0;
+    volatile bool _recovering = false;
+    bool _outage = false;
+    uint16_t _outageTicks = 0;
+    uint16_t _longestOutageTicks = 0;
+    uint16_t _timeouts = 0;
+    uint16_t _stuck = 0;
+};
@@ -0,0 +1,111 @@
+//
+//  TaskScheduler.h
+//
+//  Priority ordered cooperative tasks run from EV_IDLE
+//
+
+#pragma once
+
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+
+//
+// Tasks are listed in a PROGMEM table, highest priority first, each with a
+// function and a deadline. A task runs when it has been made ready, either
+// from the event loop or from an ISR. Each call to runNext() runs one step of
+// the highest priority ready task and returns, so the event loop gets back
+// control between steps. A task that has more to do returns true and stays
+// ready; it runs again when nothing more urgent is ready. Long work should be
+// sliced into steps like that, so no step holds up a task above it for long.
+//
+// The deadline is the time a task may take from becoming ready to finishing
+// its last step. Finishing later counts as a miss. Times are in whatever
+// units the owner's ticks() counts. finishedOnTime() says whether a task has
+// finished within its deadline since it was last asked, e.g. to feed a
+// watchdog only while the task keeps up.
+//
+
+template<typename T, uint8_t NumTasks>
+class TaskScheduler {
+    static_assert(NumTasks <= 8, "Ready tasks are kept in a byte");
+
+public:
+    typedef bool (*TaskFunction)(T*);
+
+    struct Task
+    {
+        TaskFunction _function;
+        uint16_t _deadline;
+    };
+
+    TaskScheduler(const Task* tasks, T* owner) : _tasks(tasks), _owner(owner) { }
+
+    // Safe to call from ISRs
+    void ready(uint8_t task)
+    {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            if (!(_ready & (1 << task))) {
+                _ready |= 1 << task;
+                _readySince[task] = _owner->ticks();
+            }
+        }
+    }
+
+    bool idle() const { return _ready == 0; }
+
+    // Returns false if there was nothing to run
+    bool runNext()
+    {
+        uint8_t ready = _ready;
+        if (!ready) {
+            return false;
+        }
+        uint8_t task = 0;
+        while (!(ready & 1)) {
+            ready >>= 1;
+            ++task;
+        }
+
+        // Clear the ready bit before running, so becoming ready again while
+        // this step runs isn't lost
+        uint16_t since = 0;
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            _ready &= ~(1 << task);
+            since = _readySince[task];
+        }
+
+        TaskFunction function = reinterpret_cast<TaskFunction>(pgm_read_ptr(&_tasks[task]._function));
+        if (function(_owner)) {
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                if (!(_ready & (1 << task))) {
+                    _ready |= 1 << task;
+                    _readySince[task] = since;
+                }
+            }
+        } else if (static_cast<uint16_t>(_owner->ticks() - since) > pgm_read_word(&_tasks[task]._deadline)) {
+            if (_misses[task] != 0xff) {
+                ++_misses[task];
+            }
+        } else {
+            _onTime |= 1 << task;
+        }
+        return true;
+    }
+
+    uint8_t misses(uint8_t task) const { return _misses[task]; }
+
+    bool finishedOnTime(uint8_t task)
+    {
+        bool onTime = _onTime & (1 << task);
+        _onTime &= ~(1 << task);
+        return onTime;
+    }
+
+private:
+    const Task* _tasks;
+    T* _owner;
+    volatile uint8_t _ready = 0;
+    uint16_t _readySince[NumTasks];
+    uint8_t _misses[NumTasks] = { };
+    uint8_t _onTime = 0;
+};
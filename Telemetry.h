@@ -0,0 +1,72 @@
+//
+//  Telemetry.h
+//
+//  Framed binary records on a serial port
+//
+
+#pragma once
+
+#include <util/crc16.h>
+
+//
+// Each record goes out as:
+//
+//  0xa5, type, payload length, sequence, payload..., crc8
+//
+// Multi-byte values are little endian, which is the AVR's own order. The
+// CRC (CRC-8/CCITT, polynomial 0x07) covers everything after the sync byte.
+// The sequence number increments on every record that is actually sent, so
+// the host can tell a gap when the port had no room. begin() checks there is
+// room for the whole record up front; if not the record is dropped and
+// counted rather than stalling the caller. Nothing is formatted, values are
+// copied out as they are held.
+//
+
+template<typename Port>
+class Telemetry {
+public:
+    static const uint8_t Sync = 0xa5;
+    static const uint8_t Overhead = 5;
+
+    Telemetry(Port& port) : _port(port) { }
+
+    // Returns false if the record was dropped, in which case put8/put16/end
+    // must not be called
+    bool begin(uint8_t type, uint8_t length)
+    {
+        if (_port.room() < length + Overhead) {
+            if (_dropped != 0xffff) {
+                ++_dropped;
+            }
+            return false;
+        }
+        _crc = 0;
+        _port.tryWrite(Sync);
+        put8(type);
+        put8(length);
+        put8(_sequence++);
+        return true;
+    }
+
+    void put8(uint8_t b)
+    {
+        _crc = _crc8_ccitt_update(_crc, b);
+        _port.tryWrite(b);
+    }
+
+    void put16(uint16_t v)
+    {
+        put8(v);
+        put8(v >> 8);
+    }
+
+    void end() { _port.tryWrite(_crc); }
+
+    uint16_t dropped() const { return _dropped; }
+
+private:
+    Port& _port;
+    uint8_t _sequence = 0;
+    uint8_t _crc = 0;
+    uint16_t _dropped = 0;
+};
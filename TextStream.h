@@ -0,0 +1,99 @@
+//
+//  TextStream.h
+//
+//  Text and number formatting on top of any device with write(char)
+//
+
+#pragma once
+
+#include "m8r.h"
+
+// Print value, which has 'places' implied decimal places, with 'decimals'
+// digits after the point, right aligned in at least 'width' characters.
+// Extra places are rounded off. Digits are extracted most significant first
+// by subtracting powers of 10, so there is no division and no buffer. The
+// value is 32 bit so that unsigned 16 bit values past 32767 print as they
+// are, but its magnitude has to stay below 65536.
+struct Decimal
+{
+    Decimal(int32_t value, uint8_t places, uint8_t decimals, uint8_t width = 0)
+        : _value(value), _places(places), _decimals(decimals), _width(width) { }
+    int32_t _value;
+    uint8_t _places;
+    uint8_t _decimals;
+    uint8_t _width;
+};
+
+const uint16_t PowersOf10[] PROGMEM = { 1, 10, 100, 1000, 10000 };
+
+template<typename Device>
+class TextStream : public Device {
+public:
+    TextStream& operator<<(char c) { Device::write(c); return *this; }
+    TextStream& operator<<(const char* s)
+    {
+        while (*s) {
+            Device::write(*s++);
+        }
+        return *this;
+    }
+    TextStream& operator<<(const m8r::_FlashString* s)
+    {
+        const char* p = reinterpret_cast<const char*>(s);
+        char c;
+        while ((c = pgm_read_byte(p++))) {
+            Device::write(c);
+        }
+        return *this;
+    }
+    TextStream& operator<<(const m8r::_FlashString& s) { return *this << &s; }
+    TextStream& operator<<(uint16_t value) { writeDecimal(value, false, 0, 0, 0); return *this; }
+    TextStream& operator<<(int16_t value) { return *this << Decimal(value, 0, 0); }
+    TextStream& operator<<(const Decimal& d)
+    {
+        bool negative = d._value < 0;
+        writeDecimal(static_cast<uint16_t>(negative ? -d._value : d._value), negative, d._places, d._decimals, d._width);
+        return *this;
+    }
+
+private:
+    static uint16_t powerOf10(uint8_t n) { return pgm_read_word(&PowersOf10[n]); }
+
+    // Values must stay below 65536 after rounding.
+    void writeDecimal(uint16_t value, bool negative, uint8_t places, uint8_t decimals, uint8_t width)
+    {
+        // Digit positions are powers of 10. Print from the highest non-zero
+        // one (but at least the units) down to the last one kept.
+        uint8_t last = 0;
+        if (places > decimals) {
+            last = places - decimals;
+            value += powerOf10(last) / 2;
+        }
+        uint8_t first = places;
+        while (first < 4 && value >= powerOf10(first + 1)) {
+            ++first;
+        }
+
+        uint8_t length = first - last + 1 + negative + ((decimals && places) ? 1 : 0);
+        while (length < width) {
+            Device::write(' ');
+            ++length;
+        }
+        if (negative) {
+            Device::write('-');
+        }
+
+        for (uint8_t i = first + 1; i-- > last; ) {
+            if (i == places - 1) {
+                Device::write('.');
+            }
+            uint16_t power = powerOf10(i);
+            char digit = '0';
+            while (value >= power) {
+                value -= power;
+                ++digit;
+            }
+            Device::write(digit);
+        }
+    }
+};
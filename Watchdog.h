@@ -0,0 +1,47 @@
+//
+//  Watchdog.h
+//
+//  Reset cause, and the hardware watchdog as the way out of a fatal error
+//
+
+#pragma once
+
+#include <avr/io.h>
+#include <avr/wdt.h>
+
+//
+// After a watchdog reset the watchdog is still on, at its shortest timeout,
+// so it has to be turned off before the constructors run or it would reset
+// the chip again 16ms later. An .init3 hook does that, after the C runtime
+// has set up r1 and the stack but before it clears the static data, and
+// keeps MCUSR in .noinit so the app can tell why it was reset.
+//
+// arm() starts it counting down to a reset, from the timeout given, and
+// feed() starts the count again. Stop feeding it and the chip resets.
+//
+// Host builds have no init sections. The simulation's watchdog counts a
+// timeout rather than resetting, and causedReset() never sees one.
+//
+
+#ifdef __AVR__
+static uint8_t g_resetFlags __attribute__((section(".noinit")));
+
+__attribute__((naked, used, section(".init3"))) static void saveResetFlags()
+{
+    g_resetFlags = MCUSR;
+    MCUSR = 0;
+    wdt_disable();
+}
+#else
+static uint8_t g_resetFlags = 0;
+#endif
+
+class Watchdog {
+public:
+    // MCUSR at reset
+    static uint8_t resetFlags() { return g_resetFlags; }
+    static bool causedReset() { return g_resetFlags & _BV(WDRF); }
+
+    static void arm(uint8_t timeout) { wdt_enable(timeout); }
+    static void feed() { wdt_reset(); }
+};
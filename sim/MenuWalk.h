@@ -0,0 +1,71 @@
+//
+//  MenuWalk.h
+//
+//  Button presses that take the menu through every state
+//
+
+#pragma once
+
+#include <stdint.h>
+
+//
+// Starts and ends on the normal display. Both lines go once round all their
+// modes, then the current limit screens are walked twice: supply A is
+// adjusted coarse and fine and rejected, supply B is adjusted back to where
+// it was and accepted, which also saves the settings. Each step is a button
+// index, how long to let the app run afterwards and what the LCD line should
+// then start with (nullptr for no check).
+//
+
+struct MenuStep
+{
+    uint8_t _button;
+    uint16_t _settleMs;
+    uint8_t _line;
+    const char* _expect;
+};
+
+#define MENU_STEP(button, settleMs, line, expect) { button, settleMs, line, expect }
+
+const MenuStep MenuWalk[] = {
+    MENU_STEP(0, 200, 0, "B:"),             // Line 0 modes
+    MENU_STEP(0, 200, 0, "A:"),
+    MENU_STEP(0, 200, 0, "a:"),
+    MENU_STEP(0, 200, 0, "c:"),
+    MENU_STEP(0, 200, 0, "Trip A:"),
+    MENU_STEP(0, 200, 0, "Late"),
+    MENU_STEP(0, 200, 0, "555"),            // Current bars, A at 250mA of 1000mA
+    MENU_STEP(0, 200, 0, "5"),
+    MENU_STEP(0, 200, 0, "A:"),
+    MENU_STEP(1, 200, 1, "A:"),             // Line 1 modes
+    MENU_STEP(1, 200, 1, "a:"),
+    MENU_STEP(1, 200, 1, "c:"),
+    MENU_STEP(1, 200, 1, "Trip A:"),
+    MENU_STEP(1, 200, 1, "Late"),
+    MENU_STEP(1, 200, 1, "555"),
+    MENU_STEP(1, 200, 1, "5"),
+    MENU_STEP(1, 200, 1, "A:"),
+    MENU_STEP(1, 200, 1, "B:"),
+    MENU_STEP(2, 200, 1, ">A:1000ma"),      // Cur limit, supply A
+    MENU_STEP(0, 200, 1, ">B:1000ma"),
+    MENU_STEP(0, 200, 1, ">A:1000ma"),
+    MENU_STEP(1, 200, 1, " A:1000ma<10ma"), // Coarse adjust, stops at the top
+    MENU_STEP(0, 200, 1, " A:1000ma<"),
+    MENU_STEP(1, 200, 1, " A:990ma<"),
+    MENU_STEP(2, 200, 1, " A:990ma<1ma"),   // Fine adjust
+    MENU_STEP(1, 200, 1, " A:989ma<"),
+    MENU_STEP(0, 200, 1, " A:990ma<"),
+    MENU_STEP(1, 200, 1, " A:989ma<"),
+    MENU_STEP(2, 200, 0, "Save? (UP=YES)"),
+    MENU_STEP(1, 200, 0, "A:"),             // Reject
+    MENU_STEP(2, 200, 1, ">A:1000ma"),      // Cur limit, supply B
+    MENU_STEP(0, 200, 1, ">B:1000ma"),
+    MENU_STEP(1, 200, 1, " B:1000ma<"),
+    MENU_STEP(1, 200, 1, " B:990ma<"),
+    MENU_STEP(0, 200, 1, " B:1000ma<"),
+    MENU_STEP(2, 200, 1, " B:1000ma<1ma"),
+    MENU_STEP(2, 200, 0, "Save? (UP=YES)"),
+    MENU_STEP(0, 2500, 0, "A:"),            // Accept, shows "Cur Limit Set" for 2s
+};
+
+const uint8_t MenuWalkSteps = sizeof(MenuWalk) / sizeof(MenuWalk[0]);
@@ -0,0 +1,1134 @@
+//
+//  bench.cpp
+//
+//  Host benchmarks and trip latency checks for the app
+//
+
+//
+// AVRPowerSupply.cpp is included as it is, against the simulated machine,
+// so this is the whole app including g_app. After boot, the hot paths are
+// timed on the host clock, one call at a time with fresh work for each:
+// updateADC, updateCurrentSensor, updateDisplay in each line mode and every
+// button press of a full menu walk. The display is checked to hold off
+// redrawing a dithering reading and to redraw only the end of a current bar
+// as it moves. Then each trace given on the command
+// line is played into the supply sensors and analog inputs. The trip latency
+// is measured in simulated time, from the supply's current going over its
+// limit to its shutdown pin going high, and checked against
+// FastTripLatencyBudgetUs. Traces can also check that hiccup mode brings
+// a supply back. Then AVCC moves, an analog input is calibrated and its
+// filter changed from the menu, remote commands are sent in on the serial
+// port, the sensors hang the bus, and last an error is reported, a warning
+// and then a fatal one.
+//
+// Host times only compare builds on the same machine. The exit status is 1
+// if a trace trips when it shouldn't, doesn't trip when it should, trips
+// late, or the menu walk doesn't show what it should.
+//
+
+#include "../AVRPowerSupply.cpp"
+
+#include "Machine.h"
+#include "MenuWalk.h"
+#include "Trace.h"
+
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+namespace {
+
+const uint16_t DefaultIterations = 2000;
+
+// Until the menu walk, both supplies are at the default (largest) limit,
+// which is past the end of the shunt range, so they trip at full scale
+const uint16_t DefaultLimitMa = CurrentLimitMaxMa;
+const double TripMilliAmps = (DefaultLimitMa * ShuntCountsPerMa < ShuntFullScale)
+    ? DefaultLimitMa : static_cast<double>(ShuntFullScale - 1) / ShuntCountsPerMa;
+
+const char* const LineModeNames[] = { "PS1VA", "PS2VA", "PS12A", "V1V2", "V3V4", "Trip", "Late", "BarA", "BarB" };
+const uint8_t NumLineModes = sizeof(LineModeNames) / sizeof(LineModeNames[0]);
+
+const sim::Inputs BootInputs = { { 250, 100 }, { 5000, 3300 }, { 1000, 2000, 3000, 4000 } };
+
+typedef std::chrono::steady_clock Clock;
+
+class HostTiming {
+public:
+    HostTiming(const char* name) : _name(name) { }
+
+    void start() { _start = Clock::now(); }
+    void stop() { add(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - _start).count()); }
+
+    void add(double ns)
+    {
+        ns = (ns > s_overheadNs) ? ns - s_overheadNs : 0;
+        _min = (_count == 0 || ns < _min) ? ns : _min;
+        _max = (ns > _max) ? ns : _max;
+        _total += ns;
+        ++_count;
+    }
+
+    double mean() const { return _count ? _total / _count : 0; }
+    double max() const { return _max; }
+
+    void print() const
+    {
+        printf("bench %-24s n=%-6u mean %8.0fns  min %8.0fns  max %8.0fns\n", _name, _count, mean(), _min, _max);
+    }
+
+    // Lowest cost of a start()/stop() pair, taken off every sample
+    static void calibrate()
+    {
+        HostTiming t("");
+        for (uint16_t i = 0; i < 10000; ++i) {
+            t.start();
+            t.stop();
+        }
+        s_overheadNs = t._min;
+    }
+
+private:
+    const char* _name;
+    Clock::time_point _start;
+    double _min = 0;
+    double _max = 0;
+    double _total = 0;
+    unsigned _count = 0;
+
+    static double s_overheadNs;
+};
+
+double HostTiming::s_overheadNs = 0;
+
+std::vector<std::string> g_failures;
+
+void failure(const char* format, const char* detail)
+{
+    char message[128];
+    snprintf(message, sizeof(message), format, detail);
+    g_failures.push_back(message);
+}
+
+// Straight to the app, as the tick's debouncer would hand it a press and release
+void pressButton(uint8_t button)
+{
+    g_app.handleEvent(EV_BUTTON_DOWN, reinterpret_cast<EventParam>(static_cast<uintptr_t>(button)));
+    g_app.handleEvent(EV_BUTTON_UP, reinterpret_cast<EventParam>(static_cast<uintptr_t>(button)));
+}
+
+// On the switch, through the debouncer
+void holdButton(uint8_t button, uint32_t ms)
+{
+    sim::setButton(button, true);
+    sim::runMs(ms);
+    sim::setButton(button, false);
+    sim::runMs(50);
+}
+
+bool lineStartsWith(uint8_t line, const char* text) { return !strncmp(sim::lcdLine(line), text, strlen(text)); }
+
+// The watchdog should only go after a fatal error. Stats are reset along the
+// way, so this is checked before each reset.
+void checkWatchdog(const char* where)
+{
+    if (sim::stats().watchdogTimeouts) {
+        failure("watchdog reset the app in %s", where);
+    }
+}
+
+struct Record
+{
+    uint8_t type;
+    std::vector<uint8_t> payload;
+
+    int16_t get16(size_t offset) const { return payload[offset] | (payload[offset + 1] << 8); }
+};
+
+// Length of the record with a good CRC at i in the serial output, or 0
+size_t recordLength(const std::vector<uint8_t>& out, size_t i)
+{
+    if (i + 4 >= out.size() || out[i] != Telemetry<MySerial>::Sync || i + 5 + out[i + 2] > out.size()) {
+        return 0;
+    }
+    uint8_t length = out[i + 2];
+    uint8_t crc = 0;
+    for (size_t j = i + 1; j < i + 4 + length; ++j) {
+        crc = _crc8_ccitt_update(crc, out[j]);
+    }
+    return (crc == out[i + 4 + length]) ? 5 + length : 0;
+}
+
+// The telemetry records with a good CRC in what's gone out on the serial port
+std::vector<Record> telemetryRecords()
+{
+    const std::vector<uint8_t>& out = sim::serialOutput();
+    std::vector<Record> records;
+    for (size_t i = 0; i < out.size(); ) {
+        size_t length = recordLength(out, i);
+        if (!length) {
+            ++i;
+            continue;
+        }
+        records.push_back({ out[i + 1], std::vector<uint8_t>(out.begin() + i + 4, out.begin() + i + length - 1) });
+        i += length;
+    }
+    return records;
+}
+
+// The lines of text between the records that start from offset from in the
+// serial output, as a host would sort them out. The records are found from
+// the start, as from can be part way through one.
+std::vector<std::string> remoteReplies(size_t from)
+{
+    const std::vector<uint8_t>& out = sim::serialOutput();
+    std::vector<std::string> replies;
+    std::string line;
+    for (size_t i = 0; i < out.size(); ) {
+        size_t length = recordLength(out, i);
+        if (length) {
+            i += length;
+            continue;
+        }
+        if (i >= from && out[i] == '\n') {
+            replies.push_back(line);
+            line.clear();
+        } else if (i >= from) {
+            line += static_cast<char>(out[i]);
+        }
+        ++i;
+    }
+    return replies;
+}
+
+// Sends the lines and waits for them all to be answered
+std::vector<std::string> remote(const char* lines, uint32_t ms = 100)
+{
+    size_t from = sim::serialOutput().size();
+    sim::serialInput(lines);
+    sim::runMs(ms);
+    return remoteReplies(from);
+}
+
+// The currents on the display and the power in the measurement records come
+// from the INA219s' own current and power registers
+void boot()
+{
+    sim::setInputs(BootInputs);
+    sim::runMs(2500);
+    printf("boot  |%s|\n      |%s|\n", sim::lcdLine(0), sim::lcdLine(1));
+    if (!lineStartsWith(0, "A:") || !lineStartsWith(1, "B:")) {
+        failure("%s", "boot didn't reach the normal display");
+    }
+    // Fresh settings, so both limits are the default, past the end of the
+    // shunt range, and the trip threshold has to saturate rather than wrap
+    for (uint8_t i = 0; i < 2; ++i) {
+        if (sim::stats().shutdowns[i] || sim::shutdown(i)) {
+            char supply[2] = { static_cast<char>('A' + i), '\0' };
+            failure("boot with the default limit tripped %s", supply);
+        }
+    }
+    for (uint8_t i = 0; i < 2; ++i) {
+        float milliAmps = 0;
+        if (sscanf(sim::lcdLine(i) + 2, "%*fv %fma", &milliAmps) != 1 || fabs(milliAmps - BootInputs.supplyMilliAmps[i]) > 0.25) {
+            failure("boot current reads \"%s\"", sim::lcdLine(i));
+        }
+    }
+
+    std::vector<Record> records = telemetryRecords();
+    const Record* measurements = nullptr;
+    for (const Record& record : records) {
+        if (record.type == TelemetryRecordMeasurements) {
+            measurements = &record;
+        }
+    }
+    if (!measurements) {
+        failure("%s", "no measurement records");
+        return;
+    }
+    int16_t milliWatts[2] = { measurements->get16(6), measurements->get16(12) };
+    printf("boot  power A %dmW B %dmW\n", milliWatts[0], milliWatts[1]);
+    for (uint8_t i = 0; i < 2; ++i) {
+        double expected = static_cast<double>(BootInputs.supplyMilliAmps[i]) * BootInputs.supplyMilliVolts[i] / 1000;
+        if (fabs(milliWatts[i] - expected) > 2 * SensorPowerLsbMilliWatts) {
+            failure("%s", "measured power doesn't match the inputs");
+        }
+    }
+}
+
+// Four new samples per pass, one per channel, as the ADC interrupt leaves them
+void benchUpdateADC(uint16_t iterations)
+{
+    HostTiming timing("updateADC");
+    for (uint16_t i = 0; i < iterations; ++i) {
+        for (uint8_t channel = 0; channel < ADCNumChannels; ++channel) {
+            ADCW = 200 * (channel + 1) + (i & 7);
+            g_app.handleADCInterrupt();
+        }
+        timing.start();
+        g_app.updateADC();
+        timing.stop();
+    }
+    timing.print();
+}
+
+// Each round changes both currents by more than the deadband, so both
+// supplies are read at the full rate. The reads start from the sensor
+// timer's event, then the TWI runs between the calls until they're in.
+void benchUpdateCurrentSensor(uint16_t iterations)
+{
+    TimerEvent* sensorTimer = nullptr;
+    for (uint8_t i = 0; System::timer(i); ++i) {
+        if (System::timer(i)->intervalMs() == SensorPollMs) {
+            sensorTimer = System::timer(i);
+        }
+    }
+    if (!sensorTimer) {
+        failure("%s", "no sensor timer");
+        return;
+    }
+
+    HostTiming call("updateCurrentSensor");
+    HostTiming reading("updateCurrentSensor/read");
+    sim::Inputs inputs = BootInputs;
+    for (uint16_t i = 0; i < iterations; ++i) {
+        inputs.supplyMilliAmps[0] = BootInputs.supplyMilliAmps[0] + ((i & 1) ? 20 : 0);
+        inputs.supplyMilliAmps[1] = BootInputs.supplyMilliAmps[1] + ((i & 1) ? 20 : 0);
+        sim::setInputs(inputs);
+        sim::runHardware(FastTripConversionUs * sim::CyclesPerUs);
+        g_app.handleEvent(EV_EVENT_TIMER, sensorTimer);
+        double total = 0;
+        bool more = true;
+        while (more) {
+            sim::runHardware(50 * sim::CyclesPerUs);
+            Clock::time_point start = Clock::now();
+            more = g_app.updateCurrentSensor();
+            double ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+            call.add(ns);
+            total += ns;
+        }
+        reading.add(total);
+    }
+    sim::setInputs(BootInputs);
+    call.print();
+    reading.print();
+}
+
+// Every line 0 mode in turn, ending back where it started
+void benchUpdateDisplay(uint16_t iterations)
+{
+    char name[32];
+    for (uint8_t mode = 0; mode < sizeof(LineModeNames) / sizeof(LineModeNames[0]); ++mode) {
+        snprintf(name, sizeof(name), "updateDisplay/%s", LineModeNames[mode]);
+        HostTiming timing(name);
+        for (uint16_t i = 0; i < iterations; ++i) {
+            timing.start();
+            g_app.updateDisplay();
+            timing.stop();
+        }
+        timing.print();
+        pressButton(0);
+        sim::runMs(100);
+    }
+}
+
+// Supply A from BootInputs, stepping up by the given amounts for every
+// other 7ms, which doesn't beat with the display's frames
+class Dither : public sim::InputSource {
+public:
+    Dither(double milliAmps, double milliVolts) : _milliAmps(milliAmps), _milliVolts(milliVolts) { }
+
+    sim::Inputs at(double ms) const override
+    {
+        sim::Inputs inputs = BootInputs;
+        if (static_cast<long>(ms / 7) & 1) {
+            inputs.supplyMilliAmps[0] += _milliAmps;
+            inputs.supplyMilliVolts[0] += _milliVolts;
+        }
+        return inputs;
+    }
+
+private:
+    double _milliAmps;
+    double _milliVolts;
+};
+
+// Times line 0 changes in 2s of the dither, looked at every ms
+unsigned lineChanges(const Dither& dither)
+{
+    sim::setInputSource(&dither);
+    std::string line = sim::lcdLine(0);
+    unsigned changes = 0;
+    for (int i = 0; i < 2000; ++i) {
+        sim::runMs(1);
+        if (line != sim::lcdLine(0)) {
+            line = sim::lcdLine(0);
+            ++changes;
+        }
+    }
+    sim::setInputs(BootInputs);
+    return changes;
+}
+
+// Supply A dithering inside the display's deadbands, which shouldn't show,
+// then well outside them, which should show no more than DisplayRefreshHz
+// times a second. Then a step has to show within a frame.
+void benchDisplayPacing()
+{
+    sim::runMs(500);
+    if (!lineStartsWith(0, "A:")) {
+        failure("display pacing starts on \"%s\"", sim::lcdLine(0));
+        return;
+    }
+    unsigned quiet = lineChanges(Dither(0.1, 4));
+    unsigned busy = lineChanges(Dither(20, 100));
+    printf("display 2s of dither by 0.1mA %u frames, by 20mA %u frames, at most %u\n", quiet, busy, 2 * DisplayRefreshHz);
+    if (quiet) {
+        failure("%s", "display follows a dither inside its deadbands");
+    }
+    if (!busy || busy > 2 * DisplayRefreshHz + 1) {
+        failure("%s", "display isn't paced to DisplayRefreshHz");
+    }
+
+    sim::Inputs inputs = BootInputs;
+    inputs.supplyMilliAmps[0] = 300;
+    sim::setInputs(inputs);
+    sim::runMs(DisplayFrameMs + 2 * SensorPollMs);
+    float volts = 0, milliAmps = 0;
+    if (sscanf(sim::lcdLine(0), "A:%fv %fma", &volts, &milliAmps) != 2 || fabs(milliAmps - 300) > 0.5) {
+        failure("display step shows \"%s\"", sim::lcdLine(0));
+    }
+    sim::setInputs(BootInputs);
+    sim::runMs(500);
+}
+
+// Line 0 on supply A's bar, with A at a quarter of its limit, then A up by a
+// column and by a cell. Each step should only send the cells at the end of
+// the bar, a cursor move and a character or two.
+void benchCurrentBar()
+{
+    const uint8_t BarA = NumLineModes - NumSupplies;
+    for (uint8_t i = 0; i < BarA; ++i) {
+        pressButton(0);
+    }
+    sim::Inputs inputs = BootInputs;
+    const double columnMa = static_cast<double>(DefaultLimitMa) / (BarCells * BarCellColumns);
+    inputs.supplyMilliAmps[0] = DefaultLimitMa / 4 + columnMa / 2;
+    sim::setInputs(inputs);
+    sim::runMs(500);
+    const char* full = "5555            ";
+    if (strcmp(sim::lcdLine(0), full)) {
+        failure("bar at a quarter shows \"%s\"", sim::lcdLine(0));
+    }
+    const char* const steps[] = { "55551           ", "555551          " };
+    const double stepMa[] = { columnMa, BarCellColumns * columnMa };
+    for (uint8_t i = 0; i < 2; ++i) {
+        uint32_t writes = sim::stats().lcdWrites;
+        inputs.supplyMilliAmps[0] += stepMa[i];
+        sim::setInputs(inputs);
+        sim::runMs(500);
+        writes = sim::stats().lcdWrites - writes;
+        printf("bar |%s| %u LCD writes\n", sim::lcdLine(0), static_cast<unsigned>(writes));
+        if (strcmp(sim::lcdLine(0), steps[i]) || writes > 3) {
+            failure("bar step shows \"%s\"", sim::lcdLine(0));
+        }
+    }
+    sim::setInputs(BootInputs);
+    for (uint8_t i = BarA; i < NumLineModes; ++i) {
+        pressButton(0);
+    }
+    sim::runMs(500);
+}
+
+void benchMenuWalk()
+{
+    HostTiming timing("menu/press");
+    for (uint8_t i = 0; i < MenuWalkSteps; ++i) {
+        const MenuStep& step = MenuWalk[i];
+        timing.start();
+        pressButton(step._button);
+        timing.stop();
+        sim::runMs(step._settleMs);
+        if (step._expect && !lineStartsWith(step._line, step._expect)) {
+            char detail[80];
+            snprintf(detail, sizeof(detail), "step %u: line %u is \"%s\", expected \"%s\"", i, step._line, sim::lcdLine(step._line), step._expect);
+            failure("menu walk %s", detail);
+        }
+    }
+    timing.print();
+}
+
+// Arms a capture from the capture page, steps supply A from 50mA to 400mA,
+// checks the frozen result on the LCD, then has it dumped and reads the
+// capture records back off the serial port
+void benchCapture()
+{
+    sim::Inputs inputs = BootInputs;
+    inputs.supplyMilliAmps[0] = 50;
+    inputs.supplyMilliAmps[1] = 20;
+    sim::setInputs(inputs);
+
+    const uint8_t toCapture[] = {
+        2, 1, 2, 2, 2,      // Cur limit, coarse, fine, "Save?", next page
+#ifndef NDEBUG
+        2,                  // Past the profile page
+#endif
+    };
+    for (uint8_t button : toCapture) {
+        pressButton(button);
+        sim::runMs(100);
+    }
+    if (!lineStartsWith(0, "Capture off")) {
+        failure("capture page shows \"%s\"", sim::lcdLine(0));
+        return;
+    }
+
+    pressButton(0);
+    sim::runMs(100);
+    inputs.supplyMilliAmps[0] = 400;
+    sim::setInputs(inputs);
+    sim::runMs(300);
+    printf("capture |%s|\n        |%s|\n", sim::lcdLine(0), sim::lcdLine(1));
+    int peak = 0;
+    int over = 0;
+    char source = 0;
+    if (sscanf(sim::lcdLine(0), "A:%dma %dms %c", &peak, &over, &source) != 3 || peak < 390 || peak > 410
+            || over != CaptureSamples - CapturePreTrigger || source != 'L') {
+        failure("capture result \"%s\"", sim::lcdLine(0));
+    }
+
+    sim::serialOutput().clear();
+    pressButton(1);
+    sim::runMs(500);
+    unsigned records = 0;
+    unsigned samplesOver = 0;
+    int firstOver = -1;
+    int triggerIndex = -1;
+    for (const Record& record : telemetryRecords()) {
+        if (record.type == TelemetryRecordCapture) {
+            ++records;
+            triggerIndex = record.payload[2];
+            for (uint8_t j = 0; j < CaptureRecordSamples; ++j) {
+                if (record.payload[0] == 0 && record.get16(4 + j * 2) > CaptureThresholdMa * 10) {
+                    firstOver = (firstOver < 0) ? record.payload[1] + j : firstOver;
+                    ++samplesOver;
+                }
+            }
+        }
+    }
+    printf("capture dump %u records, A over %u samples from %d, trigger at %d\n", records, samplesOver, firstOver, triggerIndex);
+    if (records != 2 * CaptureSamples / CaptureRecordSamples || samplesOver != static_cast<unsigned>(over)) {
+        failure("%s", "capture dump doesn't match the capture");
+    }
+    if (firstOver != triggerIndex || triggerIndex != CapturePreTrigger) {
+        failure("%s", "capture trigger isn't at its index in the dump");
+    }
+
+    pressButton(2);
+    sim::runMs(100);
+    sim::setInputs(BootInputs);
+}
+
+// Input a in the latest measurement record, in mV
+int analogA()
+{
+    std::vector<Record> records = telemetryRecords();
+    for (size_t i = records.size(); i-- > 0; ) {
+        if (records[i].type == TelemetryRecordMeasurements) {
+            return records[i].get16(2 + NumSupplies * 6);
+        }
+    }
+    return -1;
+}
+
+// From the normal display: a long press, then input a's reference stepped
+// from its reading, or to target mV if it's given, set and the calibration
+// accepted or not. Returns the reference, or -1 if the menu didn't show what
+// it should.
+int calibrateInputA(int steps, bool accept, int target = 0)
+{
+    sim::setButton(0, true);
+    sim::runMs(ButtonLongPressMs + 200);
+    sim::setButton(0, false);
+    sim::runMs(100);
+    if (!lineStartsWith(0, "Cal a ")) {
+        failure("calibration shows \"%s\"", sim::lcdLine(0));
+        return -1;
+    }
+    holdButton(1, 50);
+    float volts = 0;
+    if (target && sscanf(sim::lcdLine(1), "Ref %fv", &volts) == 1) {
+        steps = target - lround(volts * 1000);
+    }
+    for (int i = 0; i < abs(steps); ++i) {
+        holdButton((steps > 0) ? 0 : 1, 20);
+    }
+    if (sscanf(sim::lcdLine(1), "Ref %fv", &volts) != 1) {
+        failure("calibration reference shows \"%s\"", sim::lcdLine(1));
+        return -1;
+    }
+    holdButton(2, 50);
+    printf("calibrate |%s|\n          |%s|\n", sim::lcdLine(0), sim::lcdLine(1));
+    holdButton(2, 50);
+    if (!lineStartsWith(0, "Save? (UP=YES)")) {
+        failure("calibration save shows \"%s\"", sim::lcdLine(0));
+        return -1;
+    }
+    holdButton(accept ? 0 : 1, 50);
+    sim::runMs(accept ? 2500 : 500);
+    return lround(volts * 1000);
+}
+
+// AVCC drops to 4.8V, which the bandgap measurement makes up for. Then input
+// a is calibrated 2% high from the menu and rejected, then again and
+// accepted, which saves it with the settings, and last it's put back.
+void benchCalibration()
+{
+    sim::runMs(1000);
+    int nominal = analogA();
+    sim::setAVCC(4800);
+    sim::runMs(1500);
+    int low = analogA();
+    sim::setAVCC(5000);
+    sim::runMs(1500);
+    printf("calibrate AVCC 5000mV a %dmV, 4800mV a %dmV\n", nominal, low);
+    if (abs(nominal - 1000) > 5 || abs(low - 1000) > 5) {
+        failure("%s", "input a doesn't follow AVCC");
+    }
+
+    int reference = calibrateInputA(20, false);
+    if (reference >= 0 && abs(analogA() - 1000) > 5) {
+        failure("%s", "rejected calibration still applied");
+    }
+    uint32_t writes = sim::stats().eepromWrites;
+    reference = calibrateInputA(20, true);
+    int reading = analogA();
+    printf("calibrate a to %dmV, reads %dmV\n", reference, reading);
+    if (reference >= 0 && abs(reading - reference) > 3) {
+        failure("%s", "calibrated input a doesn't read the reference");
+    }
+    MySettingsStore store;
+    Settings settings;
+    if (sim::stats().eepromWrites == writes || !store.load(settings)
+            || settings._calibration[CalibrationAnalog]._gain == Calibration::UnityGain) {
+        failure("%s", "calibration wasn't saved");
+    }
+    calibrateInputA(0, true, 1000);
+    if (abs(analogA() - 1000) > 3) {
+        failure("%s", "input a calibration didn't go back");
+    }
+}
+
+// From the normal display: a long press of the second button, then input
+// a's filter stepped on and accepted or not. The filter has to show as named
+// and the reading has to stay put.
+bool filterInputA(uint8_t steps, bool accept, const char* name)
+{
+    holdButton(1, ButtonLongPressMs + 200);
+    if (!lineStartsWith(0, "Filter a: ")) {
+        failure("filters show \"%s\"", sim::lcdLine(0));
+        return false;
+    }
+    for (uint8_t i = 0; i < steps; ++i) {
+        holdButton(1, 50);
+    }
+    sim::runMs(100);
+    printf("filter |%s|\n       |%s|\n", sim::lcdLine(0), sim::lcdLine(1));
+    if (strncmp(sim::lcdLine(0) + 10, name, strlen(name))) {
+        failure("filter shows \"%s\"", sim::lcdLine(0));
+    }
+    float volts = 0;
+    if (sscanf(sim::lcdLine(1), "Reads %fv", &volts) != 1 || fabs(volts - 1.0) > 0.005) {
+        failure("filter reading shows \"%s\"", sim::lcdLine(1));
+    }
+    holdButton(2, 50);
+    if (!lineStartsWith(0, "Save? (UP=YES)")) {
+        failure("filter save shows \"%s\"", sim::lcdLine(0));
+        return false;
+    }
+    holdButton(accept ? 0 : 1, 50);
+    sim::runMs(accept ? 2500 : 500);
+    return true;
+}
+
+// Each exponential filter, started from either end of the range, has to
+// read back a steady input exactly
+void iirSettles()
+{
+    const uint16_t sample = 613;
+    for (uint8_t shift = 1; shift <= ADCMaxIIRShift; ++shift) {
+        for (uint16_t from : { 0, 1023 }) {
+            MyADCFilters filters;
+            filters.set(0, MyADCFilters::IIR | shift);
+            filters.add(0, from);
+            uint16_t value = 0;
+            for (uint16_t i = 0; i < (32 << shift); ++i) {
+                value = filters.add(0, sample);
+            }
+            if (value != static_cast<uint16_t>(sample << 6)) {
+                char detail[60];
+                snprintf(detail, sizeof(detail), "iir %u from %u reads %u for %u", 1 << shift, from, value, sample << 6);
+                failure("exponential filter %s", detail);
+            }
+        }
+    }
+}
+
+// Input a's filter changed and rejected, then set to an exponential filter
+// and accepted, which saves it, and last put back to its default
+void benchFilters()
+{
+    iirSettles();
+    uint8_t defaultFilter = pgm_read_byte(&ADCDefaultFilters[0]);
+    filterInputA(2, false, "avg 16");
+    MySettingsStore store;
+    Settings settings;
+    uint32_t writes = sim::stats().eepromWrites;
+    filterInputA(6, true, "iir 16");
+    if (sim::stats().eepromWrites == writes || !store.load(settings)
+            || settings._adcFilter[0] != (MyADCFilters::IIR | 4)) {
+        failure("%s", "filter wasn't saved");
+    }
+    filterInputA(ADCMaxIIRShift - 4 + 1 + defaultFilter, true, "avg 4");
+    if (!store.load(settings) || settings._adcFilter[0] != defaultFilter) {
+        failure("%s", "input a filter didn't go back");
+    }
+}
+
+// Commands and queries over the serial port, then a flood of back to back
+// queries at the full baud rate with supply A stepping over its limit in
+// the middle of it, which has to trip as quickly as ever
+void benchRemote()
+{
+    struct Exchange
+    {
+        const char* line;
+        const char* replies;
+    };
+    static const Exchange Script[] = {
+        { "*IDN?\n", "m8r,AVR Power Supply,0,v0.1" },
+        { "CURR:LIM 1,500;CURR:LIM? 1\r\n", "500" },
+        { "current:limit 2,200;CURRENT:LIMIT? 2\n", "200" },
+        { "OUTP OFF;OUTP? 1;OUTP? 2\n", "0|0" },
+        { "OUTPut ON;*OPC?;OUTP? 1\n", "1|1" },
+        { "FOO\n", "-113,\"Undefined header\"" },
+        { "CURR:LIMI? 1\n", "-113,\"Undefined header\"" },
+        { "CURR:LIM 3,10\n", "-222,\"Data out of range\"" },
+        { "CURR:LIM 1,0\n", "-222,\"Data out of range\"" },
+        { "CURR:LIM 1\n", "-109,\"Missing parameter\"" },
+        { "*IDN? 1\n", "-108,\"Parameter not allowed\"" },
+        { "OUTP maybe\n", "-224,\"Illegal parameter value\"" },
+        { "MEAS:VOLT? 1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20\n", "-363,\"Input buffer overrun\"" },
+        { "CURR:LIM 2,1000;CURR:LIM? 1;CURR:LIM? 2\n", "500|1000" },
+    };
+
+    for (const Exchange& exchange : Script) {
+        std::string replies;
+        for (const std::string& reply : remote(exchange.line)) {
+            replies += (replies.empty() ? "" : "|") + reply;
+        }
+        if (replies != exchange.replies) {
+            std::string detail = std::string(exchange.line, strcspn(exchange.line, "\r\n")) + "\" answered \"" + replies;
+            failure("remote \"%s\"", detail.c_str());
+        }
+    }
+    if (sim::shutdown(0) || sim::shutdown(1)) {
+        failure("%s", "remote OUTP ON left a supply off");
+    }
+
+    // Noise on the line in the middle of the next line while the first is
+    // still being answered. Only the second is thrown away.
+    size_t noisyFrom = sim::serialOutput().size();
+    sim::serialInput("*IDN?;*IDN?;*IDN?;*IDN?;*IDN?;*IDN?\n*O");
+    sim::serialInputNoise();
+    sim::serialInput("PC?\n");
+    sim::runMs(100);
+    std::vector<std::string> noisy = remoteReplies(noisyFrom);
+    if (noisy.size() != 7 || noisy[5] != "m8r,AVR Power Supply,0,v0.1" || noisy[6] != "-360,\"Communication error\"") {
+        failure("remote noise %s", noisy.empty() ? "not answered" : ("answered \"" + noisy.back() + "\"").c_str());
+    }
+
+    // A is off, not tripped, so there's no trip light and hiccup mode
+    // leaves it alone
+    remote("OUTP OFF\n", HiccupOffMs * 2);
+    if (sim::statusLED()) {
+        failure("%s", "OUTP OFF lit the trip light");
+    }
+    if (!sim::shutdown(0)) {
+        failure("%s", "hiccup mode turned A back on after OUTP OFF");
+    }
+    // Once the link has been quiet for RemoteQuietMs the analog inputs are
+    // converted asleep again, and the first character of the next line has
+    // to wake the CPU in time to be received. The lines go in at steps
+    // through an ADC sample period, so some start during a conversion.
+    const unsigned QuietLines = 40;
+    uint32_t quiet = sim::stats().adcQuietConversions;
+    unsigned clean = 0;
+    for (unsigned i = 0; i < QuietLines; ++i) {
+        sim::runMs(RemoteQuietMs + 5);
+        sim::run(i * ADCSamplePeriodMs * 1000 / QuietLines * sim::CyclesPerUs);
+        std::vector<std::string> reply = remote("*IDN?\n", 20);
+        clean += reply.size() == 1 && reply[0] == "m8r,AVR Power Supply,0,v0.1";
+    }
+    printf("remote %u of %u lines after the link went quiet answered, ADC %u quiet\n",
+           clean, QuietLines, sim::stats().adcQuietConversions - quiet);
+    if (clean != QuietLines || sim::stats().adcQuietConversions == quiet) {
+        failure("%s", "remote line lost after the link went quiet");
+    }
+    remote("OUTP ON;CURR:LIM 1,300\n");
+
+    std::vector<std::string> measured = remote("MEAS:VOLT? 1;MEAS:CURR? 1;MEAS:POW? 1\n");
+    double volts = 0, amps = 0, watts = 0;
+    if (measured.size() != 3 || sscanf(measured[0].c_str(), "%lf", &volts) != 1 || sscanf(measured[1].c_str(), "%lf", &amps) != 1
+            || sscanf(measured[2].c_str(), "%lf", &watts) != 1 || fabs(volts * 1000 - BootInputs.supplyMilliVolts[0]) > 8
+            || fabs(amps * 1000 - BootInputs.supplyMilliAmps[0]) > 0.25 || fabs(watts - volts * amps) > 0.004) {
+        failure("%s", "remote measurements don't match the inputs");
+    }
+    printf("remote A %.3fV %.4fA %.3fW\n", volts, amps, watts);
+
+    const unsigned FloodQueries = 400;
+    std::string flood;
+    for (unsigned i = 0; i < FloodQueries; ++i) {
+        flood += "MEAS:CURR? 2\n";
+    }
+    double floodMs = flood.size() * 10 * 1000.0 / SerialBaud;
+    size_t from = sim::serialOutput().size();
+    checkWatchdog("the remote commands");
+    sim::resetStats();
+    sim::serialInput(flood.c_str());
+    sim::runMs(floodMs / 2);
+    sim::Inputs inputs = BootInputs;
+    inputs.supplyMilliAmps[0] = 400;
+    sim::setInputs(inputs);
+    uint64_t overCycles = sim::cycles();
+    sim::runMs(floodMs / 2 + 100);
+    sim::setInputs(BootInputs);
+
+    std::vector<std::string> replies = remoteReplies(from);
+    unsigned good = 0;
+    for (const std::string& reply : replies) {
+        double value;
+        good += sscanf(reply.c_str(), "%lf", &value) == 1 && reply[0] != '-' && fabs(value * 1000 - BootInputs.supplyMilliAmps[1]) <= 0.25;
+    }
+    double latencyUs = sim::shutdown(0) ? static_cast<double>(sim::shutdownCycles(0) - overCycles) / sim::CyclesPerUs : -1;
+    const sim::Stats& stats = sim::stats();
+    printf("remote flood %u queries in %.0fms, %u answered, A tripped %.0fus after going over, ADC %u (%u quiet)\n",
+           FloodQueries, floodMs, good, latencyUs, stats.adcConversions, stats.adcQuietConversions);
+    if (good != FloodQueries || replies.size() != FloodQueries) {
+        failure("%s", "remote flood not all answered");
+    }
+    if (latencyUs < 0 || latencyUs > FastTripLatencyBudgetUs) {
+        failure("%s", "remote flood held up the trip");
+    }
+    if (stats.adcConversions < floodMs / ADCSamplePeriodMs / 2) {
+        failure("%s", "analog inputs stopped during the remote flood");
+    }
+    remote("CURR:LIM 1,1000;OUTP ON\n");
+}
+
+// A sensor holding SDA low hangs the TWI. The app times the transfer out,
+// clocks the sensor free and carries on: the supplies stay on and still
+// trip in time. One that never lets go takes the bus down, and with it both
+// sensors, which fail and trip their supplies while the rest of the loop
+// carries on. They come back with the bus. Then the loop stops, which only
+// the watchdog gets out of.
+void benchBus()
+{
+    checkWatchdog("the remote flood");
+    sim::resetStats();
+    sim::holdSDA(0, 5);
+    sim::runMs(200);
+    const sim::Stats& stats = sim::stats();
+    double longestUs = static_cast<double>(stats.longestInterruptCycles) / sim::CyclesPerUs;
+    printf("bus   held %u, released %u, longest interrupt %.0fus, |%s|\n", stats.sdaHolds, stats.sdaReleases, longestUs, sim::lcdLine(0));
+    if (stats.sdaHolds != 1 || stats.sdaReleases != 1) {
+        failure("%s", "bus not recovered from a held SDA");
+    }
+    if (longestUs > 10) {
+        failure("%s", "bus recovered in an interrupt");
+    }
+    if (sim::shutdown(0) || sim::shutdown(1) || !lineStartsWith(0, "A:") || !lineStartsWith(1, "B:")) {
+        failure("%s", "recovered bus hang upset the supplies");
+    }
+
+    sim::Inputs inputs = BootInputs;
+    inputs.supplyMilliAmps[0] = TripMilliAmps + 30;
+    sim::setInputs(inputs);
+    uint64_t overCycles = sim::cycles();
+    sim::runMs(20);
+    sim::setInputs(BootInputs);
+    double latencyUs = sim::shutdown(0) ? static_cast<double>(sim::shutdownCycles(0) - overCycles) / sim::CyclesPerUs : -1;
+    printf("bus   A tripped %.0fus after going over, after the recovery\n", latencyUs);
+    if (latencyUs < 0 || latencyUs > FastTripLatencyBudgetUs) {
+        failure("%s", "trip late after a bus recovery");
+    }
+    remote("OUTP ON\n");
+
+    sim::holdSDA(1, 0);
+    sim::runMs(500);
+    printf("bus   stuck |%s|\n", sim::lcdLine(0));
+    checkWatchdog("the stuck bus");
+    if (!sim::shutdown(0) || !sim::shutdown(1)) {
+        failure("%s", "supply left on with the bus down");
+    }
+    if (!lineStartsWith(0, "Warn:I 0x4")) {
+        failure("%s", "failed sensor not reported");
+    }
+    sim::runMs(2 * ErrorShowMs);
+    printf("      |%s|\n      |%s|\n", sim::lcdLine(0), sim::lcdLine(1));
+    if (!lineStartsWith(0, "A? sensor fault") || !lineStartsWith(1, "B? sensor fault")) {
+        failure("%s", "failed sensors not shown");
+    }
+    std::vector<std::string> identity = remote("*IDN?\n");
+    if (identity.empty() || identity.back() != "m8r,AVR Power Supply,0,v0.1") {
+        failure("%s", "remote stopped with the bus down");
+    }
+
+    sim::releaseSDA();
+    sim::runMs(200);
+    remote("OUTP ON\n");
+    printf("bus   released |%s|\n", sim::lcdLine(0));
+    checkWatchdog("the bus hang");
+
+    // With the event loop stopped protection can't be on time, so the
+    // watchdog goes, though the interrupts carry on. It's counted, not reset,
+    // after which the sim's watchdog is off until it's armed again.
+    uint64_t stopCycles = sim::cycles();
+    sim::runHardware(1000 * 1000 * sim::CyclesPerUs);
+    double stoppedMs = static_cast<double>(sim::stats().firstWatchdogTimeoutCycles - stopCycles) / sim::CyclesPerUs / 1000;
+    printf("bus   loop stopped, watchdog reset %.0fms later\n", stoppedMs);
+    if (sim::stats().watchdogTimeouts != 1 || stoppedMs > 600) {
+        failure("%s", "watchdog didn't reset a stopped loop");
+    }
+    sim::runMs(100);
+    sim::resetStats();
+    if (sim::shutdown(0) || sim::shutdown(1) || !lineStartsWith(0, "A:") || !lineStartsWith(1, "B:")) {
+        failure("%s", "supplies not back with the bus");
+    }
+}
+
+// Last, as a fatal error is only left by the watchdog resetting. A warning
+// is shown for ErrorShowMs and counted in the error records. A fatal one
+// shuts the supplies down at once, stays on the display, keeps them off
+// and lets the watchdog go.
+void benchErrors()
+{
+    MyErrorReporter reporter;
+    reporter.reportError('T', 0x1234, ErrorConditionWarning);
+    sim::runMs(100);
+    printf("error |%s|\n", sim::lcdLine(0));
+    if (!lineStartsWith(0, "Warn:T 0x1234")) {
+        failure("%s", "warning not shown");
+    }
+    sim::runMs(ErrorShowMs + StackCheckMs);
+    if (!lineStartsWith(0, "A:")) {
+        failure("%s", "warning still shown after ErrorShowMs");
+    }
+    const Record* errors = nullptr;
+    std::vector<Record> records = telemetryRecords();
+    for (const Record& record : records) {
+        if (record.type == TelemetryRecordErrors) {
+            errors = &record;
+        }
+    }
+    if (!errors || errors->get16(2) < 1) {
+        failure("%s", "warning not counted in the error records");
+    }
+
+    checkWatchdog("the warning");
+    uint64_t fatalCycles = sim::cycles();
+    reporter.reportError('T', 0x5678, ErrorConditionFatal);
+    if (!sim::shutdown(0) || !sim::shutdown(1)) {
+        failure("%s", "fatal error left a supply on");
+    }
+    remote("OUTP ON\n", HiccupOffMs * 2);
+    printf("fatal |%s|\n", sim::lcdLine(0));
+    if (!lineStartsWith(0, "Fatl:T 0x5678")) {
+        failure("%s", "fatal error not shown");
+    }
+    if (!sim::shutdown(0) || !sim::shutdown(1)) {
+        failure("%s", "supply back on after a fatal error");
+    }
+    sim::runMs(2500);
+    const sim::Stats& stats = sim::stats();
+    double resetMs = static_cast<double>(stats.firstWatchdogTimeoutCycles - fatalCycles) / sim::CyclesPerUs / 1000;
+    printf("fatal watchdog reset %.0fms after the error\n", resetMs);
+    if (stats.watchdogTimeouts != 1 || resetMs < 1900 || resetMs > 2200) {
+        failure("%s", "watchdog didn't go in time after a fatal error");
+    }
+}
+
+// Repeats the debouncer should make in a hold of the given ticks, from its
+// schedule. The press and the release are both a debounce late, so the
+// button is down to the debouncer for as many ticks as it was held.
+unsigned expectedRepeats(uint16_t heldTicks)
+{
+    unsigned repeats = 0;
+    uint16_t interval = MyButtons::RepeatDelayTicks / 2;
+    for (uint16_t t = MyButtons::RepeatDelayTicks; t < heldTicks; ) {
+        ++repeats;
+        t += interval;
+        if (interval - (interval >> 2) >= MyButtons::RepeatDelayTicks / 8) {
+            interval -= interval >> 2;
+        }
+    }
+    return repeats;
+}
+
+// The switches themselves: a short press on the normal display, which goes
+// on its release; holding dec in the coarse current limit adjust, which
+// repeats faster and faster; and a long press turning the outputs back on.
+void benchButtons()
+{
+    holdButton(0, 100);
+    if (!lineStartsWith(0, "B:")) {
+        failure("short press shows \"%s\"", sim::lcdLine(0));
+    }
+    for (uint8_t i = 0; i < NumLineModes - 1; ++i) {
+        holdButton(0, 100);
+    }
+
+    const uint32_t HoldMs = 2000;
+    holdButton(2, 100);
+    holdButton(1, 100);
+    int start = 0;
+    if (sscanf(sim::lcdLine(1), " A:%dma", &start) != 1) {
+        failure("adjust shows \"%s\"", sim::lcdLine(1));
+    }
+    uint16_t pressTicks = g_app.ticks();
+    sim::setButton(1, true);
+    sim::runMs(HoldMs);
+    uint16_t heldTicks = g_app.ticks() - pressTicks;
+    sim::setButton(1, false);
+    sim::runMs(50);
+    int steps = 1 + expectedRepeats(heldTicks);
+    int ma = (start - 1) / CurrentLimitCoarseMa * CurrentLimitCoarseMa - (steps - 1) * CurrentLimitCoarseMa;
+    char expected[24];
+    snprintf(expected, sizeof(expected), " A:%dma<", (ma < CurrentLimitMinMa) ? CurrentLimitMinMa : ma);
+    printf("buttons hold %ums, %d steps |%s|\n", HoldMs, steps, sim::lcdLine(1));
+    if (!lineStartsWith(1, expected)) {
+        failure("auto-repeat shows \"%s\"", sim::lcdLine(1));
+    }
+    holdButton(2, 100);
+    holdButton(2, 100);
+    holdButton(1, 100);
+
+    sim::Inputs inputs = BootInputs;
+    inputs.supplyMilliAmps[0] = 1500;
+    sim::setInputs(inputs);
+    sim::runMs(20);
+    sim::setInputs(BootInputs);
+    sim::setButton(2, true);
+    sim::runMs(ButtonLongPressMs + 200);
+    if (!lineStartsWith(0, "Outputs On") || sim::shutdown(0)) {
+        failure("long press shows \"%s\"", sim::lcdLine(0));
+    }
+    sim::setButton(2, false);
+    sim::runMs(1200);
+    if (!lineStartsWith(0, "A:")) {
+        failure("after the long press, \"%s\"", sim::lcdLine(0));
+    }
+}
+
+void runTrace(const Trace& trace)
+{
+    g_app.resetCurrentLimit();
+    sim::runMs(10);
+    checkWatchdog("the benches");
+    sim::resetStats();
+    uint64_t start = sim::cycles();
+    sim::setInputSource(&trace);
+    sim::run(static_cast<uint64_t>((trace.durationMs() + 20) * 1000 * sim::CyclesPerUs));
+    sim::setInputs(BootInputs);
+
+    const sim::Stats& stats = sim::stats();
+    printf("trace %-12s", trace.name().c_str());
+    for (uint8_t i = 0; i < 2; ++i) {
+        char supply = 'A' + i;
+        bool tripped = stats.shutdowns[i] != 0;
+        double overMs = trace.firstOverMs(i, TripMilliAmps);
+        char detail[80];
+        if (!tripped) {
+            printf("  %c held", supply);
+            if (trace.expectTrip(i)) {
+                snprintf(detail, sizeof(detail), "%s: %c didn't trip", trace.name().c_str(), supply);
+                failure("%s", detail);
+            }
+            continue;
+        }
+
+        double atUs = static_cast<double>(stats.firstShutdownCycles[i] - start) / sim::CyclesPerUs;
+        if (overMs < 0) {
+            printf("  %c tripped at %.0fus, never over %.0fmA", supply, atUs, TripMilliAmps);
+        } else {
+            printf("  %c tripped %.0fus after going over", supply, atUs - overMs * 1000);
+        }
+        if (!trace.expectTrip(i)) {
+            snprintf(detail, sizeof(detail), "%s: %c tripped", trace.name().c_str(), supply);
+            failure("%s", detail);
+        } else if (overMs >= 0 && atUs - overMs * 1000 > FastTripLatencyBudgetUs) {
+            snprintf(detail, sizeof(detail), "%s: %c tripped later than %uus", trace.name().c_str(), supply, FastTripLatencyBudgetUs);
+            failure("%s", detail);
+        }
+        if (stats.shutdowns[i] > 1) {
+            printf(" %u times", stats.shutdowns[i]);
+        }
+        if (!sim::shutdown(i)) {
+            printf(", back on");
+        } else if (trace.expectRecover(i)) {
+            snprintf(detail, sizeof(detail), "%s: %c didn't come back on", trace.name().c_str(), supply);
+            failure("%s", detail);
+        }
+    }
+
+    checkWatchdog(trace.name().c_str());
+    uint64_t cycles = sim::cycles() - start;
+    printf("  awake %.1f%%  ADC %u (%u quiet)  TWI %u  serial %u\n",
+           100.0 * (cycles - stats.sleepCycles - stats.adcSleepCycles) / cycles,
+           stats.adcConversions, stats.adcQuietConversions, stats.twiBytes, stats.serialBytes);
+}
+
+}
+
+int main(int argc, char** argv)
+{
+    uint16_t iterations = DefaultIterations;
+    int first = 1;
+    if (argc > 2 && !strcmp(argv[1], "-n")) {
+        iterations = atoi(argv[2]);
+        first = 3;
+    }
+
+    HostTiming::calibrate();
+    boot();
+    benchUpdateADC(iterations);
+    benchUpdateCurrentSensor(iterations / 10);
+    benchUpdateDisplay(iterations);
+    benchDisplayPacing();
+    benchCurrentBar();
+    printf("trip budget %uus, limit %umA, trips at %.1fmA\n", FastTripLatencyBudgetUs, DefaultLimitMa, TripMilliAmps);
+    for (int i = first; i < argc; ++i) {
+        Trace trace;
+        if (!trace.load(argv[i])) {
+            return 2;
+        }
+        runTrace(trace);
+    }
+    benchMenuWalk();
+    benchCapture();
+    benchButtons();
+    benchCalibration();
+    benchFilters();
+    benchRemote();
+    benchBus();
+    benchErrors();
+    for (const std::string& message : g_failures) {
+        printf("FAIL %s\n", message.c_str());
+    }
+    printf("%u failures in %.1fs simulated\n", static_cast<unsigned>(g_failures.size()), sim::micros() / 1000000);
+    return g_failures.empty() ? 0 : 1;
+}
@@ -0,0 +1,27 @@
+//
+//  EventListener.h
+//
+//  m8r event dispatch for the host simulation
+//
+
+#pragma once
+
+#include "m8r.h"
+
+namespace m8r {
+
+enum EventType { EV_NONE, EV_IDLE, EV_ADC, EV_EVENT_TIMER, EV_BUTTON_DOWN, EV_BUTTON_UP };
+typedef void* EventParam;
+
+// Listeners register themselves on construction, as in the library
+class EventListener {
+public:
+    EventListener();
+    virtual ~EventListener();
+
+    virtual void handleEvent(EventType, EventParam) = 0;
+
+    static void dispatch(EventType, EventParam);
+};
+
+}
@@ -0,0 +1,1108 @@
+//
+//  Machine.cpp
+//
+//  Simulated ATmega328P and power supply board for host builds
+//
+
+#include "Machine.h"
+
+#include "System.h"
+
+#include <avr/eeprom.h>
+#include <avr/io.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+#include <util/delay.h>
+
+#include <deque>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The app's handlers, where it has them
+#define DECLARE_VECTOR(vector) extern "C" void vector(void) __attribute__((weak))
+DECLARE_VECTOR(PCINT2_vect);
+DECLARE_VECTOR(TIMER2_COMPA_vect);
+DECLARE_VECTOR(TIMER1_OVF_vect);
+DECLARE_VECTOR(USART_RX_vect);
+DECLARE_VECTOR(USART_UDRE_vect);
+DECLARE_VECTOR(ADC_vect);
+DECLARE_VECTOR(EE_READY_vect);
+DECLARE_VECTOR(TWI_vect);
+
+namespace sim {
+
+namespace {
+
+const uint64_t Never = UINT64_MAX;
+
+const uint64_t Timer0Cycles = 64 * 256;
+const uint64_t ADCConversionCycles = 13 * 128;
+const uint64_t EEPROMWriteCycles = 3400 * CyclesPerUs;
+const uint16_t SerialInNoise = 0x100;
+const double ADCNoiseLsb = 2;
+
+// The internal bandgap on mux 14. The first conversion after the mux
+// switches to it reads low, as it takes longer than that to settle.
+const uint8_t BandgapMux = 0x0e;
+const double BandgapMilliVolts = 1100;
+const double BandgapSettlingFraction = 0.8;
+
+// INA219 on a 0.33 ohm shunt
+const uint8_t NumSensors = 2;
+const uint8_t SensorAddress[NumSensors] = { 0x40, 0x41 };
+const double ShuntMilliOhms = 330;
+const uint16_t SensorConfigDefault = 0x399f;
+
+// Board wiring, see the Connection notes in AVRPowerSupply.cpp
+const uint8_t LCDRSBit = 4;         // Port B
+const uint8_t LCDEnableBit = 3;     // Port B
+const uint8_t StatusLEDBit = 5;     // Port B
+const uint8_t LCDDataBits[4] = { 5, 4, 3, 2 };  // Port D, LCD D4-D7
+const uint8_t ShutdownBits[2] = { 6, 7 };       // Port D
+const uint8_t SwitchBits = 0x07;                // Port B
+const uint8_t SDABit = 4;                       // Port C
+const uint8_t SCLBit = 5;                       // Port C
+
+enum class Event : uint8_t { Timer0, Timer1, Timer2, TWI, USART, Analog, EEPROM, SerialIn, Watchdog, Sensor0, Sensor1, None };
+
+struct Sensor
+{
+    uint16_t reg[6];
+    uint8_t pointer;
+    uint8_t byteIndex;
+    uint8_t msb;
+    uint64_t nextConversion;
+};
+
+enum class TWIPhase : uint8_t { Idle, Address, Transmit, Receive, Held };
+
+struct State
+{
+    uint8_t io[0x100];
+    uint8_t eeprom[E2END + 1];
+    uint64_t now = 0;
+    uint64_t ioStopped = 0;
+    Stats stats;
+
+    // Timer0 always runs, for the m8r event timers
+    uint64_t timer0Next = Timer0Cycles;
+    uint64_t timer1Base = 0;
+    uint64_t timer1Next = Never;
+    uint8_t timer1High = 0;
+    uint64_t timer2Next = Never;
+
+    uint64_t adcDone = Never;
+    uint8_t adcChannel = 0;
+    uint8_t adcLastChannel = 0;
+    bool adcQuiet = false;
+    double avccMilliVolts = 5000;
+    uint32_t noiseSeed = 1;
+
+    TWIPhase twiPhase = TWIPhase::Idle;
+    int8_t twiDevice = -1;
+    uint64_t twiDone = Never;
+    uint8_t twiStatus = 0;
+    uint8_t twiData = 0;
+    int8_t sdaHoldArmed = -1;       // Sensor to hold SDA from its next byte
+    uint8_t sdaHoldClocks = 0;
+    bool sdaHeld = false;
+
+    uint64_t usartDone = Never;
+    bool usartHolding = false;
+    std::vector<uint8_t> serial;
+    std::deque<uint16_t> serialIn;  // SerialInNoise for a framing error
+    uint64_t serialInDone = Never;
+    uint64_t serialInStopped = 0;   // ioStopped when the byte coming in started
+    uint8_t serialInData = 0;
+
+    uint64_t eepromDone = Never;
+
+    uint64_t watchdogPeriod = 0;
+    uint64_t watchdogDue = Never;
+
+    bool lcdFourBit = false;
+    bool lcdHaveHigh = false;
+    uint8_t lcdHigh = 0;
+    uint8_t lcdAddress = 0;
+    bool lcdCGRAM = false;
+    uint8_t lcdDDRAM[80];
+    uint8_t lcdCGRAMData[64];
+    char lcdText[2][17];
+
+    Sensor sensors[NumSensors];
+    uint64_t shutdownSince[2] = { Never, Never };
+    uint8_t buttonsDown = 0;
+    Inputs inputs = { { 0, 0 }, { 0, 0 }, { 0, 0, 0, 0 } };
+    const InputSource* source = nullptr;
+    uint64_t sourceStart = 0;
+
+    State()
+    {
+        memset(io, 0, sizeof(io));
+        memset(eeprom, 0xff, sizeof(eeprom));
+        memset(&stats, 0, sizeof(stats));
+        memset(lcdDDRAM, ' ', sizeof(lcdDDRAM));
+        memset(lcdCGRAMData, 0, sizeof(lcdCGRAMData));
+        io[0xc0] = _BV(UDRE0);
+        for (uint8_t i = 0; i < NumSensors; ++i) {
+            memset(&sensors[i], 0, sizeof(Sensor));
+            sensors[i].reg[0] = SensorConfigDefault;
+            sensors[i].nextConversion = Never;
+        }
+    }
+};
+
+// Function local so it's ready for g_app's constructor, whatever the order
+// of static initialization
+State& state()
+{
+    static State s;
+    return s;
+}
+
+[[noreturn]] void fail(const char* message)
+{
+    fprintf(stderr, "sim: %s at %.1fus\n", message, micros());
+    exit(2);
+}
+
+uint8_t& reg(uint8_t address) { return state().io[address]; }
+
+Inputs inputs()
+{
+    State& s = state();
+    if (!s.source) {
+        return s.inputs;
+    }
+    return s.source->at(static_cast<double>(s.now - s.sourceStart) / (1000.0 * CyclesPerUs));
+}
+
+bool supplyOn(uint8_t supply) { return !(reg(0x2b) & _BV(ShutdownBits[supply])); }
+
+// ------------------------------------------------------------------ Timers
+
+const uint16_t TimerPrescale[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+const uint16_t Timer2Prescale[8] = { 0, 1, 8, 32, 64, 128, 256, 1024 };
+
+uint64_t timer1Prescale() { return TimerPrescale[reg(0x81) & 0x07]; }
+
+uint16_t timer1Count()
+{
+    State& s = state();
+    uint64_t prescale = timer1Prescale();
+    return prescale ? static_cast<uint16_t>((s.now - s.timer1Base) / prescale) : 0;
+}
+
+void scheduleTimer1(uint16_t count)
+{
+    State& s = state();
+    uint64_t prescale = timer1Prescale();
+    if (!prescale) {
+        s.timer1Next = Never;
+        return;
+    }
+    s.timer1Base = s.now - count * prescale;
+    s.timer1Next = s.timer1Base + 0x10000 * prescale;
+}
+
+uint64_t timer2Period()
+{
+    return static_cast<uint64_t>(reg(0xb3) + 1) * Timer2Prescale[reg(0xb1) & 0x07];
+}
+
+// --------------------------------------------------------------------- ADC
+
+double noise(double lsb)
+{
+    State& s = state();
+    s.noiseSeed = s.noiseSeed * 1103515245 + 12345;
+    return ((s.noiseSeed >> 8) & 0xffff) / 65535.0 * 2 * lsb - lsb;
+}
+
+void startConversion(bool quiet)
+{
+    State& s = state();
+    s.adcLastChannel = s.adcChannel;
+    s.adcChannel = reg(0x7c) & 0x0f;
+    s.adcDone = s.now + ADCConversionCycles;
+    s.adcQuiet = quiet;
+    reg(0x7a) |= _BV(ADSC);
+}
+
+bool adcTriggeredBy(uint8_t source)
+{
+    return (reg(0x7a) & _BV(ADEN)) && (reg(0x7a) & _BV(ADATE)) && (reg(0x7b) & 0x07) == source;
+}
+
+void finishConversion()
+{
+    State& s = state();
+    s.adcDone = Never;
+    double mV = (s.adcChannel < 4) ? inputs().analogMilliVolts[s.adcChannel] : 0;
+    if (s.adcChannel == BandgapMux) {
+        mV = BandgapMilliVolts * ((s.adcLastChannel == BandgapMux) ? 1 : BandgapSettlingFraction);
+    }
+    double value = mV * 1024 / s.avccMilliVolts + noise(s.adcQuiet ? 0.5 : ADCNoiseLsb);
+    uint16_t result = (value < 0) ? 0 : (value > 1023) ? 1023 : static_cast<uint16_t>(lround(value));
+    reg(0x78) = result;
+    reg(0x79) = result >> 8;
+    reg(0x7a) = (reg(0x7a) & ~_BV(ADSC)) | _BV(ADIF);
+    ++s.stats.adcConversions;
+    if (s.adcQuiet) {
+        ++s.stats.adcQuietConversions;
+    }
+    if (adcTriggeredBy(0)) {
+        startConversion(false);
+    }
+}
+
+void writeADCSRA(uint8_t value)
+{
+    uint8_t old = reg(0x7a);
+    uint8_t flags = (value & _BV(ADIF)) ? 0 : (old & _BV(ADIF));
+    reg(0x7a) = (value & ~(_BV(ADIF) | _BV(ADSC))) | flags | (old & _BV(ADSC));
+    if (!(value & _BV(ADEN))) {
+        state().adcDone = Never;
+        reg(0x7a) &= ~_BV(ADSC);
+    } else if ((value & _BV(ADSC)) && !(old & _BV(ADSC))) {
+        startConversion(false);
+    }
+}
+
+// --------------------------------------------------------------- INA219s
+
+uint64_t conversionCycles(uint8_t adc)
+{
+    static const uint16_t Us[4] = { 84, 148, 276, 532 };
+    return static_cast<uint64_t>((adc & 0x08) ? (532u << (adc & 0x07)) : Us[adc & 0x03]) * CyclesPerUs;
+}
+
+uint64_t shuntCycles(const Sensor& sensor) { return conversionCycles((sensor.reg[0] >> 3) & 0x0f); }
+uint64_t busCycles(const Sensor& sensor) { return conversionCycles((sensor.reg[0] >> 7) & 0x0f); }
+
+uint64_t sensorPeriod(const Sensor& sensor)
+{
+    switch (sensor.reg[0] & 0x07) {
+        case 5: return shuntCycles(sensor);
+        case 6: return busCycles(sensor);
+        case 7: return shuntCycles(sensor) + busCycles(sensor);
+        default: return 0;  // Triggered modes aren't modelled
+    }
+}
+
+void restartSensor(Sensor& sensor)
+{
+    uint64_t period = sensorPeriod(sensor);
+    sensor.nextConversion = period ? state().now + period : Never;
+    sensor.reg[2] &= ~0x0003;
+}
+
+// The shunt reading is averaged over its conversion window. With the supply
+// shut down its output, and so both readings, drop to 0.
+void convert(uint8_t index)
+{
+    State& s = state();
+    Sensor& sensor = s.sensors[index];
+    Inputs in = inputs();
+    bool on = supplyOn(index);
+
+    uint8_t mode = sensor.reg[0] & 0x07;
+    if (mode == 5 || mode == 7) {
+        uint64_t window = shuntCycles(sensor);
+        double mA = 0;
+        const uint8_t Points = 4;
+        if (on) {
+            for (uint8_t i = 0; i < Points; ++i) {
+                uint64_t saved = s.now;
+                s.now -= window * i / Points;
+                mA += inputs().supplyMilliAmps[index];
+                s.now = saved;
+            }
+            mA /= Points;
+        }
+        double limit = 4000 << ((sensor.reg[0] >> 11) & 0x03);
+        double counts = mA * ShuntMilliOhms / 10;   // 10uV per count
+        counts = (counts > limit) ? limit : (counts < -limit) ? -limit : counts;
+        sensor.reg[1] = static_cast<uint16_t>(static_cast<int16_t>(lround(counts)));
+    }
+    if (mode == 6 || mode == 7) {
+        double mV = on ? in.supplyMilliVolts[index] : 0;
+        double limit = (sensor.reg[0] & 0x2000) ? 8000 : 4000;
+        double counts = mV / 4;
+        counts = (counts > limit) ? limit : (counts < 0) ? 0 : counts;
+        sensor.reg[2] = static_cast<uint16_t>(lround(counts)) << 3;
+    }
+    sensor.reg[2] |= 0x0002;     // CNVR
+
+    int32_t current = (static_cast<int32_t>(static_cast<int16_t>(sensor.reg[1])) * sensor.reg[5]) >> 12;
+    sensor.reg[4] = static_cast<uint16_t>(current);
+    sensor.reg[3] = static_cast<uint16_t>(labs(current) * (sensor.reg[2] >> 3) / 5000);
+
+    sensor.nextConversion += sensorPeriod(sensor);
+}
+
+void sensorWrite(Sensor& sensor, uint8_t byte)
+{
+    if (sensor.byteIndex == 0) {
+        sensor.pointer = byte % 6;
+    } else if (sensor.byteIndex == 1) {
+        sensor.msb = byte;
+    } else if (sensor.byteIndex == 2) {
+        uint16_t value = (static_cast<uint16_t>(sensor.msb) << 8) | byte;
+        if (sensor.pointer == 0) {
+            sensor.reg[0] = (value & 0x8000) ? SensorConfigDefault : value;
+            restartSensor(sensor);
+        } else if (sensor.pointer == 5) {
+            sensor.reg[5] = value & 0xfffe;
+        }
+    }
+    ++sensor.byteIndex;
+}
+
+uint8_t sensorRead(Sensor& sensor)
+{
+    uint16_t value = sensor.reg[sensor.pointer];
+    if (sensor.pointer == 3) {
+        sensor.reg[2] &= ~0x0002;   // Reading power clears CNVR
+    }
+    return (sensor.byteIndex++ & 1) ? value : value >> 8;
+}
+
+// --------------------------------------------------------------------- TWI
+
+uint64_t twiBitCycles()
+{
+    static const uint8_t Prescale[4] = { 1, 4, 16, 64 };
+    return 16 + 2 * static_cast<uint64_t>(reg(0xb8)) * Prescale[reg(0xb9) & 0x03];
+}
+
+void twiComplete(uint8_t status, uint64_t bits)
+{
+    State& s = state();
+    s.twiStatus = status;
+    s.twiDone = s.now + bits * twiBitCycles();
+}
+
+// Turning the TWI off abandons whatever it was doing. While a sensor holds
+// SDA low nothing on the bus finishes: no STARTs, no bytes and no STOPs.
+void writeTWCR(uint8_t value)
+{
+    State& s = state();
+    uint8_t control = value & (_BV(TWEA) | _BV(TWSTA) | _BV(TWSTO) | _BV(TWEN) | _BV(TWIE));
+    if (!(value & _BV(TWEN))) {
+        reg(0xbc) = ((value & _BV(TWINT)) ? 0 : (reg(0xbc) & _BV(TWINT))) | control;
+        s.twiPhase = TWIPhase::Idle;
+        s.twiDevice = -1;
+        s.twiDone = Never;
+        return;
+    }
+    if (!(value & _BV(TWINT))) {
+        reg(0xbc) = (reg(0xbc) & _BV(TWINT)) | control;
+        return;
+    }
+    reg(0xbc) = control & ~_BV(TWSTO);
+    if (s.sdaHeld) {
+        return;
+    }
+
+    if (value & _BV(TWSTO)) {
+        s.twiPhase = TWIPhase::Idle;
+        s.twiDevice = -1;
+        if (!(value & _BV(TWSTA))) {
+            return;
+        }
+    }
+    if (value & _BV(TWSTA)) {
+        twiComplete((s.twiPhase == TWIPhase::Idle) ? 0x08 : 0x10, 1);
+        s.twiPhase = TWIPhase::Address;
+        return;
+    }
+
+    ++s.stats.twiBytes;
+    uint8_t data = reg(0xbb);
+    switch (s.twiPhase) {
+        case TWIPhase::Address: {
+            bool read = data & 1;
+            s.twiDevice = -1;
+            for (uint8_t i = 0; i < NumSensors; ++i) {
+                if (SensorAddress[i] == data >> 1) {
+                    s.twiDevice = i;
+                    s.sensors[i].byteIndex = 0;
+                }
+            }
+            if (s.twiDevice < 0) {
+                ++s.stats.twiNacks;
+                s.twiPhase = TWIPhase::Held;
+                twiComplete(read ? 0x48 : 0x20, 9);
+            } else {
+                s.twiPhase = read ? TWIPhase::Receive : TWIPhase::Transmit;
+                twiComplete(read ? 0x40 : 0x18, 9);
+            }
+            break;
+        }
+        case TWIPhase::Transmit:
+            sensorWrite(s.sensors[s.twiDevice], data);
+            twiComplete(0x28, 9);
+            break;
+        case TWIPhase::Receive:
+            if (s.twiDevice == s.sdaHoldArmed) {
+                s.sdaHoldArmed = -1;
+                s.sdaHeld = true;
+                ++s.stats.sdaHolds;
+                break;
+            }
+            s.twiData = sensorRead(s.sensors[s.twiDevice]);
+            twiComplete((value & _BV(TWEA)) ? 0x50 : 0x58, 9);
+            break;
+        default:
+            twiComplete(0x00, 1);   // Bus error
+            break;
+    }
+}
+
+// With the TWI off the pins are the port's, open drain with pull-ups: low
+// only where DDRC drives them with PORTC low
+bool pinDrivenLow(uint8_t bit)
+{
+    return !(reg(0xbc) & _BV(TWEN)) && (reg(0x27) & _BV(bit)) && !(reg(0x28) & _BV(bit));
+}
+
+uint8_t readPINC()
+{
+    uint8_t pins = reg(0x26) | _BV(SDABit) | _BV(SCLBit);
+    if (pinDrivenLow(SDABit) || state().sdaHeld) {
+        pins &= ~_BV(SDABit);
+    }
+    if (pinDrivenLow(SCLBit)) {
+        pins &= ~_BV(SCLBit);
+    }
+    return pins;
+}
+
+// A sensor holding SDA lets go once it has been clocked enough
+void writePortC(uint8_t address, uint8_t value)
+{
+    State& s = state();
+    bool sclWasLow = pinDrivenLow(SCLBit);
+    reg(address) = value;
+    if (sclWasLow && !pinDrivenLow(SCLBit) && s.sdaHeld && s.sdaHoldClocks && --s.sdaHoldClocks == 0) {
+        s.sdaHeld = false;
+        ++s.stats.sdaReleases;
+    }
+}
+
+void finishTWI()
+{
+    State& s = state();
+    s.twiDone = Never;
+    if (s.twiStatus == 0x50 || s.twiStatus == 0x58) {
+        reg(0xbb) = s.twiData;
+    }
+    reg(0xb9) = (reg(0xb9) & 0x03) | s.twiStatus;
+    reg(0xbc) |= _BV(TWINT);
+}
+
+// ------------------------------------------------------------------- USART
+
+uint64_t usartByteCycles()
+{
+    uint16_t ubrr = reg(0xc4) | (static_cast<uint16_t>(reg(0xc5)) << 8);
+    return 10 * ((reg(0xc0) & _BV(U2X0)) ? 8 : 16) * static_cast<uint64_t>(ubrr + 1);
+}
+
+void writeUDR(uint8_t value)
+{
+    State& s = state();
+    if (!(reg(0xc1) & _BV(TXEN0))) {
+        return;
+    }
+    s.serial.push_back(value);
+    ++s.stats.serialBytes;
+    if (s.usartDone == Never) {
+        s.usartDone = s.now + usartByteCycles();
+    } else {
+        s.usartHolding = true;
+    }
+}
+
+void finishUSARTByte()
+{
+    State& s = state();
+    if (s.usartHolding) {
+        s.usartHolding = false;
+        s.usartDone += usartByteCycles();
+    } else {
+        s.usartDone = Never;
+        reg(0xc0) |= _BV(TXC0);
+    }
+}
+
+// The falling edge of the start bit sets the pin change flag for RXD
+void startSerialIn()
+{
+    State& s = state();
+    s.serialInDone = s.serialIn.empty() ? Never : s.now + usartByteCycles();
+    s.serialInStopped = s.ioStopped;
+    if (!s.serialIn.empty() && (reg(0x6d) & _BV(PCINT16))) {
+        reg(0x3b) |= _BV(PCIF2);
+    }
+}
+
+// The receiver only buffers one byte here, where the chip has two
+void finishSerialIn()
+{
+    State& s = state();
+    uint16_t b = s.serialIn.front();
+    s.serialIn.pop_front();
+    if (reg(0xc1) & _BV(RXEN0)) {
+        if (reg(0xc0) & _BV(RXC0)) {
+            reg(0xc0) |= _BV(DOR0);
+        } else {
+            bool framingError = s.ioStopped != s.serialInStopped || b == SerialInNoise;
+            s.serialInData = b;
+            reg(0xc0) = (reg(0xc0) & ~_BV(FE0)) | _BV(RXC0) | (framingError ? _BV(FE0) : 0);
+        }
+    }
+    startSerialIn();
+}
+
+// ------------------------------------------------------------------ EEPROM
+
+void writeEECR(uint8_t value)
+{
+    State& s = state();
+    uint8_t old = reg(0x3f);
+    reg(0x3f) = (value & (_BV(EERIE) | _BV(EEMPE))) | (old & _BV(EEPE));
+    if ((value & _BV(EERE)) && !(old & _BV(EEPE))) {
+        reg(0x40) = s.eeprom[(reg(0x41) | (reg(0x42) << 8)) & E2END];
+    }
+    if ((value & _BV(EEPE)) && (old & _BV(EEMPE)) && !(old & _BV(EEPE))) {
+        reg(0x3f) = (reg(0x3f) & ~_BV(EEMPE)) | _BV(EEPE);
+        s.eepromDone = s.now + EEPROMWriteCycles;
+    }
+}
+
+void finishEEPROMWrite()
+{
+    State& s = state();
+    s.eepromDone = Never;
+    s.eeprom[(reg(0x41) | (reg(0x42) << 8)) & E2END] = reg(0x40);
+    reg(0x3f) &= ~_BV(EEPE);
+    ++s.stats.eepromWrites;
+}
+
+// ---------------------------------------------------------------- Watchdog
+
+// The chip would reset here. Nothing more happens until it's enabled again.
+void watchdogTimeout()
+{
+    State& s = state();
+    s.watchdogDue = Never;
+    if (s.stats.watchdogTimeouts++ == 0) {
+        s.stats.firstWatchdogTimeoutCycles = s.now;
+    }
+}
+
+// --------------------------------------------------------------------- LCD
+
+uint8_t lcdIndex(uint8_t address) { return (address & 0x40) ? 40 + (address & 0x3f) : address; }
+
+void lcdExecute(bool rs, uint8_t b)
+{
+    State& s = state();
+    if (rs) {
+        ++s.stats.lcdWrites;
+        if (s.lcdCGRAM) {
+            s.lcdCGRAMData[s.lcdAddress & 0x3f] = b;
+            s.lcdAddress = (s.lcdAddress + 1) & 0x3f;
+            return;
+        }
+        if (lcdIndex(s.lcdAddress) < sizeof(s.lcdDDRAM)) {
+            s.lcdDDRAM[lcdIndex(s.lcdAddress)] = b;
+        }
+        s.lcdAddress = (s.lcdAddress == 0x27) ? 0x40 : (s.lcdAddress == 0x67) ? 0x00 : s.lcdAddress + 1;
+        return;
+    }
+
+    if (b & 0x80) {
+        s.lcdAddress = b & 0x7f;
+        s.lcdCGRAM = false;
+    } else if (b & 0x40) {
+        s.lcdAddress = b & 0x3f;
+        s.lcdCGRAM = true;
+    } else if (b & 0x20) {
+        s.lcdFourBit = !(b & 0x10);
+    } else if (b == 0x01) {
+        memset(s.lcdDDRAM, ' ', sizeof(s.lcdDDRAM));
+        s.lcdAddress = 0;
+        s.lcdCGRAM = false;
+    } else if ((b & 0xfe) == 0x02) {
+        s.lcdAddress = 0;
+        s.lcdCGRAM = false;
+    }
+}
+
+// The LCD latches on the falling edge of E. Until it's told to go to 4 bit
+// mode it reads D4-D7 as the top of a whole byte.
+void lcdStrobe()
+{
+    State& s = state();
+    bool rs = reg(0x25) & _BV(LCDRSBit);
+    uint8_t nibble = 0;
+    for (uint8_t i = 0; i < 4; ++i) {
+        if (reg(0x2b) & _BV(LCDDataBits[i])) {
+            nibble |= 1 << i;
+        }
+    }
+    if (!s.lcdFourBit) {
+        lcdExecute(rs, nibble << 4);
+    } else if (!s.lcdHaveHigh) {
+        s.lcdHigh = nibble;
+        s.lcdHaveHigh = true;
+    } else {
+        s.lcdHaveHigh = false;
+        lcdExecute(rs, (s.lcdHigh << 4) | nibble);
+    }
+}
+
+// ------------------------------------------------------------- Scheduling
+
+uint64_t eventTime(Event e)
+{
+    State& s = state();
+    switch (e) {
+        case Event::Timer0: return s.timer0Next;
+        case Event::Timer1: return s.timer1Next;
+        case Event::Timer2: return s.timer2Next;
+        case Event::TWI: return s.twiDone;
+        case Event::USART: return s.usartDone;
+        case Event::Analog: return s.adcDone;
+        case Event::EEPROM: return s.eepromDone;
+        case Event::SerialIn: return s.serialInDone;
+        case Event::Watchdog: return s.watchdogDue;
+        case Event::Sensor0: return s.sensors[0].nextConversion;
+        case Event::Sensor1: return s.sensors[1].nextConversion;
+        case Event::None: break;
+    }
+    return Never;
+}
+
+// Events timed by the I/O clock, which stops in ADC noise reduction sleep
+bool onIOClock(Event e) { return e <= Event::USART; }
+
+Event nextEvent(bool ioRunning)
+{
+    Event next = Event::None;
+    uint64_t time = Never;
+    for (uint8_t i = 0; i < static_cast<uint8_t>(Event::None); ++i) {
+        Event e = static_cast<Event>(i);
+        if ((ioRunning || !onIOClock(e)) && eventTime(e) < time) {
+            time = eventTime(e);
+            next = e;
+        }
+    }
+    return next;
+}
+
+void slipIOClock(uint64_t cycles)
+{
+    State& s = state();
+    uint64_t* times[] = { &s.timer0Next, &s.timer1Next, &s.timer2Next, &s.twiDone, &s.usartDone };
+    for (uint64_t* t : times) {
+        if (*t != Never) {
+            *t += cycles;
+        }
+    }
+    s.timer1Base += cycles;
+    s.ioStopped += cycles;
+}
+
+void fire(Event e)
+{
+    State& s = state();
+    switch (e) {
+        case Event::Timer0:
+            s.timer0Next += Timer0Cycles;
+            reg(0x35) |= _BV(TOV0);
+            m8r::System::serviceTimers(static_cast<uint32_t>((s.now - s.ioStopped) / (1000 * CyclesPerUs)));
+            if (adcTriggeredBy(4) && !(reg(0x7a) & _BV(ADSC))) {
+                startConversion(false);
+            }
+            break;
+        case Event::Timer1:
+            s.timer1Next += 0x10000 * timer1Prescale();
+            reg(0x36) |= _BV(TOV1);
+            break;
+        case Event::Timer2:
+            reg(0x37) |= _BV(OCF2A);
+            s.timer2Next = timer2Period() ? s.timer2Next + timer2Period() : Never;
+            break;
+        case Event::TWI: finishTWI(); break;
+        case Event::USART: finishUSARTByte(); break;
+        case Event::Analog: finishConversion(); break;
+        case Event::EEPROM: finishEEPROMWrite(); break;
+        case Event::SerialIn: finishSerialIn(); break;
+        case Event::Watchdog: watchdogTimeout(); break;
+        case Event::Sensor0: convert(0); break;
+        case Event::Sensor1: convert(1); break;
+        case Event::None: break;
+    }
+}
+
+typedef void (*Vector)();
+
+void call(Vector vector, const char* name)
+{
+    if (!vector) {
+        fprintf(stderr, "sim: no handler for %s\n", name);
+        fail("interrupt with no handler");
+    }
+    State& s = state();
+    ++s.stats.interrupts;
+    uint64_t start = s.now;
+    reg(0x5f) &= ~0x80;
+    vector();
+    reg(0x5f) |= 0x80;
+    if (s.now - start > s.stats.longestInterruptCycles) {
+        s.stats.longestInterruptCycles = s.now - start;
+    }
+}
+
+// Runs the highest priority pending interrupt, if interrupts are on.
+// Flags the hardware clears on entry to the handler are cleared here.
+bool serviceOne()
+{
+    if (!(reg(0x5f) & 0x80)) {
+        return false;
+    }
+    if ((reg(0x68) & _BV(PCIE2)) && (reg(0x3b) & _BV(PCIF2))) {
+        reg(0x3b) &= ~_BV(PCIF2);
+        call(PCINT2_vect, "PCINT2_vect");
+    } else if ((reg(0x70) & _BV(OCIE2A)) && (reg(0x37) & _BV(OCF2A))) {
+        reg(0x37) &= ~_BV(OCF2A);
+        call(TIMER2_COMPA_vect, "TIMER2_COMPA_vect");
+    } else if ((reg(0x6f) & _BV(TOIE1)) && (reg(0x36) & _BV(TOV1))) {
+        reg(0x36) &= ~_BV(TOV1);
+        call(TIMER1_OVF_vect, "TIMER1_OVF_vect");
+    } else if ((reg(0xc1) & _BV(RXCIE0)) && (reg(0xc0) & _BV(RXC0))) {
+        call(USART_RX_vect, "USART_RX_vect");
+    } else if ((reg(0xc1) & _BV(UDRIE0)) && !state().usartHolding) {
+        call(USART_UDRE_vect, "USART_UDRE_vect");
+    } else if ((reg(0x7a) & _BV(ADIE)) && (reg(0x7a) & _BV(ADIF))) {
+        reg(0x7a) &= ~_BV(ADIF);
+        call(ADC_vect, "ADC_vect");
+    } else if ((reg(0x3f) & _BV(EERIE)) && !(reg(0x3f) & _BV(EEPE))) {
+        call(EE_READY_vect, "EE_READY_vect");
+    } else if ((reg(0xbc) & _BV(TWIE)) && (reg(0xbc) & _BV(TWINT))) {
+        call(TWI_vect, "TWI_vect");
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool serviceInterrupts()
+{
+    uint16_t count = 0;
+    while (serviceOne()) {
+        if (++count > 1000) {
+            fail("interrupt keeps firing");
+        }
+    }
+    return count != 0;
+}
+
+// Moves time on to 'until', handling the hardware events on the way and the
+// interrupts they raise. With wake set it stops after the first interrupt.
+// Returns true if it stopped for one.
+bool advance(uint64_t until, bool ioRunning, bool wake)
+{
+    State& s = state();
+    while (true) {
+        Event e = nextEvent(ioRunning);
+        uint64_t time = eventTime(e);
+        if (time > until) {
+            if (until == Never) {
+                fail("asleep with nothing to wake up");
+            }
+            if (!ioRunning) {
+                slipIOClock(until - s.now);
+            }
+            s.now = until;
+            return false;
+        }
+        if (!ioRunning) {
+            slipIOClock(time - s.now);
+        }
+        s.now = time;
+        fire(e);
+        if (serviceInterrupts() && wake) {
+            return true;
+        }
+    }
+}
+
+}
+
+// ------------------------------------------------------------- Registers
+
+uint8_t readRegister(uint8_t address)
+{
+    State& s = state();
+    switch (address) {
+        case 0xc0:
+            return (s.io[0xc0] & ~_BV(UDRE0)) | (s.usartHolding ? 0 : _BV(UDRE0));
+        case 0x84: {
+            uint16_t count = timer1Count();
+            s.timer1High = count >> 8;
+            return count;
+        }
+        case 0x85:
+            return s.timer1High;
+        case 0x23:
+            return (s.io[0x23] & ~SwitchBits) | (SwitchBits & ~s.buttonsDown);
+        case 0x26:
+            return readPINC();
+        case 0xc6:
+            s.io[0xc0] &= ~(_BV(RXC0) | _BV(FE0) | _BV(DOR0));
+            return s.serialInData;
+        default:
+            return s.io[address];
+    }
+}
+
+void writeRegister(uint8_t address, uint8_t value)
+{
+    State& s = state();
+    uint8_t old = s.io[address];
+    switch (address) {
+        case 0x25:
+            s.io[address] = value;
+            if ((old & _BV(LCDEnableBit)) && !(value & _BV(LCDEnableBit))) {
+                lcdStrobe();
+            }
+            break;
+        case 0x2b:
+            s.io[address] = value;
+            for (uint8_t i = 0; i < 2; ++i) {
+                if ((value & _BV(ShutdownBits[i])) && !(old & _BV(ShutdownBits[i]))) {
+                    s.shutdownSince[i] = s.now;
+                    if (s.stats.shutdowns[i]++ == 0) {
+                        s.stats.firstShutdownCycles[i] = s.now;
+                    }
+                }
+            }
+            break;
+        case 0x27:
+        case 0x28:
+            writePortC(address, value);
+            break;
+        case 0x35:
+        case 0x36:
+        case 0x37:
+        case 0x3b:
+            s.io[address] = old & ~value;
+            break;
+        case 0x3f:
+            writeEECR(value);
+            break;
+        case 0x7a:
+            writeADCSRA(value);
+            break;
+        case 0x81:
+            s.io[address] = value;
+            scheduleTimer1(0);
+            break;
+        case 0x84:
+            scheduleTimer1(value | (static_cast<uint16_t>(s.timer1High) << 8));
+            break;
+        case 0x85:
+            s.timer1High = value;
+            break;
+        case 0xb1:
+        case 0xb3:
+            s.io[address] = value;
+            s.timer2Next = timer2Period() ? s.now + timer2Period() : Never;
+            break;
+        case 0xb9:
+            s.io[address] = (old & 0xf8) | (value & 0x03);
+            break;
+        case 0xbc:
+            writeTWCR(value);
+            break;
+        case 0xc0: {
+            // The receive flags are read only
+            const uint8_t receive = _BV(RXC0) | _BV(FE0) | _BV(DOR0);
+            s.io[address] = (value & ~(_BV(TXC0) | _BV(UDRE0) | receive)) | (old & ~value & _BV(TXC0)) | (old & receive);
+            break;
+        }
+        case 0xc6:
+            writeUDR(value);
+            break;
+        default:
+            s.io[address] = value;
+            break;
+    }
+}
+
+uint8_t* eeprom() { return state().eeprom; }
+
+// ---------------------------------------------------------- CPU and board
+
+void sleep()
+{
+    State& s = state();
+    if (!(s.io[0x53] & _BV(SE))) {
+        return;
+    }
+    uint64_t start = s.now;
+    switch (s.io[0x53] & (_BV(SM0) | _BV(SM1) | _BV(SM2))) {
+        case SLEEP_MODE_IDLE:
+            if (!serviceInterrupts()) {
+                advance(Never, true, true);
+            }
+            s.stats.sleepCycles += s.now - start;
+            break;
+        case SLEEP_MODE_ADC:
+            if ((s.io[0x7a] & _BV(ADEN)) && !(s.io[0x7a] & _BV(ADSC))) {
+                startConversion(true);
+            }
+            if (!serviceInterrupts()) {
+                advance(Never, false, true);
+            }
+            s.stats.adcSleepCycles += s.now - start;
+            break;
+        default:
+            fail("unsupported sleep mode");
+    }
+}
+
+// On its own 128kHz oscillator, 2048 cycles for the shortest timeout
+void watchdogEnable(uint8_t timeout)
+{
+    State& s = state();
+    s.watchdogPeriod = (16000ULL * CyclesPerUs) << timeout;
+    s.watchdogDue = s.now + s.watchdogPeriod;
+}
+
+void watchdogDisable() { state().watchdogDue = Never; }
+
+void watchdogReset()
+{
+    State& s = state();
+    if (s.watchdogDue != Never) {
+        s.watchdogDue = s.now + s.watchdogPeriod;
+    }
+}
+
+void delayNs(uint64_t ns)
+{
+    runHardware((ns * CyclesPerUs + 999) / 1000);
+}
+
+uint64_t cycles() { return state().now; }
+
+void setAVCC(double milliVolts)
+{
+    state().avccMilliVolts = milliVolts;
+}
+
+void setInputs(const Inputs& inputs)
+{
+    state().inputs = inputs;
+    state().source = nullptr;
+}
+
+void setInputSource(const InputSource* source)
+{
+    state().source = source;
+    state().sourceStart = state().now;
+}
+
+void run(uint64_t cycles)
+{
+    State& s = state();
+    uint64_t end = s.now + cycles;
+    while (s.now < end) {
+        serviceInterrupts();
+        advance(s.now + PassCycles, true, false);
+        m8r::System::dispatchNextEvent();
+    }
+}
+
+void runHardware(uint64_t cycles)
+{
+    serviceInterrupts();
+    advance(state().now + cycles, true, false);
+}
+
+const char* lcdLine(uint8_t row)
+{
+    State& s = state();
+    for (uint8_t i = 0; i < 16; ++i) {
+        uint8_t c = s.lcdDDRAM[row * 40 + i];
+        s.lcdText[row][i] = (c < 8) ? '0' + c : (c == 0x7e) ? '>' : (c == 0x7f) ? '<' : (c < 0x20 || c > 0x7e) ? '?' : c;
+    }
+    s.lcdText[row][16] = '\0';
+    return s.lcdText[row];
+}
+
+void setButton(uint8_t button, bool down)
+{
+    State& s = state();
+    s.buttonsDown = down ? (s.buttonsDown | _BV(button)) : (s.buttonsDown & ~_BV(button));
+}
+
+bool shutdown(uint8_t supply) { return !supplyOn(supply); }
+
+uint64_t shutdownCycles(uint8_t supply) { return state().shutdownSince[supply]; }
+
+bool statusLED() { return reg(0x25) & _BV(StatusLEDBit); }
+
+std::vector<uint8_t>& serialOutput() { return state().serial; }
+
+void serialInput(const char* text)
+{
+    State& s = state();
+    bool idle = s.serialIn.empty();
+    while (*text) {
+        s.serialIn.push_back(*text++);
+    }
+    if (idle) {
+        startSerialIn();
+    }
+}
+
+void serialInputNoise()
+{
+    State& s = state();
+    s.serialIn.push_back(SerialInNoise);
+    if (s.serialIn.size() == 1) {
+        startSerialIn();
+    }
+}
+
+void holdSDA(uint8_t sensor, uint8_t clocks)
+{
+    State& s = state();
+    s.sdaHoldArmed = sensor;
+    s.sdaHoldClocks = clocks;
+}
+
+void releaseSDA()
+{
+    State& s = state();
+    s.sdaHoldArmed = -1;
+    if (s.sdaHeld) {
+        s.sdaHeld = false;
+        ++s.stats.sdaReleases;
+    }
+}
+
+const Stats& stats() { return state().stats; }
+
+void resetStats() { memset(&state().stats, 0, sizeof(Stats)); }
+
+}
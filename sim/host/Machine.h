@@ -0,0 +1,130 @@
+//
+//  Machine.h
+//
+//  Simulated ATmega328P and power supply board for host builds
+//
+
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+//
+// The app is built for the host against the register proxies in avr/io.h.
+// This models the peripherals it uses closely enough for its drivers to run
+// unchanged: Timer0 (event timers and the ADC trigger), Timer1, Timer2, the
+// ADC with its noise reduction sleep and the bandgap, the TWI with the two
+// INA219s at 0x40 and 0x41 and the bus pins when it's off, USART0, the
+// EEPROM, the HD44780 on its port pins, the shutdown pins that switch the
+// supplies off, and the three switches to ground on B0-B2, which read high
+// unless they're held down. The watchdog runs, but a timeout is only
+// counted: the app can't be reset.
+//
+// Time is counted in CPU cycles at F_CPU. Code takes no time, except that
+// each trip round the event loop costs PassCycles and busy waits
+// (_delay_us() and friends) take what they ask for; interrupt handlers run
+// in zero time. So simulated timing shows what the hardware and scheduling
+// allow, like the trip latency, and host timing of the app's functions shows
+// how much code they run. The I/O clock stops in ADC noise reduction sleep,
+// as on the chip: timers, TWI and USART slip while the ADC, the EEPROM, the
+// watchdog and the outside world carry on.
+//
+
+namespace sim {
+
+// What the outside world is doing. Supply values are before the shutdown
+// pins, which switch the supply's output off.
+struct Inputs
+{
+    double supplyMilliAmps[2];
+    double supplyMilliVolts[2];
+    double analogMilliVolts[4];
+};
+
+class InputSource {
+public:
+    virtual ~InputSource() { }
+
+    // ms is the time since the source was set
+    virtual Inputs at(double ms) const = 0;
+};
+
+struct Stats
+{
+    uint64_t sleepCycles;           // Idle sleep
+    uint64_t adcSleepCycles;        // ADC noise reduction sleep
+    uint32_t adcConversions;
+    uint32_t adcQuietConversions;   // Taken in ADC noise reduction sleep
+    uint32_t twiBytes;
+    uint32_t twiNacks;
+    uint32_t sdaHolds;              // Times a sensor started holding SDA low
+    uint32_t sdaReleases;
+    uint32_t serialBytes;
+    uint32_t eepromWrites;
+    uint32_t lcdWrites;
+    uint32_t interrupts;
+    uint64_t longestInterruptCycles;    // In one handler, from the delays in it
+    uint32_t shutdowns[2];          // Times each shutdown pin went high
+    uint64_t firstShutdownCycles[2];
+    uint32_t watchdogTimeouts;
+    uint64_t firstWatchdogTimeoutCycles;
+};
+
+const uint32_t CyclesPerUs = F_CPU / 1000000;
+const uint64_t PassCycles = 10 * CyclesPerUs;
+
+uint64_t cycles();
+inline double micros() { return static_cast<double>(cycles()) / CyclesPerUs; }
+
+// Fixed inputs, or a source sampled whenever a conversion needs them
+void setInputs(const Inputs&);
+void setInputSource(const InputSource*);
+
+// The ADC reference, 5000mV unless it's set. The internal bandgap is
+// 1100mV against it.
+void setAVCC(double milliVolts);
+
+// Runs the app's event loop for the given time
+void run(uint64_t cycles);
+inline void runMs(uint32_t ms) { run(static_cast<uint64_t>(ms) * 1000 * CyclesPerUs); }
+
+// Lets the hardware and interrupt handlers run with the event loop stopped
+void runHardware(uint64_t cycles);
+
+// The LCD as it reads now. CGRAM characters show as '0'-'7', the arrows as
+// '>' and '<'.
+const char* lcdLine(uint8_t row);
+
+// Holds a switch down, or lets it go. They don't bounce.
+void setButton(uint8_t button, bool down);
+
+// Shutdown pin state, and the time it last went high
+bool shutdown(uint8_t supply);
+uint64_t shutdownCycles(uint8_t supply);
+
+// The status LED, which is lit by a trip
+bool statusLED();
+
+std::vector<uint8_t>& serialOutput();
+
+// Makes a sensor hold SDA low from the next byte it's asked for, as one
+// that has lost track of the bus does, which hangs the TWI. It lets go once
+// SCL has been clocked the given number of times with the TWI off, or with
+// 0, only on releaseSDA().
+void holdSDA(uint8_t sensor, uint8_t clocks);
+void releaseSDA();
+
+// Queues bytes to come in on the serial port, back to back at its baud rate.
+// They're timed by the outside world, so one that comes in while the I/O
+// clock is stopped gets a framing error, and one that comes in before the
+// last has been read is lost to an overrun. The start bit of each sets the
+// pin change flag for RXD (PCINT16) if it's enabled, which wakes the CPU.
+void serialInput(const char* text);
+
+// Queues a byte that comes in with a framing error, as noise on the line would
+void serialInputNoise();
+
+const Stats& stats();
+void resetStats();
+
+}
@@ -0,0 +1,37 @@
+//
+//  System.h
+//
+//  m8r event loop services for the host simulation
+//
+
+#pragma once
+
+#include "EventListener.h"
+#include "TimerEventMgr.h"
+
+#include <util/delay.h>
+
+namespace m8r {
+
+class System {
+public:
+    static void startEventTimer(TimerEvent*);
+    static void stopEventTimer(TimerEvent*);
+
+    template<uint16_t ms>
+    static void msDelay() { sim::delayNs(static_cast<uint64_t>(ms) * 1000000); }
+
+    static void postEvent(EventType, EventParam = nullptr);
+
+    // Dispatches the oldest posted event, or EV_IDLE if there is none
+    static void dispatchNextEvent();
+
+    // Called by the simulated Timer0 with the current time
+    static void serviceTimers(uint32_t ms);
+
+    // Started timers in the order they were started, for scripts that need
+    // to fire one directly
+    static TimerEvent* timer(uint8_t index);
+};
+
+}
@@ -0,0 +1,17 @@
+//
+//  Timer0.h
+//
+//  m8r Timer0 for the host simulation
+//
+
+#pragma once
+
+#include "m8r.h"
+
+namespace m8r {
+
+class Timer0 { };
+
+enum TimerClock { TimerClockDIV1 = 1, TimerClockDIV8 = 2, TimerClockDIV64 = 3, TimerClockDIV256 = 4, TimerClockDIV1024 = 5 };
+
+}
@@ -0,0 +1,48 @@
+//
+//  TimerEventMgr.h
+//
+//  m8r timer events for the host simulation
+//
+
+#pragma once
+
+#include "m8r.h"
+
+//
+// Started timers are counted down in ms from the simulated Timer0 overflow
+// (System::serviceTimers()) and post EV_EVENT_TIMER with the timer as the
+// parameter.
+//
+
+namespace m8r {
+
+class TimerEvent {
+    friend class System;
+
+public:
+    TimerEvent(uint16_t intervalMs, bool repeating) : _intervalMs(intervalMs), _repeating(repeating) { }
+
+    uint16_t intervalMs() const { return _intervalMs; }
+
+private:
+    uint16_t _intervalMs;
+    bool _repeating;
+    bool _running = false;
+    uint32_t _dueMs = 0;
+};
+
+class RepeatingTimerEvent : public TimerEvent {
+public:
+    RepeatingTimerEvent(uint16_t intervalMs) : TimerEvent(intervalMs, true) { }
+};
+
+class OneShotTimerEvent : public TimerEvent {
+public:
+    OneShotTimerEvent(uint16_t intervalMs) : TimerEvent(intervalMs, false) { }
+};
+
+// The simulated Timer0 always runs, so there is nothing to set up
+template<typename Timer, int Prescale>
+class TimerEventMgr { };
+
+}
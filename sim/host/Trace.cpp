@@ -0,0 +1,109 @@
+//
+//  Trace.cpp
+//
+//  Scripted board inputs for the host simulation
+//
+
+#include "Trace.h"
+
+#include <stdio.h>
+#include <string.h>
+
+bool Trace::load(const char* path)
+{
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "%s: can't open\n", path);
+        return false;
+    }
+
+    const char* slash = strrchr(path, '/');
+    _name = slash ? slash + 1 : path;
+    _name = _name.substr(0, _name.rfind('.'));
+    _points.clear();
+    _expectTrip[0] = _expectTrip[1] = false;
+    _expectRecover[0] = _expectRecover[1] = false;
+
+    char line[256];
+    unsigned lineNumber = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), f)) {
+        ++lineNumber;
+        char* comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        char supply;
+        if (sscanf(line, " expect trip %c", &supply) == 1 && (supply == 'A' || supply == 'B')) {
+            _expectTrip[supply - 'A'] = true;
+            continue;
+        }
+        if (sscanf(line, " expect recover %c", &supply) == 1 && (supply == 'A' || supply == 'B')) {
+            _expectTrip[supply - 'A'] = true;
+            _expectRecover[supply - 'A'] = true;
+            continue;
+        }
+        char word[16];
+        if (sscanf(line, " %15s", word) != 1 || !strcmp(word, "expect")) {
+            continue;
+        }
+
+        Point p;
+        sim::Inputs& in = p.inputs;
+        int n = sscanf(line, "%lf %lf %lf %lf %lf %lf %lf %lf %lf", &p.ms,
+                       &in.supplyMilliAmps[0], &in.supplyMilliVolts[0], &in.supplyMilliAmps[1], &in.supplyMilliVolts[1],
+                       &in.analogMilliVolts[0], &in.analogMilliVolts[1], &in.analogMilliVolts[2], &in.analogMilliVolts[3]);
+        if (n != 9 || (!_points.empty() && p.ms < _points.back().ms)) {
+            fprintf(stderr, "%s:%u: expected 9 values, in time order\n", path, lineNumber);
+            ok = false;
+        }
+        _points.push_back(p);
+    }
+    fclose(f);
+    if (ok && _points.empty()) {
+        fprintf(stderr, "%s: no points\n", path);
+        ok = false;
+    }
+    return ok;
+}
+
+sim::Inputs Trace::at(double ms) const
+{
+    size_t i = 0;
+    while (i + 1 < _points.size() && _points[i + 1].ms <= ms) {
+        ++i;
+    }
+    if (i + 1 >= _points.size() || ms <= _points[i].ms) {
+        return _points[i].inputs;
+    }
+
+    const Point& a = _points[i];
+    const Point& b = _points[i + 1];
+    double f = (ms - a.ms) / (b.ms - a.ms);
+    sim::Inputs in;
+    for (uint8_t j = 0; j < 2; ++j) {
+        in.supplyMilliAmps[j] = a.inputs.supplyMilliAmps[j] + f * (b.inputs.supplyMilliAmps[j] - a.inputs.supplyMilliAmps[j]);
+        in.supplyMilliVolts[j] = a.inputs.supplyMilliVolts[j] + f * (b.inputs.supplyMilliVolts[j] - a.inputs.supplyMilliVolts[j]);
+    }
+    for (uint8_t j = 0; j < 4; ++j) {
+        in.analogMilliVolts[j] = a.inputs.analogMilliVolts[j] + f * (b.inputs.analogMilliVolts[j] - a.inputs.analogMilliVolts[j]);
+    }
+    return in;
+}
+
+double Trace::firstOverMs(uint8_t supply, double mA) const
+{
+    for (size_t i = 0; i < _points.size(); ++i) {
+        double current = _points[i].inputs.supplyMilliAmps[supply];
+        if (current <= mA) {
+            continue;
+        }
+        if (i == 0) {
+            return 0;
+        }
+        const Point& a = _points[i - 1];
+        double previous = a.inputs.supplyMilliAmps[supply];
+        return a.ms + (_points[i].ms - a.ms) * (mA - previous) / (current - previous);
+    }
+    return -1;
+}
@@ -0,0 +1,51 @@
+//
+//  Trace.h
+//
+//  Scripted board inputs for the host simulation
+//
+
+#pragma once
+
+#include "Machine.h"
+
+#include <string>
+#include <vector>
+
+//
+// A trace file has one point per line:
+//
+//  t_ms  a_mA a_mV  b_mA b_mV  in0_mV in1_mV in2_mV in3_mV
+//
+// with the inputs interpolated linearly between points and held after the
+// last one. Two points at the same time make a step. '#' starts a comment.
+// A line 'expect none', 'expect trip A' or 'expect trip B' says which
+// supplies should shut down during the trace. 'expect recover A' (or B)
+// says it should trip and then be back on by the end.
+//
+
+class Trace : public sim::InputSource {
+public:
+    bool load(const char* path);
+
+    virtual sim::Inputs at(double ms) const override;
+
+    const std::string& name() const { return _name; }
+    double durationMs() const { return _points.empty() ? 0 : _points.back().ms; }
+    bool expectTrip(uint8_t supply) const { return _expectTrip[supply]; }
+    bool expectRecover(uint8_t supply) const { return _expectRecover[supply]; }
+
+    // When the supply's current first goes over mA, or a negative value
+    double firstOverMs(uint8_t supply, double mA) const;
+
+private:
+    struct Point
+    {
+        double ms;
+        sim::Inputs inputs;
+    };
+
+    std::string _name;
+    std::vector<Point> _points;
+    bool _expectTrip[2] = { false, false };
+    bool _expectRecover[2] = { false, false };
+};
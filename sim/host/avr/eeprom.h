@@ -0,0 +1,31 @@
+//
+//  eeprom.h
+//
+//  EEPROM access for the host simulation
+//
+
+#pragma once
+
+#include <stdint.h>
+#include <avr/io.h>
+
+namespace sim {
+
+uint8_t* eeprom();
+
+}
+
+#define EEMEM
+
+inline uint8_t eeprom_read_byte(const uint8_t* address)
+{
+    return sim::eeprom()[reinterpret_cast<uintptr_t>(address) & E2END];
+}
+
+inline void eeprom_read_block(void* destination, const void* source, uint16_t size)
+{
+    uint8_t* p = static_cast<uint8_t*>(destination);
+    for (uint16_t i = 0; i < size; ++i) {
+        p[i] = sim::eeprom()[(reinterpret_cast<uintptr_t>(source) + i) & E2END];
+    }
+}
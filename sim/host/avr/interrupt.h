@@ -0,0 +1,19 @@
+//
+//  interrupt.h
+//
+//  Interrupt control for the host simulation
+//
+
+#pragma once
+
+#include <avr/io.h>
+
+//
+// Only the I bit in SREG is kept. The simulator runs interrupt handlers
+// between idle passes, in sleep and in delays, whenever it is set.
+//
+
+#define sei() (SREG |= 0x80)
+#define cli() (SREG &= 0x7f)
+
+#define ISR(vector) extern "C" void vector(void); extern "C" void vector(void)
@@ -0,0 +1,216 @@
+//
+//  io.h
+//
+//  ATmega328P registers for the host simulation
+//
+
+#pragma once
+
+#include <stdint.h>
+
+//
+// Every register is a proxy for its data memory address. Reads and writes go
+// through sim::readRegister() and sim::writeRegister(), so the peripheral
+// models in Machine.cpp see each access, e.g. a TWCR write starts a bus
+// operation and a TCNT1 read returns the count for the current simulated
+// time. Registers nothing models just hold their value.
+//
+
+namespace sim {
+
+uint8_t readRegister(uint8_t address);
+void writeRegister(uint8_t address, uint8_t value);
+
+template<uint8_t Address>
+struct Register
+{
+    operator uint8_t() const { return readRegister(Address); }
+    Register& operator=(uint8_t value) { writeRegister(Address, value); return *this; }
+    Register& operator|=(uint8_t bits) { return *this = readRegister(Address) | bits; }
+    Register& operator&=(uint8_t bits) { return *this = readRegister(Address) & bits; }
+    Register& operator^=(uint8_t bits) { return *this = readRegister(Address) ^ bits; }
+};
+
+// Low byte first, the order the AVR wants for 16 bit writes
+template<uint8_t Address>
+struct Register16
+{
+    operator uint16_t() const
+    {
+        uint8_t low = readRegister(Address);
+        return low | (static_cast<uint16_t>(readRegister(Address + 1)) << 8);
+    }
+    Register16& operator=(uint16_t value)
+    {
+        writeRegister(Address + 1, value >> 8);
+        writeRegister(Address, value);
+        return *this;
+    }
+};
+
+}
+
+#define PINB sim::Register<0x23>()
+#define DDRB sim::Register<0x24>()
+#define PORTB sim::Register<0x25>()
+#define PINC sim::Register<0x26>()
+#define DDRC sim::Register<0x27>()
+#define PORTC sim::Register<0x28>()
+#define PIND sim::Register<0x29>()
+#define DDRD sim::Register<0x2a>()
+#define PORTD sim::Register<0x2b>()
+#define TIFR0 sim::Register<0x35>()
+#define TIFR1 sim::Register<0x36>()
+#define TIFR2 sim::Register<0x37>()
+#define PCIFR sim::Register<0x3b>()
+#define GPIOR0 sim::Register<0x3e>()
+#define EECR sim::Register<0x3f>()
+#define EEDR sim::Register<0x40>()
+#define EEAR sim::Register16<0x41>()
+#define SMCR sim::Register<0x53>()
+#define MCUSR sim::Register<0x54>()
+#define SP sim::Register16<0x5d>()
+#define SREG sim::Register<0x5f>()
+#define WDTCSR sim::Register<0x60>()
+#define PCICR sim::Register<0x68>()
+#define PCMSK2 sim::Register<0x6d>()
+#define TIMSK0 sim::Register<0x6e>()
+#define TIMSK1 sim::Register<0x6f>()
+#define TIMSK2 sim::Register<0x70>()
+#define ADCW sim::Register16<0x78>()
+#define ADC sim::Register16<0x78>()
+#define ADCSRA sim::Register<0x7a>()
+#define ADCSRB sim::Register<0x7b>()
+#define ADMUX sim::Register<0x7c>()
+#define DIDR0 sim::Register<0x7e>()
+#define TCCR1A sim::Register<0x80>()
+#define TCCR1B sim::Register<0x81>()
+#define TCNT1 sim::Register16<0x84>()
+#define OCR1A sim::Register16<0x88>()
+#define TCCR2A sim::Register<0xb0>()
+#define TCCR2B sim::Register<0xb1>()
+#define TCNT2 sim::Register<0xb2>()
+#define OCR2A sim::Register<0xb3>()
+#define TWBR sim::Register<0xb8>()
+#define TWSR sim::Register<0xb9>()
+#define TWAR sim::Register<0xba>()
+#define TWDR sim::Register<0xbb>()
+#define TWCR sim::Register<0xbc>()
+#define UCSR0A sim::Register<0xc0>()
+#define UCSR0B sim::Register<0xc1>()
+#define UCSR0C sim::Register<0xc2>()
+#define UBRR0 sim::Register16<0xc4>()
+#define UDR0 sim::Register<0xc6>()
+
+// ADCSRA, ADCSRB, ADMUX
+#define ADPS0 0
+#define ADPS1 1
+#define ADPS2 2
+#define ADIE 3
+#define ADIF 4
+#define ADATE 5
+#define ADSC 6
+#define ADEN 7
+#define ADTS0 0
+#define ADTS1 1
+#define ADTS2 2
+#define MUX0 0
+#define MUX1 1
+#define MUX2 2
+#define MUX3 3
+#define ADLAR 5
+#define REFS0 6
+#define REFS1 7
+
+// TWCR
+#define TWIE 0
+#define TWEN 2
+#define TWWC 3
+#define TWSTO 4
+#define TWSTA 5
+#define TWEA 6
+#define TWINT 7
+#define TWPS0 0
+#define TWPS1 1
+
+// Timers
+#define TOV0 0
+#define CS10 0
+#define CS11 1
+#define CS12 2
+#define WGM12 3
+#define TOIE1 0
+#define TOV1 0
+#define CS20 0
+#define CS21 1
+#define CS22 2
+#define WGM21 1
+#define OCIE2A 1
+#define OCF2A 1
+
+// USART0
+#define MPCM0 0
+#define U2X0 1
+#define UPE0 2
+#define DOR0 3
+#define FE0 4
+#define UDRE0 5
+#define TXC0 6
+#define RXC0 7
+#define TXB80 0
+#define RXB80 1
+#define UCSZ02 2
+#define TXEN0 3
+#define RXEN0 4
+#define UDRIE0 5
+#define TXCIE0 6
+#define RXCIE0 7
+#define UCSZ00 1
+#define UCSZ01 2
+
+// PCICR, PCIFR, PCMSK2
+#define PCIE2 2
+#define PCIF2 2
+#define PCINT16 0
+
+// EECR, SMCR, MCUSR, WDTCSR
+#define EERE 0
+#define EEPE 1
+#define EEMPE 2
+#define EERIE 3
+#define SE 0
+#define SM0 1
+#define SM1 2
+#define SM2 3
+#define PORF 0
+#define EXTRF 1
+#define BORF 2
+#define WDRF 3
+#define WDP0 0
+#define WDP1 1
+#define WDP2 2
+#define WDE 3
+#define WDCE 4
+#define WDP3 5
+#define WDIE 6
+#define WDIF 7
+
+#define E2END 0x3ff
+#define RAMSTART 0x100
+#define RAMEND 0x8ff
+
+#define _BV(bit) (1 << (bit))
+#define bit_is_set(sfr, bit) ((sfr) & _BV(bit))
+#define bit_is_clear(sfr, bit) (!((sfr) & _BV(bit)))
+
+// Vector numbers as in avr-libc. ISR() defines the same extern "C" names,
+// which Machine.cpp calls.
+#define PCINT2_vect __vector_5
+#define WDT_vect __vector_6
+#define TIMER2_COMPA_vect __vector_7
+#define TIMER1_OVF_vect __vector_13
+#define USART_RX_vect __vector_18
+#define USART_UDRE_vect __vector_19
+#define ADC_vect __vector_21
+#define EE_READY_vect __vector_22
+#define TWI_vect __vector_24
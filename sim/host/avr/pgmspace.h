@@ -0,0 +1,30 @@
+//
+//  pgmspace.h
+//
+//  Program memory access for the host simulation
+//
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+//
+// Flash and RAM are the same address space on the host. pgm_read_ptr() reads
+// a whole host pointer, so tables of pointers have to use it rather than
+// pgm_read_word().
+//
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define PGM_P const char*
+
+#define pgm_read_byte(address) (*reinterpret_cast<const uint8_t*>(address))
+#define pgm_read_word(address) (*reinterpret_cast<const uint16_t*>(address))
+#define pgm_read_dword(address) (*reinterpret_cast<const uint32_t*>(address))
+#define pgm_read_ptr(address) (*(void* const*)(address))
+
+#define memcpy_P memcpy
+#define strlen_P strlen
+#define strcmp_P strcmp
+#define strncmp_P strncmp
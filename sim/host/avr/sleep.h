@@ -0,0 +1,25 @@
+//
+//  sleep.h
+//
+//  Sleep modes for the host simulation
+//
+
+#pragma once
+
+#include <avr/io.h>
+
+namespace sim {
+
+// Runs the simulation until an interrupt wakes the CPU, see Machine.cpp
+void sleep();
+
+}
+
+#define SLEEP_MODE_IDLE 0
+#define SLEEP_MODE_ADC _BV(SM0)
+#define SLEEP_MODE_PWR_DOWN _BV(SM1)
+
+#define set_sleep_mode(mode) (SMCR = (SMCR & ~(_BV(SM0) | _BV(SM1) | _BV(SM2))) | (mode))
+#define sleep_enable() (SMCR |= _BV(SE))
+#define sleep_disable() (SMCR &= ~_BV(SE))
+#define sleep_cpu() sim::sleep()
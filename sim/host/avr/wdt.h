@@ -0,0 +1,33 @@
+//
+//  wdt.h
+//
+//  Watchdog timer for the host simulation
+//
+
+#pragma once
+
+#include <stdint.h>
+
+namespace sim {
+
+// See Machine.cpp. A timeout is counted, it doesn't reset the app.
+void watchdogEnable(uint8_t timeout);
+void watchdogDisable();
+void watchdogReset();
+
+}
+
+#define WDTO_15MS 0
+#define WDTO_30MS 1
+#define WDTO_60MS 2
+#define WDTO_120MS 3
+#define WDTO_250MS 4
+#define WDTO_500MS 5
+#define WDTO_1S 6
+#define WDTO_2S 7
+#define WDTO_4S 8
+#define WDTO_8S 9
+
+#define wdt_enable(timeout) sim::watchdogEnable(timeout)
+#define wdt_disable() sim::watchdogDisable()
+#define wdt_reset() sim::watchdogReset()
@@ -0,0 +1,113 @@
+//
+//  m8r.cpp
+//
+//  m8r event dispatch and timers for the host simulation
+//
+
+#include "System.h"
+
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+namespace m8r {
+
+namespace {
+
+struct Posted
+{
+    EventType type;
+    EventParam param;
+};
+
+// Function local, like the machine state, so listeners constructed during
+// static initialization can register
+std::vector<EventListener*>& listeners()
+{
+    static std::vector<EventListener*> list;
+    return list;
+}
+
+std::vector<TimerEvent*>& timers()
+{
+    static std::vector<TimerEvent*> list;
+    return list;
+}
+
+std::deque<Posted>& events()
+{
+    static std::deque<Posted> queue;
+    return queue;
+}
+
+uint32_t g_ms = 0;
+
+}
+
+EventListener::EventListener() { listeners().push_back(this); }
+
+EventListener::~EventListener()
+{
+    std::vector<EventListener*>& list = listeners();
+    list.erase(std::remove(list.begin(), list.end(), this), list.end());
+}
+
+void EventListener::dispatch(EventType type, EventParam param)
+{
+    for (EventListener* listener : listeners()) {
+        listener->handleEvent(type, param);
+    }
+}
+
+void System::startEventTimer(TimerEvent* timer)
+{
+    timer->_dueMs = g_ms + timer->_intervalMs;
+    if (!timer->_running) {
+        timer->_running = true;
+        timers().push_back(timer);
+    }
+}
+
+void System::stopEventTimer(TimerEvent* timer)
+{
+    timer->_running = false;
+    std::vector<TimerEvent*>& list = timers();
+    list.erase(std::remove(list.begin(), list.end(), timer), list.end());
+}
+
+void System::postEvent(EventType type, EventParam param) { events().push_back({ type, param }); }
+
+void System::dispatchNextEvent()
+{
+    if (events().empty()) {
+        EventListener::dispatch(EV_IDLE, nullptr);
+        return;
+    }
+    Posted event = events().front();
+    events().pop_front();
+    EventListener::dispatch(event.type, event.param);
+}
+
+void System::serviceTimers(uint32_t ms)
+{
+    g_ms = ms;
+    std::vector<TimerEvent*> list = timers();
+    for (TimerEvent* timer : list) {
+        if (static_cast<int32_t>(ms - timer->_dueMs) < 0) {
+            continue;
+        }
+        postEvent(EV_EVENT_TIMER, timer);
+        if (timer->_repeating) {
+            timer->_dueMs += timer->_intervalMs;
+            if (static_cast<int32_t>(ms - timer->_dueMs) >= 0) {
+                timer->_dueMs = ms + timer->_intervalMs;
+            }
+        } else {
+            stopEventTimer(timer);
+        }
+    }
+}
+
+TimerEvent* System::timer(uint8_t index) { return (index < timers().size()) ? timers()[index] : nullptr; }
+
+}
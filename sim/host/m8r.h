@@ -0,0 +1,67 @@
+//
+//  m8r.h
+//
+//  The parts of the m8r library the app uses, for the host simulation
+//
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+
+//
+// Just enough of the library's interface for AVRPowerSupply.cpp to build
+// unchanged. Port bits go through the simulated port registers, so the
+// machine sees the LCD, shutdown and LED pins move.
+//
+
+namespace m8r {
+
+class _FlashString;
+#define FS(s) (reinterpret_cast<const m8r::_FlashString*>(PSTR(s)))
+
+enum ErrorConditionType { ErrorConditionNote, ErrorConditionWarning, ErrorConditionFatal };
+
+class ErrorReporter {
+public:
+    virtual ~ErrorReporter() { }
+    virtual void reportError(char, uint32_t, ErrorConditionType) = 0;
+};
+
+struct B { static const uint8_t PinAddress = 0x23; };
+struct C { static const uint8_t PinAddress = 0x26; };
+struct D { static const uint8_t PinAddress = 0x29; };
+
+template<typename P>
+struct Port
+{
+    static const uint8_t PinAddress = P::PinAddress;
+
+    static uint8_t pin() { return sim::readRegister(PinAddress); }
+    static void setBit(uint8_t address, uint8_t bit, bool value)
+    {
+        uint8_t v = sim::readRegister(address);
+        sim::writeRegister(address, value ? (v | _BV(bit)) : (v & ~_BV(bit)));
+    }
+};
+
+template<typename P, uint8_t Bit>
+class OutputBit {
+public:
+    OutputBit() { P::setBit(P::PinAddress + 1, Bit, true); }
+    OutputBit& operator=(bool value) { P::setBit(P::PinAddress + 2, Bit, value); return *this; }
+    operator bool() const { return sim::readRegister(P::PinAddress + 2) & _BV(Bit); }
+};
+
+template<typename P, uint8_t Bit>
+class DynamicInputBit {
+public:
+    DynamicInputBit() { Port<P>::setBit(P::PinAddress + 1, Bit, false); }
+    operator bool() const { return Port<P>::pin() & _BV(Bit); }
+};
+
+}
@@ -0,0 +1,43 @@
+//
+//  atomic.h
+//
+//  ATOMIC_BLOCK for the host simulation
+//
+
+#pragma once
+
+#include <avr/interrupt.h>
+
+//
+// Like avr-libc the state is put back on every way out of the block,
+// including return, here by a destructor instead of the cleanup attribute.
+//
+
+#define ATOMIC_RESTORESTATE 0
+#define ATOMIC_FORCEON 1
+
+namespace sim {
+
+class AtomicGuard {
+public:
+    AtomicGuard(uint8_t type) : _type(type), _sreg(SREG) { cli(); }
+    ~AtomicGuard()
+    {
+        if (_type == ATOMIC_FORCEON) {
+            sei();
+        } else {
+            SREG = _sreg;
+        }
+    }
+
+    bool once() { bool first = _first; _first = false; return first; }
+
+private:
+    uint8_t _type;
+    uint8_t _sreg;
+    bool _first = true;
+};
+
+}
+
+#define ATOMIC_BLOCK(type) for (sim::AtomicGuard _atomicGuard(type); _atomicGuard.once(); )
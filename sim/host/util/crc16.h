@@ -0,0 +1,29 @@
+//
+//  crc16.h
+//
+//  avr-libc CRC routines for the host simulation
+//
+
+#pragma once
+
+#include <stdint.h>
+
+// Same results as the avr-libc inline assembler versions
+
+inline uint16_t _crc16_update(uint16_t crc, uint8_t a)
+{
+    crc ^= a;
+    for (uint8_t i = 0; i < 8; ++i) {
+        crc = (crc & 1) ? (crc >> 1) ^ 0xa001 : (crc >> 1);
+    }
+    return crc;
+}
+
+inline uint8_t _crc8_ccitt_update(uint8_t crc, uint8_t data)
+{
+    crc ^= data;
+    for (uint8_t i = 0; i < 8; ++i) {
+        crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+    }
+    return crc;
+}
@@ -0,0 +1,19 @@
+//
+//  delay.h
+//
+//  Busy waits for the host simulation
+//
+
+#pragma once
+
+#include <stdint.h>
+
+namespace sim {
+
+// Runs the simulation for the time the CPU would spin, interrupts included
+void delayNs(uint64_t ns);
+
+}
+
+inline void _delay_us(double us) { sim::delayNs(static_cast<uint64_t>(us * 1000)); }
+inline void _delay_ms(double ms) { sim::delayNs(static_cast<uint64_t>(ms * 1000000)); }